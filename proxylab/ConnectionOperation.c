@@ -11,12 +11,30 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <string.h>
 
 #include "dlist.h"
 #include "typedef.h"
 #include "csapp.h"
+#include "http.h"
+#include "gzip.h"
 
+/* Chunks of a large object or a fill sent by one writev */
+#define WRITE_IOVS 16
+/* The head of an object in a file: the stored one up to the patch point,
+   then the hop headers */
+#define HEAD_IOVS 2
+
+/* Hosts that failed to connect recently, by hash of "host:port" */
+#define UNREACHABLE_HOSTS 64
+
+static struct {
+    unsigned int hash;
+    time_t until;
+} unreachable[UNREACHABLE_HOSTS];
+static pthread_mutex_t unreachable_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /* little helper function */
 static int compare(void *iter, void *ctx)
@@ -32,9 +50,25 @@ static void free_connection(void *ctx, void *connection)
     struct connection* conn = (struct connection *)connection;
     if (conn)
     {
-        close(conn->fd);
         if (conn->pair)
             conn->pair->pair = NULL;
+        release_object(conn->obj);
+        release_object(conn->stale);
+        if (conn->fill)
+        {
+            /* The fetch did not complete, fail its waiters */
+            if (conn->refresh)
+                count_refresh(REFRESH_FAILED);
+            fill_finish(conn->fill, 0);
+            fill_release(conn->fill);
+        }
+        if (conn->follow)
+        {
+            fill_remove_waiter(conn->follow, conn->fd);
+            fill_release(conn->follow);
+        }
+        close(conn->fd);
+        free(conn->request);
         free(conn);
     } 
 }
@@ -177,6 +211,18 @@ void* make_connection(int fd)
         conn->fd = fd;
         conn->size = 0;
         conn->first = conn->last = 0;
+        conn->obj = NULL;
+        memset(&conn->obj_cursor, 0, sizeof(conn->obj_cursor));
+        conn->fill = NULL;
+        conn->follow = NULL;
+        memset(&conn->cursor, 0, sizeof(conn->cursor));
+        conn->stale = NULL;
+        conn->refresh = 0;
+        conn->gzip = 0;
+        conn->hash = 0;
+        conn->url[0] = '\0';
+        conn->request = NULL;
+        conn->request_len = 0;
         conn->pair = NULL;
         return conn;
     }
@@ -231,6 +277,497 @@ static int parse_url(const char *request, char *hostname, char *uri, char *port)
     return -1;
 }
 
+/*
+ * host_hash - return the hash of the server of url in the unreachable
+ *             table, or 0 if the url is malformed.
+ */
+static unsigned int host_hash(const char *url)
+{
+    char hostname[64];
+    char port[16];
+    char uri[HTTP_URL_LEN];
+    char host[96];
+
+    if (parse_url(url, hostname, uri, port) == -1)
+        return 0;
+    snprintf(host, sizeof(host), "%s:%s", hostname, port);
+    return cache_hash(host) | 1;
+}
+
+/*
+ * host_unreachable - return 1 if connecting to the host of hash failed less
+ *                    than HTTP_NEGATIVE_TTL seconds ago.
+ */
+static int host_unreachable(unsigned int hash)
+{
+    int found;
+
+    pthread_mutex_lock(&unreachable_mtx);
+    found = unreachable[hash % UNREACHABLE_HOSTS].hash == hash &&
+            unreachable[hash % UNREACHABLE_HOSTS].until > time(NULL);
+    pthread_mutex_unlock(&unreachable_mtx);
+    return found;
+}
+
+/*
+ * set_unreachable - Remember that connecting to the host of hash failed, so
+ *                   the next requests to it don't block on it again.
+ */
+static void set_unreachable(unsigned int hash)
+{
+    pthread_mutex_lock(&unreachable_mtx);
+    unreachable[hash % UNREACHABLE_HOSTS].hash = hash;
+    unreachable[hash % UNREACHABLE_HOSTS].until = time(NULL) + HTTP_NEGATIVE_TTL;
+    pthread_mutex_unlock(&unreachable_mtx);
+}
+
+/*
+ * serve_from_cache - Send a pinned cache object to the client. The object is
+ *                    written straight from the cache with its hop headers
+ *                    patched in, decoded first if the cache gzip encoded it
+ *                    and the client does not accept it, and released by
+ *                    write_to_connection once it is fully sent.
+ */
+static int serve_from_cache(struct connection *conn, struct object *obj, int epfd)
+{
+    struct epoll_event ev;
+
+    if ((obj = negotiate_object(obj, conn->gzip)) == NULL)
+        return -1;
+    conn->obj = obj;
+    open_object(obj, &conn->obj_cursor);
+    /* The whole response is in the object, close after sending it */
+    conn->state = HALF_FINISH_CONNECTION;
+
+    ev.data.fd = conn->fd;
+    ev.events = EPOLLIN | EPOLLOUT;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * serve_reply - Send the len bytes of the response the proxy wrote in the
+ *               buffer of conn itself, then close.
+ */
+static int serve_reply(struct connection *conn, int len, int epfd)
+{
+    struct epoll_event ev;
+
+    conn->first = 0;
+    conn->size = len;
+    conn->last = len;
+    conn->state = HALF_FINISH_CONNECTION;
+
+    ev.data.fd = conn->fd;
+    ev.events = EPOLLIN | EPOLLOUT;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * serve_unreachable - The server of url could not be connected to. Answer
+ *                     502, and cache it briefly under key so the next
+ *                     requests of url get it at once. Return -1 if the
+ *                     fetch failed for another reason.
+ */
+static int serve_unreachable(struct connection *conn, const char *url,
+                             const char *key, unsigned int hash, int epfd)
+{
+    static const char body[] = "The server can't be reached\n";
+    int n;
+
+    if (!host_unreachable(host_hash(url)))
+        return -1;
+    n = snprintf(conn->data, MAX_OBJECT_SIZE,
+                 "HTTP/1.0 502 Bad Gateway\r\nContent-Type: text/plain\r\n"
+                 "Cache-Control: max-age=%d\r\nContent-Length: %d\r\n\r\n%s",
+                 HTTP_NEGATIVE_TTL, (int)sizeof(body) - 1, body);
+    if (key[0])
+        insert_in_cache(key, hash, conn->data, n);
+    return serve_reply(conn, n, epfd);
+}
+
+/*
+ * local_peer - return 1 if the client of fd connects from the loopback.
+ */
+static int local_peer(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) == -1)
+        return 0;
+    if (addr.ss_family == AF_INET)
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    return addr.ss_family == AF_INET6 &&
+           (IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr) ||
+            (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) &&
+             in6->sin6_addr.s6_addr[12] == 127));
+}
+
+/*
+ * serve_purge - Answer a PURGE request from the loopback. A Surrogate-Key
+ *               header purges the responses with that tag, a url ending in
+ *               '*' every key starting with the rest, any other url its
+ *               responses. The reply tells the number of objects removed.
+ */
+static int serve_purge(struct connection *conn, const char *url,
+                       const char *request, int len, int epfd)
+{
+    char pattern[MAX_REQUEST];
+    char prefix[HTTP_URL_LEN];
+    char body[64];
+    int n;
+    long purged = -1;
+
+    if (!local_peer(conn->fd))
+        n = snprintf(conn->data, MAX_OBJECT_SIZE,
+                     "HTTP/1.0 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+    else
+    {
+        if (http_header(request, len, "Surrogate-Key", pattern,
+                        sizeof(pattern)) >= 0)
+            purged = purge_cache(PURGE_TAG, pattern);
+        else if ((n = strlen(url)) > 0 && url[n - 1] == '*')
+        {
+            /* url is bounded by HTTP_URL_LEN */
+            memcpy(prefix, url, n - 1);
+            prefix[n - 1] = '\0';
+            if (http_canonical_url(prefix, pattern, sizeof(pattern)) >= 0)
+                purged = purge_cache(PURGE_PREFIX, pattern);
+        }
+        else if (http_canonical_url(url, pattern, sizeof(pattern)) >= 0)
+            purged = purge_cache(PURGE_URL, pattern);
+
+        if (purged < 0)
+            n = snprintf(conn->data, MAX_OBJECT_SIZE,
+                         "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+        else
+        {
+            snprintf(body, sizeof(body), "purged %ld\n", purged);
+            n = snprintf(conn->data, MAX_OBJECT_SIZE,
+                         "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                         "Content-Length: %d\r\n\r\n%s",
+                         (int)strlen(body), body);
+        }
+    }
+    return serve_reply(conn, n, epfd);
+}
+
+/*
+ * start_fill - Feed the response read from the server connection to fill, so
+ *              waiting clients get it and it can be inserted in the cache
+ *              when the server closes the connection. The request buffered
+ *              for the server is kept, the key of a response that varies
+ *              depends on it.
+ */
+static void start_fill(struct connection *conn, struct fill *fill,
+                       const char *key, unsigned int hash)
+{
+    conn->fill = fill;
+    conn->hash = hash;
+    strcpy(conn->url, key);
+    if ((conn->request = malloc(conn->size)) != NULL)
+    {
+        memcpy(conn->request, conn->data + conn->first, conn->size);
+        conn->request_len = conn->size;
+    }
+}
+
+/*
+ * response_key - Set key to the key the response of the fill of conn is
+ *                stored under, and hash to its hash. A response that
+ *                varies goes under the secondary key of the request, and
+ *                the url gets a Vary marker. Return 0 if success, or -1 if
+ *                the response can't be stored.
+ */
+static int response_key(struct connection *conn, const char *head, int len,
+                        char *key, unsigned int *hash)
+{
+    char vary[HTTP_VALIDATOR_LEN];
+    int n, url_len;
+
+    strcpy(key, conn->url);
+    *hash = conn->hash;
+    if (http_header(head, len, "Vary", vary, sizeof(vary)) < 0)
+        return 0;
+
+    /* The fill may be keyed by the url only, the first time */
+    url_len = strcspn(key, "\n");
+    if (conn->request == NULL ||
+        (n = http_variant_key(vary, conn->request, conn->request_len, key,
+                              url_len, MAX_REQUEST)) < 0)
+        return -1;
+    key[url_len] = '\0';
+    insert_vary_in_cache(key, cache_hash(key), vary);
+    key[url_len] = '\n';
+    *hash = cache_hash(key);
+    return 0;
+}
+
+/*
+ * search_request - Search the cache for the response to the GET request of
+ *                  url. key is set to its cache key, and hash to its hash:
+ *                  the canonical url, and the secondary key of the request
+ *                  if the responses of the url vary. key is empty if the
+ *                  request can't be cached. The L1 table of the thread is
+ *                  searched first. Return the object pinned, or NULL if
+ *                  not found.
+ */
+static struct object *search_request(const char *url, const char *request,
+                                     int len, char *key, unsigned int *hash)
+{
+    struct object *obj;
+    const char *vary;
+    int n;
+
+    if ((n = http_canonical_url(url, key, MAX_REQUEST)) < 0)
+    {
+        key[0] = '\0';
+        return NULL;
+    }
+    *hash = cache_hash(key);
+    if ((obj = search_in_cache_local(key, *hash)) == NULL ||
+        (vary = get_object_vary(obj)) == NULL)
+        return obj;
+
+    n = http_variant_key(vary, request, len, key, n, MAX_REQUEST);
+    release_object(obj);
+    if (n < 0)
+    {
+        key[0] = '\0';
+        return NULL;
+    }
+    *hash = cache_hash(key);
+    return search_in_cache_local(key, *hash);
+}
+
+/*
+ * feed_fill - Append response bytes read from the server to the fill of
+ *             conn. Once the whole head is in, the waiters are let through
+ *             if the response may be shared, or told to fetch it on their
+ *             own. A head that doesn't fit the first chunk is not shared.
+ */
+static void feed_fill(struct connection *conn, const char *buf, int len)
+{
+    struct cache_chunk *chunk;
+
+    if (!conn->fill)
+        return;
+    fill_append(conn->fill, buf, len);
+    if (!fill_held(conn->fill))
+        return;
+    chunk = fill_chunks(conn->fill);
+    if (chunk && chunk->len < CACHE_CHUNK_SIZE &&
+        http_body_offset(chunk->data, chunk->len) < 0)
+        return;
+    fill_share(conn->fill, chunk && http_shareable(chunk->data, chunk->len));
+}
+
+/*
+ * abort_fill - The response is incomplete, fail the waiters of the fill.
+ */
+static void abort_fill(struct connection *conn)
+{
+    if (!conn->fill)
+        return;
+    if (conn->refresh)
+        count_refresh(REFRESH_FAILED);
+    fill_finish(conn->fill, 0);
+    fill_release(conn->fill);
+    conn->fill = NULL;
+}
+
+/*
+ * storable_response - Return 1 if the response read on conn is cached. A
+ *                     server error answering a background refresh is not,
+ *                     the stale object is served until its grace ends.
+ */
+static int storable_response(struct connection *conn, const char *buf, int len)
+{
+    return http_storable(buf, len) &&
+           !(conn->refresh && http_status(buf, len) >= 500);
+}
+
+/*
+ * finish_fill - The server closed the connection cleanly, the fill holds
+ *               the whole response. Insert it in the cache if it is storable
+ *               and fits, in place of the stale version if any, then let
+ *               the waiters send the rest. A large response is inserted as
+ *               the chunks of the fill, without copying it.
+ */
+static void finish_fill(struct connection *conn)
+{
+    struct cache_chunk *chunks;
+    struct object *obj;
+    char key[MAX_REQUEST];
+    unsigned int hash;
+    char *buf;
+    int len;
+    int stored = 0;
+
+    if (!conn->fill)
+        return;
+    if (fill_length(conn->fill) > MAX_OBJECT_SIZE)
+    {
+        chunks = fill_chunks(conn->fill);
+        if (chunks && storable_response(conn, chunks->data, chunks->len) &&
+            response_key(conn, chunks->data, chunks->len, key, &hash) == 0 &&
+            insert_chunks_in_cache(key, hash, chunks,
+                                   fill_length(conn->fill), &obj) == 0)
+        {
+            fill_attach_object(conn->fill, obj);
+            stored = 1;
+        }
+    }
+    else if ((buf = malloc(MAX_OBJECT_SIZE)) != NULL)
+    {
+        len = fill_copy(conn->fill, buf, MAX_OBJECT_SIZE);
+        if (storable_response(conn, buf, len) &&
+            response_key(conn, buf, len, key, &hash) == 0)
+            stored = insert_in_cache(key, hash, buf, len) == 0;
+        free(buf);
+    }
+    if (conn->refresh)
+        count_refresh(stored ? REFRESH_REPLACED : REFRESH_FAILED);
+    fill_finish(conn->fill, 1);
+    fill_release(conn->fill);
+    conn->fill = NULL;
+}
+
+/*
+ * fill_from_object - Complete the fill with the content of obj, for the
+ *                    requests that joined it during a revalidation. They
+ *                    may not accept gzip, so it is decoded if needed. An
+ *                    object that varies is not theirs, they fetch their own.
+ */
+static void fill_from_object(struct fill *fill, struct object *obj)
+{
+    struct object_cursor cursor;
+    struct iovec iov[WRITE_IOVS];
+    const char *head;
+    int i, n, shared;
+
+    if ((obj = negotiate_object(pin_object(obj), 0)) == NULL)
+    {
+        fill_finish(fill, 0);
+        fill_release(fill);
+        return;
+    }
+    head = get_object_head(obj, &n);
+    shared = http_shareable(head, n);
+    fill_share(fill, shared);
+    memset(&cursor, 0, sizeof(cursor));
+    while (shared && (n = read_object(obj, &cursor, iov, WRITE_IOVS)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            fill_append(fill, iov[i].iov_base, iov[i].iov_len);
+            consume_object(obj, &cursor, iov[i].iov_len);
+        }
+    }
+    release_object(obj);
+    fill_finish(fill, 1);
+    fill_release(fill);
+}
+
+/*
+ * check_revalidation - Look at the start of the response to a conditional
+ *                      request. On 304 Not Modified, the stale object is
+ *                      fresh again: it is sent to the client and to the
+ *                      requests waiting on the fill, and 1 is returned. Any
+ *                      other response replaces the object, return 0.
+ */
+static int check_revalidation(struct connection *conn, const char *buf,
+                              int len, int epfd)
+{
+    struct object *obj = conn->stale;
+
+    conn->stale = NULL;
+    if (http_status(buf, len) != 304)
+    {
+        release_object(obj);
+        return 0;
+    }
+
+    revalidate_object(obj, buf, len);
+    if (conn->refresh)
+        count_refresh(REFRESH_NOT_MODIFIED);
+    if (conn->fill)
+    {
+        fill_from_object(conn->fill, obj);
+        conn->fill = NULL;
+    }
+    /* The client owns the reference once it is served, even on error */
+    if (conn->pair == NULL)
+        release_object(obj);
+    else
+        serve_from_cache(conn->pair, obj, epfd);
+    return 1;
+}
+
+/*
+ * drain_connection - Shut down our side of the connection and read until the
+ *                    peer closes it. A server response still feeding a fill
+ *                    is completed, so its waiters get it and it is cached
+ *                    even if the client went away first.
+ */
+void drain_connection(struct connection *conn)
+{
+    char buf[MAXLINE];
+    ssize_t nread;
+
+    shutdown(conn->fd, SHUT_WR);
+    while ((nread = read(conn->fd, buf, sizeof(buf))) != 0)
+    {
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            abort_fill(conn);
+            return;
+        }
+        if (conn->stale && check_revalidation(conn, buf, nread, -1))
+            return;
+        feed_fill(conn, buf, nread);
+    }
+    finish_fill(conn);
+}
+
+/*
+ * read_from_refresh - Read the response of a background refresh. It only
+ *                     feeds the fill, there is no client to forward it to.
+ */
+static int read_from_refresh(struct connection *conn, int epfd)
+{
+    char buf[MAXLINE];
+    ssize_t nread;
+
+    nread = read(conn->fd, buf, sizeof(buf));
+    if (nread < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    if (nread == 0)
+    {
+        finish_fill(conn);
+        return -2;
+    }
+    if (conn->stale && check_revalidation(conn, buf, nread, epfd))
+        return -2;
+    feed_fill(conn, buf, nread);
+    return 0;
+}
+
 /*
  * read_from_connection - Read data from the connection, remember the data would send
  *                        to the pair connection. So we need store the data into the 
@@ -243,11 +780,13 @@ int read_from_connection(struct connection *conn, int epfd)
     int fd = conn->fd;
     ssize_t nread;
     
+    if (!pair && conn->refresh)
+        return read_from_refresh(conn, epfd);
     /* No space left, just return*/ 
-    if (!pair || MAX_OBJECT_SIZE == pair->size)
+    if (!pair || MAX_OBJECT_SIZE == pair->last)
         return 0;
 
-    nread = read(fd, pair->data + pair->last, MAX_OBJECT_SIZE - pair->size);
+    nread = read(fd, pair->data + pair->last, MAX_OBJECT_SIZE - pair->last);
     if (nread < 0)
     {
         if (errno == EINTR || errno == EAGAIN)
@@ -257,13 +796,18 @@ int read_from_connection(struct connection *conn, int epfd)
     }
     else if (nread == 0)
     {
+       finish_fill(conn);
        return -2;
     }
     else
     {
-        pair->last = (pair->last + nread) % MAX_OBJECT_SIZE;
+        /* A 304 is not forwarded, the client gets the cached object */
+        if (conn->stale &&
+            check_revalidation(conn, pair->data + pair->last, nread, epfd))
+            return -2;
+        feed_fill(conn, pair->data + pair->last, nread);
+        pair->last += nread;
         pair->size += nread;
-        pair->data[pair->size] = '\0';
         
         /* 
          * As we have data need to send to pair connection.
@@ -281,7 +825,9 @@ int read_from_connection(struct connection *conn, int epfd)
 }
 
 /*
- * connect_to_server
+ * connect_to_server - Open a connection to the server of url, paired with
+ *                     the client connection conn. conn is NULL for a
+ *                     background refresh.
  */
 struct connection* connect_to_server(DList* connectionTable, const char* url, struct connection* conn)
 {
@@ -289,6 +835,7 @@ struct connection* connect_to_server(DList* connectionTable, const char* url, st
         char port[16];
         char uri[HTTP_URL_LEN];
         int clientfd;
+        unsigned int host = host_hash(url);
         struct connection* pair;
 
         if (parse_url(url, hostname, uri, port) == -1)
@@ -296,9 +843,13 @@ struct connection* connect_to_server(DList* connectionTable, const char* url, st
             return NULL;
         }
         
+        /* Don't block on a host that just failed, until its entry expires */
+        if (host_unreachable(host))
+            return NULL;
         if ((clientfd = open_clientfd(hostname, port)) < 0)
         {
             fprintf(stderr, "open_clientfd error\n");
+            set_unreachable(host);
             return NULL;
         } 
 
@@ -314,119 +865,441 @@ struct connection* connect_to_server(DList* connectionTable, const char* url, st
             return NULL;
         }
 
+        pair->state = ALL_CONNECTION;
+        if (conn == NULL)
+            return pair;
+
         conn->pair = pair;
         pair->pair = conn;
         conn->state = ALL_CONNECTION;
-        pair->state = ALL_CONNECTION;
         
         printf("pair: fd1, %d, fd2, %d\n", conn->fd, pair->fd);
         return pair;
 }
 
 /*
- * int read_from_half_connection
+ * follow_fill - Send the response of a fetch started by another request to
+ *               the client, instead of fetching it again. The client is
+ *               woken by the fill whenever more data arrives. The request
+ *               is kept, in case the response turns out not to be shared.
  */
-int read_from_half_connection(DList* connectionTable, struct connection* conn, int epfd)
+static int follow_fill(struct connection *conn, struct fill *fill,
+                       const char *request, int len, int epfd)
 {
-    char request[MAXLINE];
-    ssize_t nread;
-    int fd = conn->fd;
-    char method[HTTP_METHOD_LEN];
-    char version[HTTP_VERSION_LEN];
-    char url[HTTP_URL_LEN];
-    char* content;
     struct epoll_event ev;
-    struct connection* pair;
 
-    assert(conn->pair == NULL && conn->state == HALF_CONNECTION);
+    if ((conn->request = malloc(len + 1)) == NULL)
+        return -1;
+    if (fill_add_waiter(fill, epfd, conn->fd) == -1)
+    {
+        free(conn->request);
+        conn->request = NULL;
+        return -1;
+    }
+    memcpy(conn->request, request, len + 1);
+    conn->request_len = len;
+    conn->follow = fill;
+    memset(&conn->cursor, 0, sizeof(conn->cursor));
+    /* The whole response comes from the fill, close after sending it */
+    conn->state = HALF_FINISH_CONNECTION;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = conn->fd;
+    ev.events = EPOLLIN | EPOLLOUT;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+        fprintf(stderr, "epoll_ctl error\n");
+
+    return 0;
+}
+
+/*
+ * write_to_connection - Write data to the connection. Buffered data goes
+ *                       first, then the pinned cache object or the followed
+ *                       fill, in a single writev. An object on disk is sent
+ *                       with sendfile. The object is released once it is
+ *                       sent. A client that caught up with its fill stops
+ *                       polling for write until the fill grows. Return 1 if
+ *                       the response of the fill is not shared, the request
+ *                       has to be served again by refetch_connection.
+ */
+int write_to_connection(struct connection *conn, int epfd)
+{
+    int fd = conn->fd;
+    ssize_t  nwrite;
+    struct iovec iov[WRITE_IOVS];
+    int iovcnt = 0;
+    int max;
+    FillState state;
+    int file;
+    off_t offset;
+    long sent;
     
-    nread = read(fd, request, MAXLINE);
-    if (nread < 0)
+    /* An object on disk goes from the page cache to the socket, once the
+       patched head is sent */
+    if (conn->obj && conn->size == 0 &&
+        (sent = get_object_offset(conn->obj, &conn->obj_cursor)) >= 0 &&
+        (file = get_object_file(conn->obj, &offset)) >= 0)
+    {
+        offset += sent;
+        nwrite = sendfile(fd, file, &offset, get_object_size(conn->obj) - sent);
+    }
+    else
+    {
+        if (conn->size > 0)
+        {
+            iov[iovcnt].iov_base = conn->data + conn->first;
+            iov[iovcnt].iov_len = conn->size;
+            iovcnt++;
+        }
+        if (conn->obj)
+        {
+            /* Only the head of an object in a file goes by writev */
+            max = WRITE_IOVS - iovcnt;
+            if (max > HEAD_IOVS && get_object_file(conn->obj, &offset) >= 0)
+                max = HEAD_IOVS;
+            iovcnt += read_object(conn->obj, &conn->obj_cursor, iov + iovcnt, max);
+        }
+        if (conn->follow)
+        {
+            iovcnt += fill_read(conn->follow, &conn->cursor, iov + iovcnt,
+                                WRITE_IOVS - iovcnt, &state);
+            if (iovcnt == 0)
+            {
+                if (state == FILL_PRIVATE)
+                    return 1;
+                if (state == FILL_ABORTED)
+                    return -1;
+                fill_wait(conn->follow, &conn->cursor, epfd, fd);
+                return 0;
+            }
+        }
+        if (iovcnt == 0)
+            return 0;
+
+        nwrite = writev(fd, iov, iovcnt);
+    }
+    if (nwrite < 0)
     {
+        printf("error happened, %s\n", strerror(errno));
         if (errno == EINTR || errno == EAGAIN)
             return 0;
         else
             return -1;
     }
-    else if (nread == 0)
-    {
-       return -2;
-    }
     else
     {
-        sscanf(request, "%s %s %s",  method, url, version);
-        
-        /* First we find request in the cache */
-        if (!strcasecmp(method, "GET"))
-            content = search_in_cache(url);
-
-        if (content)
+        if (nwrite >= conn->size)
         {
-            int len;
-            if (strlen(content) > MAX_OBJECT_SIZE - conn->size)
-                len = MAX_OBJECT_SIZE - conn->size;
-            else
-                len = strlen(content);
-            strncpy(conn->data, content, len);
-            conn->size += len;
-            conn->last = (conn->last + len) % MAX_OBJECT_SIZE;
-            free(content);
-            
-            ev.data.fd = conn->fd;
-            ev.events = EPOLLIN | EPOLLOUT;
-            if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
-            {
-                fprintf(stderr, "epoll_ctl error\n");
-                return -1;
-            }
+            nwrite -= conn->size;
+            conn->first = 0;
+            conn->last = 0;
+            conn->size = 0;
         }
         else
         {
-            pair = connect_to_server(connectionTable, url, conn);
-            if (!pair)
+            conn->first = (conn->first + nwrite) % MAX_OBJECT_SIZE;
+            conn->size -= nwrite;
+            nwrite = 0;
+        }
+
+        if (conn->obj)
+        {
+            consume_object(conn->obj, &conn->obj_cursor, nwrite);
+            if (get_object_pending(conn->obj, &conn->obj_cursor) == 0)
             {
-                fprintf(stderr, "connect_to_server failed\n");
-                return -1;
+                release_object(conn->obj);
+                conn->obj = NULL;
             }
         }
+        else if (conn->follow)
+        {
+            fill_consume(&conn->cursor, nwrite);
+        }
         return 0;
     }
 }
 
 /*
- * write_to_connection - Write data to the connection. If all data have sent to the 
- *                       connection, we should disable the write of the connection.
+ * connection_pending - return the bytes still waiting to be sent on conn.
  */
-int write_to_connection(struct connection *conn, int epfd)
+int connection_pending(struct connection *conn)
+{
+    int pending = conn->size;
+
+    if (conn->obj)
+        pending += get_object_pending(conn->obj, &conn->obj_cursor);
+    if (conn->follow)
+    {
+        /* An unfinished fill is pending even if we caught up with it */
+        if (fill_done(conn->follow))
+            pending += fill_length(conn->follow) - conn->cursor.sent;
+        else
+            pending++;
+    }
+    return pending;
+}
+
+/*
+ * discard_connection - Drop the buffered data, the pinned object and the
+ *                      followed fill of conn.
+ */
+void discard_connection(struct connection *conn)
 {
+    conn->size = 0;
+    release_object(conn->obj);
+    conn->obj = NULL;
+    if (conn->follow)
+    {
+        fill_remove_waiter(conn->follow, conn->fd);
+        fill_release(conn->follow);
+        conn->follow = NULL;
+    }
+}
+
+/*
+ * conditional_request - Return 1 if the request has validators of its own.
+ */
+static int conditional_request(const char *request, int len)
+{
+    char value[HTTP_VALIDATOR_LEN];
+
+    return http_header(request, len, "If-None-Match", value, sizeof(value)) >= 0 ||
+           http_header(request, len, "If-Modified-Since", value, sizeof(value)) >= 0;
+}
+
+/*
+ * make_conditional - Copy the request to buf, with the validators of the
+ *                    stale object obj: If-None-Match for its ETag and
+ *                    If-Modified-Since for its Last-Modified. Return the
+ *                    length, or -1 if obj has no validator or buf is short.
+ */
+static int make_conditional(char *buf, int size, const char *request,
+                            int len, struct object *obj)
+{
+    char value[HTTP_VALIDATOR_LEN];
+    char headers[2 * HTTP_VALIDATOR_LEN + 64];
+    const char *head, *end;
+    int n = 0, head_len, split;
+
+    head = get_object_head(obj, &head_len);
+    if (http_header(head, head_len, "ETag", value, sizeof(value)) >= 0)
+        n += sprintf(headers + n, "If-None-Match: %s\r\n", value);
+    if (http_header(head, head_len, "Last-Modified", value, sizeof(value)) >= 0)
+        n += sprintf(headers + n, "If-Modified-Since: %s\r\n", value);
+    if (n == 0 || (end = strstr(request, "\r\n\r\n")) == NULL || len + n > size)
+        return -1;
+
+    /* The validators go before the blank line ending the headers */
+    split = end - request + 2;
+    memcpy(buf, request, split);
+    memcpy(buf + split, headers, n);
+    memcpy(buf + split + n, request + split, len - split);
+    return len + n;
+}
+
+/*
+ * start_refresh - Revalidate the stale object obj in the background, while
+ *                 the client is served the stale copy. The refresh leads
+ *                 the fill of its key, so there is only one at a time, and
+ *                 requests arriving once the object expired wait for it.
+ */
+static void start_refresh(DList *connectionTable, int epfd, const char *url,
+                          const char *key, unsigned int hash,
+                          const char *request, int len, struct object *obj)
+{
+    struct connection *refresh;
+    struct fill *fill;
+    int leader;
+
+    /* The answer to the validators of the client would not be ours */
+    if (conditional_request(request, len))
+        return;
+    if ((fill = fill_join(key, hash, &leader)) == NULL)
+        return;
+    if (!leader)
+    {
+        fill_release(fill);
+        return;
+    }
+
+    count_refresh(REFRESH_STARTED);
+    if ((refresh = connect_to_server(connectionTable, url, NULL)) == NULL)
+    {
+        count_refresh(REFRESH_FAILED);
+        fill_finish(fill, 0);
+        fill_release(fill);
+        return;
+    }
+    refresh->refresh = 1;
+    if ((refresh->size = make_conditional(refresh->data, MAX_OBJECT_SIZE,
+                                          request, len, obj)) > 0)
+    {
+        refresh->stale = pin_object(obj);
+    }
+    else
+    {
+        memcpy(refresh->data, request, len);
+        refresh->size = len;
+    }
+    refresh->last = refresh->size % MAX_OBJECT_SIZE;
+    start_fill(refresh, fill, key, hash);
+
+    add_epoll_event(epfd, refresh->fd);
+    enable_write(epfd, refresh->fd);
+    append_connection(connectionTable, refresh);
+}
+
+/*
+ * serve_request - Serve the request read from the client conn: from the
+ *                 cache if the response is fresh, or stale while it is
+ *                 refreshed in the background, by following the fill of
+ *                 another client fetching it, or else from the server, with
+ *                 the validators of an expired copy. The request is
+ *                 terminated, its line is parsed by sscanf. A request with
+ *                 credentials, or with share 0, never takes part in a fill.
+ */
+static int serve_request(DList* connectionTable, int epfd,
+                         struct connection* conn, const char *request,
+                         int nread, int share)
+{
+    struct object *obj = NULL;
+    char method[HTTP_METHOD_LEN];
+    char version[HTTP_VERSION_LEN];
+    char url[HTTP_URL_LEN];
+    char key[MAX_REQUEST] = "";
+    unsigned int hash = 0;
+    struct fill *fill = NULL;
+    int leader = 0;
+    int len;
+    struct connection* pair;
+
+    /* Bounded by HTTP_METHOD_LEN, HTTP_URL_LEN and HTTP_VERSION_LEN */
+    sscanf(request, "%63s %2047s %63s", method, url, version);
+    conn->gzip = gzip_accepted(request, nread);
+    if (!strcasecmp(method, "PURGE"))
+        return serve_purge(conn, url, request, nread, epfd);
+    if (!strcasecmp(method, "GET"))
+        obj = search_request(url, request, nread, key, &hash);
+
+    if (obj && get_object_freshness(obj) != OBJECT_EXPIRED)
+    {
+        if (get_object_freshness(obj) == OBJECT_STALE)
+        {
+            count_stale_hit();
+            start_refresh(connectionTable, epfd, url, key, hash, request,
+                          nread, obj);
+        }
+        return serve_from_cache(conn, obj, epfd);
+    }
+
+    /* Someone may be fetching it already, wait for that response */
+    if (share && !strcasecmp(method, "GET") && key[0] &&
+        !http_credentials(request, nread))
+        fill = fill_join(key, hash, &leader);
+    if (fill && !leader)
+    {
+        release_object(obj);
+        if (follow_fill(conn, fill, request, nread, epfd) == 0)
+            return 0;
+        fill_release(fill);
+        fill = NULL;
+        obj = NULL;
+    }
+
+    /* Need to connect to server */
+    pair = connect_to_server(connectionTable, url, conn);
+    if (!pair)
+    {
+        fprintf(stderr, "connect_to_server failed\n");
+        release_object(obj);
+        if (fill)
+        {
+            fill_finish(fill, 0);
+            fill_release(fill);
+        }
+        return serve_unreachable(conn, url, key, hash, epfd);
+    }
+    /* Revalidate a stale object, unless the client has its own validators */
+    if (obj && !conditional_request(request, nread) &&
+        (len = make_conditional(pair->data, MAX_OBJECT_SIZE, request,
+                                nread, obj)) > 0)
+    {
+        pair->stale = obj;
+        nread = len;
+    }
+    else
+    {
+        release_object(obj);
+        memcpy(pair->data, request, nread);
+    }
+    pair->size += nread;
+    pair->last = (pair->last + nread) % MAX_OBJECT_SIZE;
+    if (fill)
+        start_fill(pair, fill, key, hash);
+
+    add_epoll_event(epfd, pair->fd);
+    enable_write(epfd, pair->fd);
+    append_connection(connectionTable, pair);
+
+    return 0;
+}
+
+/*
+ * refetch_connection - The response of the fill followed by the client conn
+ *                      is not shared. Serve its request again, on its own.
+ */
+int refetch_connection(DList* connectionTable, struct connection* conn, int epfd)
+{
+    char *request = conn->request;
+    int ret;
+
+    fill_remove_waiter(conn->follow, conn->fd);
+    fill_release(conn->follow);
+    conn->follow = NULL;
+    memset(&conn->cursor, 0, sizeof(conn->cursor));
+    conn->request = NULL;
+    if (request == NULL)
+        return -1;
+
+    conn->state = HALF_CONNECTION;
+    ret = serve_request(connectionTable, epfd, conn, request,
+                        conn->request_len, 0);
+    free(request);
+    return ret;
+}
+
+/*
+ * read_from_half_connection - Read the next request of a client connection
+ *                             with no server paired, and serve it like the
+ *                             first one.
+ */
+int read_from_half_connection(DList* connectionTable, struct connection* conn, int epfd)
+{
+    char request[MAXLINE];
+    ssize_t nread;
     int fd = conn->fd;
-    ssize_t  nwrite;
-    struct epoll_event ev;
+
+    assert(conn->pair == NULL && conn->state == HALF_CONNECTION);
     
-    nwrite = write(fd, conn->data + conn->first, conn->size);
-    if (nwrite < 0)
+    nread = read(fd, request, MAXLINE - 1);
+    if (nread < 0)
     {
-        printf("error happened, %s\n", strerror(errno));
         if (errno == EINTR || errno == EAGAIN)
             return 0;
         else
             return -1;
     }
+    else if (nread == 0)
+    {
+       return -2;
+    }
     else
     {
-        conn->first = (conn->first + nwrite) % MAX_OBJECT_SIZE;
-        conn->size -= nwrite;
-        if (conn->size == 0)
-        {
-            assert(conn->first == conn->last);
-            conn->first = 0;
-            conn->last = 0;
-        }
-        return 0;
+        request[nread] = '\0';
+        return serve_request(connectionTable, epfd, conn, request, nread, 1);
     }
 }
 
-
 /*
  * get_new_connection - Get a new request from client. First we should search in proxy cache to find
  *                      the corresponding cached content. Second if the cache missed, we should
@@ -437,20 +1310,15 @@ int write_to_connection(struct connection *conn, int epfd)
 int get_new_connection(DList* connectionTable, int epfd, int fd)
 {
     char request[MAX_OBJECT_SIZE];
-    char *content = NULL;
     ssize_t nread;
-    char method[HTTP_METHOD_LEN];
-    char version[HTTP_VERSION_LEN];
-    char url[HTTP_URL_LEN];
-    struct epoll_event ev;
-    struct connection* pair;
     struct connection* conn = make_connection(fd); 
      
     if (!conn)
         return -1;
      
     conn->state = HALF_CONNECTION;
-    nread = read(fd, request, MAX_OBJECT_SIZE);
+    /* Leave room for a terminator, the request line is parsed by sscanf */
+    nread = read(fd, request, MAX_OBJECT_SIZE - 1);
     if (nread < 0)
     {
         if (errno == EINTR)
@@ -466,53 +1334,9 @@ int get_new_connection(DList* connectionTable, int epfd, int fd)
     }
     else
     {
+        request[nread] = '\0';
         append_connection(connectionTable, conn);
 
-        sscanf(request, "%s %s %s", method, url, version);
-        if (!strcasecmp(method, "GET"))
-        {
-            content = search_in_cache(url);    
-        }
-        
-        if (content)
-        {
-            int len;
-            if (strlen(content) > MAX_OBJECT_SIZE - conn->size)
-                len = MAX_OBJECT_SIZE - conn->size;
-            else
-                len = strlen(content);
-            strncpy(conn->data, content, len);
-            conn->size += len;
-            conn->last = (conn->last + len) % MAX_OBJECT_SIZE;
-            free(content);
-            
-            ev.data.fd = conn->fd;
-            ev.events = EPOLLIN | EPOLLOUT;
-            if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
-            {
-                fprintf(stderr, "epoll_ctl error\n");
-                return -1;
-            }
-        }
-        else /* Need to connect to server */
-        {
-            ssize_t nwrite;
-            pair = connect_to_server(connectionTable, url, conn);
-            if (!pair)
-            {
-                fprintf(stderr, "connect_to_server failed\n");
-                return -1;
-            }
-            strncpy(pair->data, request, nread);
-            pair->size += nread;
-            pair->last = (pair->last + nread) % MAX_OBJECT_SIZE;
-           
-            add_epoll_event(epfd, pair->fd);
-            enable_write(epfd, pair->fd);
-            append_connection(connectionTable, pair);
-        }
+        return serve_request(connectionTable, epfd, conn, request, nread, 1);
     }
-
-    return 0;
 }
-
@@ -12,9 +12,10 @@
 
 #include "dlist.h"
 #include "cache.h"
+#include "fill.h"
 #include "csapp.h"
 
-#define HTTP_URL_LEN 256
+#define HTTP_URL_LEN 2048
 #define HTTP_METHOD_LEN 64
 #define HTTP_VERSION_LEN 64 
 
@@ -37,6 +38,19 @@ struct connection {
     char data[MAX_OBJECT_SIZE];
     int size;
     int first, last;
+    struct object *obj; /* Pinned cache object being sent, NULL if none */
+    struct object_cursor obj_cursor; /* Position in obj */
+    struct fill *fill; /* Fill fed by this server connection, NULL if none */
+    struct fill *follow; /* Fill of another fetch sent to this client */
+    struct fill_cursor cursor; /* Position of this client in follow */
+    struct object *stale; /* Stale object revalidated by this server connection */
+    int refresh; /* 1 for a background refresh, it has no client */
+    int gzip; /* The client accepts a gzip encoded response */
+    unsigned int hash; /* cache_hash() of url */
+    char url[MAX_REQUEST]; /* Cache key of the fill */
+    char *request; /* Request of the fill, for the Vary of its response, or
+                      of the followed fill, to fetch it again */
+    int request_len;
     struct connection *pair;
     State state;
 };
@@ -54,13 +68,36 @@ Ret delete_connection(DList *connectionTable, struct connection *conn);
  */
 int read_from_connection(struct connection *conn, int epfd);
 
+/*
+ * drain_connection - shut down the write side and read until the peer closes.
+ */
+void drain_connection(struct connection *conn);
+
 int read_from_half_connection(DList *connectionTable,
                               struct connection* conn,
                               int epfd);
 int get_new_connection(DList* connectionTable, int epfd, int fd);
 
 /*
- * write_to_connection - write data to connection. 
+ * write_to_connection - write data to connection. return 0 if everything is
+ *                       ok, -1 if error occurs, 1 if the followed response
+ *                       is not shared.
  */
 int write_to_connection(struct connection *conn, int epfd);
+
+/*
+ * refetch_connection - serve the request of a client again, after its
+ *                      followed response turned out not to be shared.
+ */
+int refetch_connection(DList* connectionTable, struct connection* conn, int epfd);
+
+/*
+ * connection_pending - return the bytes still waiting to be sent on conn.
+ */
+int connection_pending(struct connection *conn);
+
+/*
+ * discard_connection - drop the data still waiting to be sent on conn.
+ */
+void discard_connection(struct connection *conn);
 #endif
@@ -0,0 +1,184 @@
+/*************************************************************************
+	> File Name: bloom.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Counting Bloom filter of the cache keys, for fast misses.
+	>
+	> Every key bumps BLOOM_HASHES byte counters, and a key none of whose
+	> counters is zero may be present: a zero counter proves a miss. The
+	> counters let keys be removed again when objects leave the cache. The
+	> updates are serialized by the caller, the tests may run at any time
+	> without a lock: a counter is read and written in one access.
+ ************************************************************************/
+#include "bloom.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "typedef.h"
+
+struct _CountingBloom
+{
+    unsigned char *counters;  /* Aligned on BLOOM_BLOCK bytes */
+    unsigned int mask;        /* Blocks - 1, a power of two */
+};
+
+CountingBloom* bloom_create(int counters)
+{
+    unsigned int n = BLOOM_BLOCK;
+    void *p;
+    CountingBloom* thiz = malloc(sizeof(CountingBloom));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    while (n < (unsigned int)counters)
+        n <<= 1;
+    if (posix_memalign(&p, BLOOM_BLOCK, n) != 0)
+    {
+        free(thiz);
+        return NULL;
+    }
+    memset(p, 0, n);
+    thiz->counters = p;
+    thiz->mask = n / BLOOM_BLOCK - 1;
+
+    return thiz;
+}
+
+/*
+ * locate - Set slots to the counters of hash, all in one block so a test
+ *          reads one cache line.
+ */
+static void locate(CountingBloom* thiz, unsigned int hash,
+                   unsigned char *slots[BLOOM_HASHES])
+{
+    unsigned int h = hash;
+    unsigned char *block;
+    int i;
+
+    /* Keys of close hashes must not share counters */
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    block = thiz->counters + (size_t)(h & thiz->mask) * BLOOM_BLOCK;
+    /* The offsets come from other bits than the block */
+    h *= 0x9e3779b1u;
+    for (i = 0; i < BLOOM_HASHES; i++, h >>= 6)
+        slots[i] = block + (h >> 8 & (BLOOM_BLOCK - 1));
+}
+
+void bloom_add(CountingBloom* thiz, unsigned int hash)
+{
+    unsigned char *slots[BLOOM_HASHES];
+    int i;
+
+    return_if_fail(thiz != NULL);
+
+    locate(thiz, hash, slots);
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        if (*slots[i] < BLOOM_MAX_COUNT)
+            __atomic_store_n(slots[i], *slots[i] + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * bloom_remove - Remove a key added before. It may still be reported
+ *                present, never the other keys absent.
+ */
+void bloom_remove(CountingBloom* thiz, unsigned int hash)
+{
+    unsigned char *slots[BLOOM_HASHES];
+    int i;
+
+    return_if_fail(thiz != NULL);
+
+    locate(thiz, hash, slots);
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        if (*slots[i] > 0 && *slots[i] < BLOOM_MAX_COUNT)
+            __atomic_store_n(slots[i], *slots[i] - 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * bloom_may_contain - Return 0 if the key of hash was never added or was
+ *                     removed since, or 1 if it may be present.
+ */
+int bloom_may_contain(CountingBloom* thiz, unsigned int hash)
+{
+    unsigned char *slots[BLOOM_HASHES];
+    int i;
+
+    return_val_if_fail(thiz != NULL, 1);
+
+    locate(thiz, hash, slots);
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        if (__atomic_load_n(slots[i], __ATOMIC_ACQUIRE) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+void bloom_destroy(CountingBloom* thiz)
+{
+    if (thiz != NULL)
+    {
+        free(thiz->counters);
+        free(thiz);
+    }
+}
+
+#ifdef BLOOM_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+#define KEYS 10000
+
+static void bloom_count_test(void)
+{
+    CountingBloom* thiz = bloom_create(16 * KEYS);
+    unsigned int i;
+    int positives = 0;
+
+    for (i = 0; i < KEYS; i++)
+        bloom_add(thiz, i * 2654435761u);
+    /* No false negative */
+    for (i = 0; i < KEYS; i++)
+        assert(bloom_may_contain(thiz, i * 2654435761u));
+    for (i = KEYS; i < 2 * KEYS; i++)
+        positives += bloom_may_contain(thiz, i * 2654435761u);
+    printf("bloom: %.3f%% false positives at 16 counters per key\n",
+           100.0 * positives / KEYS);
+    assert(positives < KEYS / 100);
+
+    /* Removing half the keys keeps the others */
+    for (i = 0; i < KEYS; i += 2)
+        bloom_remove(thiz, i * 2654435761u);
+    for (i = 1; i < KEYS; i += 2)
+        assert(bloom_may_contain(thiz, i * 2654435761u));
+    for (i = 1; i < KEYS; i += 2)
+        bloom_remove(thiz, i * 2654435761u);
+    for (i = 0; i < 2 * KEYS; i++)
+        assert(!bloom_may_contain(thiz, i * 2654435761u));
+
+    /* A saturated counter stays, the key is never lost */
+    for (i = 0; i < BLOOM_MAX_COUNT + 10; i++)
+        bloom_add(thiz, 42);
+    for (i = 0; i < BLOOM_MAX_COUNT + 10; i++)
+        bloom_remove(thiz, 42);
+    assert(bloom_may_contain(thiz, 42));
+    bloom_destroy(thiz);
+}
+
+int main(int argc, char* argv[])
+{
+    bloom_count_test();
+    return 0;
+}
+#endif
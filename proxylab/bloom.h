@@ -0,0 +1,26 @@
+/*************************************************************************
+	> File Name: bloom.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Counting Bloom filter of the cache keys, for fast misses
+ ************************************************************************/
+
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#define BLOOM_HASHES 4
+/* Counters of a key are in one cache line */
+#define BLOOM_BLOCK 64
+/* A saturated counter is never decremented again */
+#define BLOOM_MAX_COUNT 255
+
+struct _CountingBloom;
+typedef struct _CountingBloom CountingBloom;
+
+CountingBloom* bloom_create(int counters);
+void           bloom_add(CountingBloom* thiz, unsigned int hash);
+void           bloom_remove(CountingBloom* thiz, unsigned int hash);
+int            bloom_may_contain(CountingBloom* thiz, unsigned int hash);
+void           bloom_destroy(CountingBloom* thiz);
+
+#endif
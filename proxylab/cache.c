@@ -6,364 +6,3472 @@
  ************************************************************************/
 #include "cache.h"
 
-#include <sys/time.h>
+#include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <stddef.h>
+
+#include "slab.h"
+#include "sketch.h"
+#include "policy.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "http.h"
+#include "epoch.h"
+#include "gzip.h"
+#include "trie.h"
+#include "bloom.h"
+
+#define INIT_BUCKETS 1024
+/* Hits recorded by the lock-free readers, replayed by the lock holder */
+#define HIT_BUFFER 64
+/* Lookups retried when a writer changed the index under a miss */
+#define LOOKUP_RETRIES 4
+/* Victims evicted at most to free a chunk when the arena is full */
+#define ALLOC_EVICTIONS 8
+/* Added to every response served from the cache */
+#define VIA_HEADER "Via: 1.0 proxylab\r\n"
 
 struct object
 {
-    char key[MAX_REQUEST]; // key of the object, always the request string.
-    char *data; // Content of the object
+    const char *key; // Cache key of the request, stored after the content
+    unsigned int hash; // cache_hash() of the key
+    const char *data; // Content of the object, right after the header
+    struct cache_chunk *chunks; // Content of a large object, data is NULL
+    DiskSegment *segment; // Segment mapping data of a disk hit, NULL if none
+    int mapped; // The header was malloc'ed, data maps the disk or the snapshot
+    int restored; // Restored from the snapshot of the previous run
+    int decoded; // Private decoded copy, malloc'ed with its data
+    int vary; // Vary marker of the url, data is the Vary header of its variants
     int size;  // data size in byte
-    struct timeval ctime; //Update time
-    struct object *next;
+    int identity; // Size once decoded if gzip encoded by the cache, or 0
+    int patch_at; // Offset of the hop headers patched at send time, or -1
+    int patch_over; // Length of the stored Age header they replace
+    int head_len; // Status line and headers with the blank line, 0 if none
+    int tags_at; // Offset of the Surrogate-Key value in the head
+    int tags_len; // Its length, 0 if there is no such header
+    int refcnt; // One reference for the cache, one for every reader
+    unsigned int generation; // Bumped when unlinked, invalidates the L1 copies
+    time_t atime; // Last access time, read from the coarse cache clock
+    time_t expires; // Stale after this time, from the response headers
+    time_t grace; // Served stale, while refreshed, until this time
+    time_t generated; // Generated by the origin at this time, for the Age
+    volatile unsigned int life_seq; // Odd while the three times above change
+    struct policy_node node; // Eviction policy state
+    struct object *hnext; // Next object in the same hash bucket
+};
+
+#define node_to_object(n) \
+    ((struct object*)((char*)(n) - offsetof(struct object, node)))
+
+struct objecthead {
+    void *policy_ctx; // Eviction policy state of the shard
+    struct object **buckets; // Hash index of the objects, chained by hnext
+    unsigned int nbuckets; // Always a power of two
+    int size; // The total size of objects int the list.
+    long identity_size; // Their size once decoded
+    int capacity; // Size budget of the shard
+    int count; // the counts of the objects number
+    FreqSketch *sketch; // Access frequency of the urls, for admission
+    KeyTrie *keys; // Keys of the objects, for the purges
+    KeyTrie *tags; // "tag key" for every Surrogate-Key tag of the objects
+    CountingBloom *filter; // Hashes of the linked objects, for fast misses
+    volatile unsigned int seq; // Odd while a writer changes the index
+    unsigned long hit_buf[HIT_BUFFER]; // Recent lookups, hash << 1 | hit
+    unsigned long lookups; // Searches in the head, write cursor of hit_buf
+    unsigned long drained; // Read cursor of hit_buf
+    long hits; // Searches that found the object in the head
+    long restored_hits; // Hits of objects restored from the snapshot
+    long filtered; // Misses told by the filter, without a lookup
+    long false_positives; // Misses the filter let through to the index
+    pthread_mutex_t mtx;
+};
+
+/*
+ * The cache is split into independently locked shards selected by the url
+ * hash, so threads working on different objects don't serialize on one lock.
+ */
+static struct objecthead *shards;
+static unsigned int nshards;
+
+/*
+ * Searches don't take the shard lock. They walk the index in an epoch read
+ * section, so nothing they may see is freed under them, and retry a miss
+ * if a writer changed the index meanwhile (seq). The policy and the
+ * frequency sketch are not thread safe: a hit is only recorded in the
+ * lossy hit_buf of the shard, and replayed under the lock by the next
+ * writer, or by the reader filling the buffer if the lock is free.
+ * Inserts and evictions stay serialized by the shard lock.
+ *
+ * Most misses don't even walk the index: a counting Bloom filter of the
+ * hashes linked in the shard, updated by the lock holder, tells most of
+ * the absent urls before the epoch is entered.
+ */
+
+/*
+ * Objects larger than MAX_OBJECT_SIZE are kept apart, with their own byte
+ * budget, so a few media files can't flush all the small objects. They are
+ * not copied in one piece: the chunks received from the origin are handed
+ * over to the cache as they are. The large cache is disabled until
+ * init_large_cache() is called.
+ */
+static struct objecthead large;
+
+/*
+ * Objects evicted from memory are spilled to the disk tier, if any. A disk
+ * hit is a temporary object pointing in the mapped segment, and an object
+ * hit often enough on disk is copied back to memory.
+ */
+static DiskTier *disk;
+static long disk_hits;
+static void promote_object(const char *url, unsigned int hash, const char *data,
+                           int size, const struct cache_lifetime *life);
+
+/*
+ * Snapshot of a previous run, mapped at startup. Its objects are restored
+ * to memory lazily, the first time they are hit.
+ */
+static Snapshot *snapshot;
+static pthread_mutex_t snapshot_mtx = PTHREAD_MUTEX_INITIALIZER;
+static long snapshot_hits;
+
+/*
+ * Object headers and data come from one slab chunk. The arena is allocated
+ * up front with some room for the header and size class overhead, so the
+ * cache memory stays bounded whatever the object size mix is. Pages move
+ * between size classes with it, their objects are dropped by evict_chunk.
+ */
+static SlabArena *arena;
+static int evict_chunk(void *ctx, void *chunk);
+
+/*
+ * TinyLFU admission. When a new object would evict others, it is only
+ * admitted if it was requested more often than each of its victims, so a
+ * scan of one hit wonders can't flush the working set.
+ */
+static int admission;
+
+/*
+ * Eviction policy of every shard, chosen before init_cache().
+ */
+static const EvictionPolicy *policy = &lru_policy;
+
+/*
+ * Stale objects served while refreshed, and the outcomes of the refreshes.
+ */
+static long stale_hits;
+static long refreshes[REFRESH_RESULTS];
+
+/*
+ * Purge requests, and the objects they removed.
+ */
+static long purges;
+static long purged_objects;
+
+/*
+ * Text responses are stored gzip encoded if compression is enabled, and
+ * decoded for the clients that don't accept gzip. Encoding happens once per
+ * insert, decoding once per such hit; both are timed.
+ */
+static int compression;
+static long encodes, encode_ns;
+static long encoded_hits, decodes, decode_ns;
+
+/*
+ * The arena is a mapped memfd if enabled before init_cache(), so the hits
+ * are sent with sendfile instead of writev. The chunk of an object may be
+ * reused while the end of its last send is still queued in a socket, as a
+ * disk segment may.
+ */
+static int memfd_arena;
+
+/*
+ * Every thread searching with search_in_cache_local() keeps a reference to
+ * the objects it hit last in its own direct mapped table. A hit there takes
+ * no lock and writes no shared line but the reference count of the object:
+ * one hit in L1_SAMPLE is reported to the shard, so the policy still sees
+ * the object is hot, the others are counted by batches. An entry is valid
+ * while the generation of its object has not moved, that is until the
+ * object is unlinked from the cache. Stale entries are swept one per
+ * search, and a thread holds l1_budget bytes of objects at most, so the
+ * evicted objects kept alive stay a small part of the cache.
+ */
+#define L1_SLOTS 256
+#define L1_SAMPLE 8
+#define L1_BATCH 64
+
+struct l1_slot {
+    struct object *obj;         // Pinned, or NULL
+    struct objecthead *head;    // Head the object was found in
+    unsigned int generation;    // Generation of obj when it was found
+    unsigned int instance;      // init_cache() the object comes from
+    unsigned int hits;
+    int size;                   // Size of obj, counted in l1_bytes
 };
 
-struct objecthead {
-    struct object *first; // Point the first item in the cache object list.
-    struct object *last;
-    int size; // The total size of objects int the list.
-    int count; // the counts of the objects number
-    pthread_mutex_t mtx;
-} head;
+static __thread struct l1_slot l1[L1_SLOTS];
+static __thread unsigned int l1_sweep;
+static __thread long l1_bytes, l1_pending;
+static long l1_budget;
+static long l1_hits;
+static unsigned int cache_instance;
+
+/*
+ * Coarse clock updated once per event loop iteration by cache_tick(), so a
+ * hit never has to make a syscall to stamp the object.
+ */
+static volatile time_t cache_clock;
+
+/*
+ * get_shard - The low bits of the hash select the bucket inside a shard,
+ *             so use the high bits to select the shard.
+ */
+static struct objecthead *get_shard(unsigned int hash)
+{
+    return &shards[(hash >> 16) % nshards];
+}
+
+/*
+ * cache_hash - FNV-1a hash of the url. Compute it once per request and pass
+ *              it to search_in_cache and insert_in_cache.
+ */
+unsigned int cache_hash(const char *url)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*url)
+    {
+        hash ^= (unsigned char)*url++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * cache_tick - Advance the coarse cache clock. Call it once per event loop.
+ */
+void cache_tick(void)
+{
+    cache_clock = time(NULL);
+    epoch_reclaim();
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 +
+           (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * deinit_head - Free the objects and the index of a head
+ */
+static void deinit_head(struct objecthead *head)
+{
+    unsigned int b;
+    struct object *current, *next;
+
+    for (b = 0; head->buckets && b < head->nbuckets; b++)
+    {
+        for (current = head->buckets[b]; current; current = next)
+        {
+            next = current->hnext;
+            release_object(current);
+        }
+    }
+    free(head->buckets);
+    trie_destroy(head->keys);
+    trie_destroy(head->tags);
+    bloom_destroy(head->filter);
+    sketch_destroy(head->sketch);
+    if (head->policy_ctx)
+        policy->destroy(head->policy_ctx);
+    pthread_mutex_destroy(&head->mtx);
+    memset(head, 0, sizeof(*head));
+}
+
+/*
+ * init_head - Initialize an empty head of capacity bytes, with a frequency
+ *             sketch of width counters per row, and a filter of 4 times
+ *             more counters.
+ */
+static int init_head(struct objecthead *head, int capacity, int width)
+{
+    head->size = 0;
+    head->capacity = capacity;
+    head->count = 0;
+    head->nbuckets = INIT_BUCKETS;
+    head->buckets = (struct object**)calloc(head->nbuckets,
+                                            sizeof(struct object*));
+    head->sketch = sketch_create(width);
+    head->keys = trie_create();
+    head->tags = trie_create();
+    head->filter = bloom_create(width * 4);
+    head->policy_ctx = policy->create(head->capacity);
+    pthread_mutex_init(&head->mtx, NULL);
+    if (head->buckets == NULL || head->sketch == NULL ||
+        head->keys == NULL || head->tags == NULL || head->filter == NULL ||
+        head->policy_ctx == NULL)
+    {
+        deinit_head(head);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * init_cache - Initialize the cache database of capacity bytes with nshard
+ *              shards. Every shard gets an equal part of the capacity, so
+ *              the shard count is clamped to keep room for at least one
+ *              MAX_OBJECT_SIZE object.
+ *              Return 0 if success, or -1 if failed.
+ */
+int init_cache(int nshard, int capacity)
+{
+    unsigned int i;
+
+    if (capacity < MAX_OBJECT_SIZE)
+        capacity = MAX_OBJECT_SIZE;
+    if (nshard < 1)
+        nshard = 1;
+    if (nshard > capacity / MAX_OBJECT_SIZE)
+        nshard = capacity / MAX_OBJECT_SIZE;
+
+    cache_tick();
+    /* The objects of a previous cache left in L1 tables are dead */
+    cache_instance++;
+    l1_budget = capacity / 32;
+    if (memfd_arena)
+        arena = slab_create_memfd((size_t)capacity + capacity / 2);
+    else
+        arena = slab_create((size_t)capacity + capacity / 2);
+    if (arena == NULL)
+        return -1;
+    slab_set_evict(arena, evict_chunk, NULL);
+    shards = (struct objecthead*)calloc(nshard, sizeof(struct objecthead));
+    if (shards == NULL)
+    {
+        slab_destroy(arena);
+        arena = NULL;
+        return -1;
+    }
+    nshards = nshard;
+
+    for (i = 0; i < nshards; i++)
+    {
+        /* Track about 4 times more urls than the shard can hold */
+        if (init_head(&shards[i], capacity / nshards, capacity / nshards / 256) < 0)
+        {
+            nshards = i;
+            deinit_cache();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * init_large_cache - Enable the cache of objects larger than MAX_OBJECT_SIZE,
+ *                    with a budget of capacity bytes. Call it after
+ *                    init_cache(). Return 0 if success, or -1 if failed.
+ */
+int init_large_cache(int capacity)
+{
+    if (capacity <= MAX_OBJECT_SIZE)
+        return 0;
+    /* Large objects are few, track urls like a shard of small ones */
+    return init_head(&large, capacity, MAX_CACHE_SIZE / 256);
+}
+
+/*
+ * init_disk_cache - Enable the disk tier of capacity bytes in the directory
+ *                   dir. Call it after init_cache(). Return 0 if success, or
+ *                   -1 if failed.
+ */
+int init_disk_cache(const char *dir, long capacity)
+{
+    disk = disk_create(dir, capacity, DISK_SEGMENT_SIZE);
+    return disk != NULL ? 0 : -1;
+}
+
+/*
+ * get_cache_object_limit - return the size of the largest cacheable object.
+ */
+int get_cache_object_limit(void)
+{
+    if (large.buckets == NULL)
+        return MAX_OBJECT_SIZE;
+    return large.capacity < MAX_LARGE_OBJECT_SIZE ?
+           large.capacity : MAX_LARGE_OBJECT_SIZE;
+}
+
+/*
+ * deinit_cache - Free all the objects and the hash index
+ */
+void deinit_cache(void)
+{
+    unsigned int i;
+
+    flush_local_cache();
+    for (i = 0; i < nshards; i++)
+        deinit_head(&shards[i]);
+    if (large.buckets)
+        deinit_head(&large);
+    /* No search is left, the retired objects can go before their memory */
+    epoch_drain();
+    disk_destroy(disk);
+    disk = NULL;
+    snapshot_close(snapshot);
+    snapshot = NULL;
+    disk_hits = snapshot_hits = 0;
+    stale_hits = 0;
+    purges = purged_objects = 0;
+    l1_hits = 0;
+    memset(refreshes, 0, sizeof(refreshes));
+    encodes = encode_ns = encoded_hits = decodes = decode_ns = 0;
+    free(shards);
+    shards = NULL;
+    nshards = 0;
+    slab_destroy(arena);
+    arena = NULL;
+}
+
+/*
+ * set_cache_policy - Select the eviction policy by name, before init_cache().
+ *                    Return 0 if success, or -1 if there is no such policy.
+ */
+int set_cache_policy(const char *name)
+{
+    const EvictionPolicy *p = find_policy(name);
+
+    if (p == NULL)
+        return -1;
+    policy = p;
+    return 0;
+}
+
+/*
+ * get_cache_policy - return the name of the eviction policy.
+ */
+const char *get_cache_policy(void)
+{
+    return policy->name;
+}
+
+/*
+ * set_cache_memfd - Keep the objects of the next init_cache() in a memfd,
+ *                   and send them with sendfile.
+ */
+void set_cache_memfd(int enable)
+{
+    memfd_arena = enable;
+}
+
+/*
+ * set_cache_compression - Store the compressible responses gzip encoded.
+ */
+void set_cache_compression(int enable)
+{
+    compression = enable;
+}
+
+/*
+ * get_cache_compression - return how many times more content the cache
+ *                         holds thanks to compression.
+ */
+double get_cache_compression(void)
+{
+    long size = 0, identity = 0;
+    unsigned int i;
+
+    for (i = 0; i < nshards; i++)
+    {
+        pthread_mutex_lock(&shards[i].mtx);
+        size += shards[i].size;
+        identity += shards[i].identity_size;
+        pthread_mutex_unlock(&shards[i].mtx);
+    }
+    return size ? (double)identity / size : 1;
+}
+
+/*
+ * set_cache_admission - Enable or disable the TinyLFU admission filter.
+ */
+void set_cache_admission(int enable)
+{
+    admission = enable;
+}
+
+/*
+ * dump_cache_stats - Print the object counts of the shards and the fill and
+ *                    waste of every slab size class.
+ */
+void dump_cache_stats(FILE *fp)
+{
+    unsigned int i;
+    int count = 0, size = 0;
+    long filtered;
+    double ratio, restored, fp_rate;
+
+    for (i = 0; i < nshards; i++)
+    {
+        pthread_mutex_lock(&shards[i].mtx);
+        count += shards[i].count;
+        size += shards[i].size;
+        pthread_mutex_unlock(&shards[i].mtx);
+    }
+    fprintf(fp, "cache: %d objects, %d bytes in %u shards\n", count, size, nshards);
+    if (large.buckets)
+    {
+        pthread_mutex_lock(&large.mtx);
+        fprintf(fp, "large cache: %d objects, %d of %d bytes\n",
+                large.count, large.size, large.capacity);
+        pthread_mutex_unlock(&large.mtx);
+    }
+    if (disk)
+        disk_dump_stats(disk, fp);
+    ratio = get_cache_hit_ratio(&restored);
+    fprintf(fp, "hit ratio %.1f%%, %.1f%% from restored objects\n",
+            100 * ratio, 100 * restored);
+    fprintf(fp, "stale hits %ld, refreshes %ld: %ld not modified, "
+            "%ld replaced, %ld failed\n", stale_hits,
+            refreshes[REFRESH_STARTED], refreshes[REFRESH_NOT_MODIFIED],
+            refreshes[REFRESH_REPLACED], refreshes[REFRESH_FAILED]);
+    if (compression || encoded_hits || decodes)
+        fprintf(fp, "gzip: capacity x%.2f, %ld encodes of %.1f us, "
+                "%ld hits sent encoded, %ld decoded in %.1f us\n",
+                get_cache_compression(), encodes,
+                encodes ? encode_ns / 1e3 / encodes : 0, encoded_hits, decodes,
+                decodes ? decode_ns / 1e3 / decodes : 0);
+    if (purges)
+        fprintf(fp, "purges %ld, %ld objects purged\n", purges, purged_objects);
+    fp_rate = get_cache_false_positive_rate(&filtered);
+    if (filtered || fp_rate)
+        fprintf(fp, "filter: %ld misses told without a lookup, "
+                "false positive rate %.2f%%\n", filtered, 100 * fp_rate);
+    if (l1_hits)
+        fprintf(fp, "per-thread L1: %ld hits not seen by the shards\n", l1_hits);
+    slab_dump_stats(arena, fp);
+}
+
+/*
+ * get_cache_shards - return the number of shards actually in use
+ */
+int get_cache_shards(void)
+{
+    return nshards;
+}
+
+/*
+ * lookup_object - Find the object in the hash index. Writers call it with
+ *                 the shard lock. A reader may call it without, inside an
+ *                 epoch section so the objects it walks are not freed, and
+ *                 must retry a miss while index_changed() is true: a
+ *                 concurrent move of the object can hide it.
+ */
+static struct object *lookup_object(struct objecthead *head,
+                                    const char *url, unsigned int hash)
+{
+    /* The bucket array is published before its size, see grow_buckets */
+    unsigned int nbuckets = __atomic_load_n(&head->nbuckets, __ATOMIC_ACQUIRE);
+    struct object **buckets = __atomic_load_n(&head->buckets, __ATOMIC_ACQUIRE);
+    struct object *current;
+
+    current = __atomic_load_n(&buckets[hash & (nbuckets - 1)], __ATOMIC_ACQUIRE);
+    while (current)
+    {
+        if (current->hash == hash && !strcmp(current->key, url))
+            return current;
+        current = __atomic_load_n(&current->hnext, __ATOMIC_ACQUIRE);
+    }
+
+    return NULL;
+}
+
+/*
+ * lookup_hash - Find an object by hash only, to replay a recorded hit. The
+ *               caller must hold the lock.
+ */
+static struct object *lookup_hash(struct objecthead *head, unsigned int hash)
+{
+    struct object *current = head->buckets[hash & (head->nbuckets - 1)];
+
+    while (current && current->hash != hash)
+        current = current->hnext;
+    return current;
+}
+
+/*
+ * index_write_begin - Mark the index as being changed, searches that miss
+ *                     meanwhile retry. The caller must hold the lock.
+ */
+static void index_write_begin(struct objecthead *head)
+{
+    head->seq++;
+    __sync_synchronize();
+}
+
+static void index_write_end(struct objecthead *head)
+{
+    __sync_synchronize();
+    head->seq++;
+}
+
+/*
+ * index_changed - Return 1 if a writer changed the index since seq was read,
+ *                 or is changing it.
+ */
+static int index_changed(struct objecthead *head, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || seq != __atomic_load_n(&head->seq, __ATOMIC_RELAXED);
+}
+
+/*
+ * index_tags - Add, or remove if add is 0, the "tag key" entries of the
+ *              Surrogate-Key tags of obj in the tag tree of head.
+ */
+static void index_tags(struct objecthead *head, struct object *obj, int add)
+{
+    char tags[HTTP_VALIDATOR_LEN], entry[TRIE_MAX_KEY];
+    char *tag, *save;
+    const char *data;
+    int len;
+
+    if (obj->vary || obj->tags_len == 0)
+        return;
+    data = get_object_head(obj, &len);
+    len = obj->tags_len < (int)sizeof(tags) ? obj->tags_len : sizeof(tags) - 1;
+    memcpy(tags, data + obj->tags_at, len);
+    tags[len] = '\0';
+    for (tag = strtok_r(tags, " \t", &save); tag;
+         tag = strtok_r(NULL, " \t", &save))
+    {
+        if (snprintf(entry, sizeof(entry), "%s %s", tag, obj->key) >=
+            (int)sizeof(entry))
+            continue;
+        if (add)
+            trie_insert(head->tags, entry, obj);
+        else if (trie_find(head->tags, entry) == obj)
+            trie_remove(head->tags, entry);
+    }
+}
+
+/*
+ * unlink_object - Remove the object from its hash bucket, the purge trees
+ *                 and the filter. The caller must hold the shard lock.
+ */
+static void unlink_object(struct objecthead *head, struct object *obj)
+{
+    struct object **pp = &head->buckets[obj->hash & (head->nbuckets - 1)];
+
+    if (trie_find(head->keys, obj->key) == obj)
+    {
+        trie_remove(head->keys, obj->key);
+        index_tags(head, obj, 0);
+    }
+
+    __atomic_add_fetch(&obj->generation, 1, __ATOMIC_RELEASE);
+    while (*pp && *pp != obj)
+        pp = &(*pp)->hnext;
+    /* obj->hnext is kept, a search may still be walking through obj */
+    if (*pp == NULL)
+        return;
+    index_write_begin(head);
+    __atomic_store_n(pp, obj->hnext, __ATOMIC_RELEASE);
+    index_write_end(head);
+    /* Once out of the index, a search may as well be told it is absent */
+    bloom_remove(head->filter, obj->hash);
+}
+
+/*
+ * grow_buckets - Double the hash index once the load factor exceeds 1.
+ *                Failing to grow is harmless, chains just get longer.
+ */
+static void grow_buckets(struct objecthead *head)
+{
+    unsigned int i, n = head->nbuckets * 2;
+    struct object **buckets, *current, *next;
+
+    buckets = (struct object**)calloc(n, sizeof(struct object*));
+    if (buckets == NULL)
+        return;
+
+    index_write_begin(head);
+    for (i = 0; i < head->nbuckets; i++)
+    {
+        current = head->buckets[i];
+        while (current)
+        {
+            next = current->hnext;
+            __atomic_store_n(&current->hnext, buckets[current->hash & (n - 1)],
+                             __ATOMIC_RELEASE);
+            buckets[current->hash & (n - 1)] = current;
+            current = next;
+        }
+    }
+    /*
+     * A search reading the new size reads the new array, one reading the
+     * old size may use either, both are large enough.
+     */
+    epoch_retire(head->buckets, free);
+    __atomic_store_n(&head->buckets, buckets, __ATOMIC_RELEASE);
+    __atomic_store_n(&head->nbuckets, n, __ATOMIC_RELEASE);
+    index_write_end(head);
+}
+
+/*
+ * identity_size - return the size of the object once decoded.
+ */
+static int identity_size(struct object *obj)
+{
+    return obj->identity ? obj->identity : obj->size;
+}
+
+/*
+ * link_object - Add a new object to head. The caller must hold the lock.
+ */
+static void link_object(struct objecthead *head, struct object *obj)
+{
+    struct object **bucket = &head->buckets[obj->hash & (head->nbuckets - 1)];
+
+    policy->on_insert(head->policy_ctx, &obj->node);
+    obj->hnext = *bucket;
+    /* In the filter before the index, a search never misses it there */
+    bloom_add(head->filter, obj->hash);
+    /* The object is complete before searches can see it */
+    index_write_begin(head);
+    __atomic_store_n(bucket, obj, __ATOMIC_RELEASE);
+    index_write_end(head);
+    head->size += obj->size;
+    head->identity_size += identity_size(obj);
+    head->count++;
+    /* Not found by the purges if out of memory */
+    if (trie_insert(head->keys, obj->key, obj) == 0)
+        index_tags(head, obj, 1);
+    if ((unsigned int)head->count > head->nbuckets)
+        grow_buckets(head);
+}
+
+/*
+ * init_object - Initialize the header of a new object of len bytes. Its key
+ *               is copied to key, the room left for it in the allocation
+ *               of the object.
+ */
+static void init_object(struct object *obj, const char *url,
+                        unsigned int hash, int len, char *key)
+{
+    obj->data = NULL;
+    obj->chunks = NULL;
+    obj->segment = NULL;
+    obj->mapped = 0;
+    obj->restored = 0;
+    obj->decoded = 0;
+    obj->vary = 0;
+    obj->identity = 0;
+    obj->patch_at = -1;
+    obj->patch_over = 0;
+    obj->head_len = 0;
+    obj->tags_at = 0;
+    obj->tags_len = 0;
+    strcpy(key, url);
+    obj->key = key;
+    obj->hash = hash;
+    obj->size = len; 
+    obj->refcnt = 1;
+    obj->generation = 0;
+    memset(&obj->node, 0, sizeof(obj->node));
+    obj->node.hash = hash;
+    obj->node.size = len;
+    obj->hnext = NULL;
+    obj->atime = cache_clock;
+    obj->expires = 0;
+    obj->grace = 0;
+    obj->generated = cache_clock;
+    obj->life_seq = 0;
+}
+
+/*
+ * read_lifetime - Compute when a response becomes stale and expired, from
+ *                 its headers.
+ */
+static void read_lifetime(const char *response, int len,
+                          struct cache_lifetime *life)
+{
+    life->expires = http_expires(response, len, cache_clock);
+    life->grace = life->expires + http_stale_grace(response, len);
+    life->generated = http_generated(response, len, cache_clock);
+}
+
+/*
+ * get_lifetime - Read the lifetime of the object. A revalidation changes it
+ *                without the lock, so the read is retried while a writer
+ *                is at it: the three times always go together.
+ */
+static void get_lifetime(struct object *obj, struct cache_lifetime *life)
+{
+    unsigned int seq;
+
+    do
+    {
+        seq = __atomic_load_n(&obj->life_seq, __ATOMIC_ACQUIRE);
+        life->expires = obj->expires;
+        life->grace = obj->grace;
+        life->generated = obj->generated;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&obj->life_seq, __ATOMIC_RELAXED));
+}
+
+/*
+ * store_lifetime - Publish a new lifetime of the object. The writers make
+ *                  the sequence odd in turn, the readers retry meanwhile.
+ */
+static void store_lifetime(struct object *obj, const struct cache_lifetime *life)
+{
+    unsigned int seq;
+
+    do
+        seq = obj->life_seq & ~1u;
+    while (!__sync_bool_compare_and_swap(&obj->life_seq, seq, seq + 1));
+    obj->expires = life->expires;
+    obj->grace = life->grace;
+    obj->generated = life->generated;
+    __sync_synchronize();
+    obj->life_seq = seq + 2;
+}
+
+/*
+ * set_patch_point - Find where the hop headers go when the object is sent.
+ *                   The chunks of a large object are shared with the fill
+ *                   they come from and are not stripped, it is only
+ *                   patched if it has no hop headers of its own.
+ */
+static void set_patch_point(struct object *obj)
+{
+    int len;
+    const char *head = get_object_head(obj, &len);
+
+    len = obj->head_len;
+    if (obj->chunks && http_strip_hop(head, len, NULL) != len)
+        return;
+    obj->patch_at = http_patch_point(head, len, &obj->patch_over);
+}
+
+/*
+ * parse_head - Find the end of the headers of the object and its
+ *              Surrogate-Key value, once: the header lookups that follow
+ *              read the header block only, never the body.
+ */
+static void parse_head(struct object *obj)
+{
+    int len, body;
+    const char *head = get_object_head(obj, &len), *tags;
+
+    body = http_body_offset(head, len);
+    obj->head_len = body < 0 ? 0 : body;
+    tags = http_header_at(head, obj->head_len, "Surrogate-Key", &len);
+    obj->tags_at = tags ? tags - head : 0;
+    obj->tags_len = tags ? len : 0;
+}
+
+/*
+ * set_expiry - Read the headers of the response the object holds: whether
+ *              the cache gzip encoded it and, unless the tier it comes from
+ *              kept it in life, its lifetime.
+ */
+static void set_expiry(struct object *obj, const struct cache_lifetime *life)
+{
+    int len;
+    const char *head = get_object_head(obj, &len);
+    struct cache_lifetime computed;
+    long identity;
+
+    parse_head(obj);
+    if (life == NULL)
+    {
+        read_lifetime(head, obj->head_len, &computed);
+        life = &computed;
+    }
+    store_lifetime(obj, life);
+    set_patch_point(obj);
+    /* Only whole objects are encoded */
+    if (obj->chunks == NULL && obj->head_len &&
+        (identity = gzip_identity_size(head, len)) > 0)
+        obj->identity = identity;
+}
+
+
+/*
+ * object_chunk_size - return the bytes asked to the arena for the object.
+ */
+static size_t object_chunk_size(struct object *obj)
+{
+    return sizeof(struct object) + obj->size + strlen(obj->key) + 1;
+}
+
+/*
+ * free_object - Free the object and its content.
+ */
+static void free_object(void *ptr)
+{
+    struct object *obj = ptr;
+    struct cache_chunk *chunk, *next;
+
+    if (obj->mapped)
+    {
+        disk_release(obj->segment);
+        free(obj);
+        return;
+    }
+    if (obj->decoded)
+    {
+        free(obj);
+        return;
+    }
+    if (obj->chunks == NULL)
+    {
+        slab_free(arena, obj, object_chunk_size(obj));
+        return;
+    }
+    for (chunk = obj->chunks; chunk; chunk = next)
+    {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(obj);
+}
+
+/*
+ * try_pin - Take a reference of an object found by a search, unless its
+ *           last reference is already gone.
+ */
+static int try_pin(struct object *obj)
+{
+    int refcnt;
+
+    while ((refcnt = __atomic_load_n(&obj->refcnt, __ATOMIC_ACQUIRE)) > 0)
+    {
+        if (__sync_bool_compare_and_swap(&obj->refcnt, refcnt, refcnt + 1))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * pin_object - Take one more reference of an object already pinned.
+ */
+struct object *pin_object(struct object *obj)
+{
+    __sync_add_and_fetch(&obj->refcnt, 1);
+    return obj;
+}
+
+/*
+ * release_object - Drop a reference of the object. The object is freed when
+ *                  the last reference is gone, so an evicted object stays
+ *                  valid until every connection sending it has finished.
+ */
+void release_object(struct object *obj)
+{
+    /* A search may still be looking at it, free it once it is done */
+    if (obj && __sync_sub_and_fetch(&obj->refcnt, 1) == 0)
+        epoch_retire(obj, free_object);
+}
+
+/*
+ * drain_hits - Replay the recorded lookups in the frequency sketch and the
+ *              eviction policy. The caller must hold the lock.
+ */
+static void drain_hits(struct objecthead *head)
+{
+    unsigned long lookups = head->lookups, entry;
+    struct object *obj;
+
+    /* The oldest ones were overwritten */
+    if (lookups - head->drained > HIT_BUFFER)
+        head->drained = lookups - HIT_BUFFER;
+    for (; head->drained != lookups; head->drained++)
+    {
+        entry = head->hit_buf[head->drained & (HIT_BUFFER - 1)];
+        sketch_increment(head->sketch, entry >> 1);
+        if ((entry & 1) && (obj = lookup_hash(head, entry >> 1)) != NULL)
+            policy->on_hit(head->policy_ctx, &obj->node);
+    }
+}
+
+/*
+ * record_lookup - Record a lookup of hash without the lock. The reader that
+ *                 fills the buffer replays it if the lock is free, or else
+ *                 leaves it to the next writer.
+ */
+static void record_lookup(struct objecthead *head, unsigned int hash, int hit)
+{
+    unsigned long n = __sync_fetch_and_add(&head->lookups, 1);
+
+    head->hit_buf[n & (HIT_BUFFER - 1)] = (unsigned long)hash << 1 | hit;
+    if ((n & (HIT_BUFFER - 1)) == HIT_BUFFER - 1 &&
+        pthread_mutex_trylock(&head->mtx) == 0)
+    {
+        drain_hits(head);
+        pthread_mutex_unlock(&head->mtx);
+    }
+}
+
+/*
+ * count_hit - Account a hit on obj, an object of head.
+ */
+static void count_hit(struct objecthead *head, struct object *obj)
+{
+    __sync_add_and_fetch(&head->hits, 1);
+    if (obj->restored)
+        __sync_add_and_fetch(&head->restored_hits, 1);
+    obj->atime = cache_clock;
+    record_lookup(head, obj->hash, 1);
+}
+
+/*
+ * search_in_head - Look the object up in head and pin it if found.
+ */
+static struct object *search_in_head(struct objecthead *head,
+                                     const char *url, unsigned int hash)
+{
+    struct object *current;
+    unsigned int seq;
+    int retries = 0;
+
+    if (!bloom_may_contain(head->filter, hash))
+    {
+        __sync_add_and_fetch(&head->filtered, 1);
+        record_lookup(head, hash, 0);
+        return NULL;
+    }
+
+    epoch_enter();
+    do
+    {
+        seq = __atomic_load_n(&head->seq, __ATOMIC_ACQUIRE);
+        current = lookup_object(head, url, hash);
+    } while (current == NULL && index_changed(head, seq) &&
+             ++retries < LOOKUP_RETRIES);
+    if (current && !try_pin(current))
+        current = NULL;
+    epoch_exit();
+
+    if (current)
+        count_hit(head, current);
+    else
+    {
+        __sync_add_and_fetch(&head->false_positives, 1);
+        record_lookup(head, hash, 0);
+    }
+    return current;
+}
+
+/*
+ * search_on_disk - Look the object up in the disk tier. Return a temporary
+ *                  object mapping the data on disk, or NULL if not found.
+ */
+static struct object *search_on_disk(const char *url, unsigned int hash)
+{
+    struct disk_ref ref;
+    struct object *obj;
+
+    if (disk_lookup(disk, url, hash, &ref) < 0)
+        return NULL;
+    if (ref.hits >= DISK_PROMOTE_HITS)
+        promote_object(url, hash, ref.data, ref.len, &ref.life);
+
+    if ((obj = malloc(sizeof(struct object) + strlen(url) + 1)) == NULL)
+    {
+        disk_release(ref.segment);
+        return NULL;
+    }
+    init_object(obj, url, hash, ref.len, (char*)(obj + 1));
+    obj->data = ref.data;
+    obj->segment = ref.segment;
+    obj->mapped = 1;
+    set_expiry(obj, &ref.life);
+    __sync_add_and_fetch(&disk_hits, 1);
+    return obj;
+}
+
+/*
+ * mark_restored - Flag the object of url in memory as restored from the
+ *                 snapshot, its hits count as restored hits.
+ */
+static void mark_restored(const char *url, unsigned int hash)
+{
+    struct objecthead *heads[2] = { get_shard(hash), &large };
+    struct object *obj;
+    int i;
+
+    for (i = 0; i < 2 && heads[i]->buckets; i++)
+    {
+        pthread_mutex_lock(&heads[i]->mtx);
+        if ((obj = lookup_object(heads[i], url, hash)) != NULL)
+            obj->restored = 1;
+        pthread_mutex_unlock(&heads[i]->mtx);
+    }
+}
+
+/*
+ * search_in_snapshot - Look the object up in the snapshot of the previous
+ *                      run. A hit restores it to memory, and returns a
+ *                      temporary object mapping the snapshot, or NULL if not
+ *                      found.
+ */
+static struct object *search_in_snapshot(const char *url, unsigned int hash)
+{
+    const char *data;
+    struct cache_lifetime life;
+    struct object *obj;
+    int len;
+
+    if (snapshot_lookup(snapshot, url, hash, &data, &len, &life) < 0)
+        return NULL;
+    promote_object(url, hash, data, len, &life);
+    mark_restored(url, hash);
+
+    if ((obj = malloc(sizeof(struct object) + strlen(url) + 1)) == NULL)
+        return NULL;
+    init_object(obj, url, hash, len, (char*)(obj + 1));
+    obj->data = data;
+    obj->mapped = 1;
+    set_expiry(obj, &life);
+    __sync_add_and_fetch(&snapshot_hits, 1);
+    return obj;
+}
+
+/*
+ * search_other_tiers - Search the tiers after the shards: the large object
+ *                      cache, the disk tier, then the snapshot.
+ */
+static struct object *search_other_tiers(const char *url, unsigned int hash)
+{
+    struct object *current = NULL;
+
+    if (large.buckets)
+        current = search_in_head(&large, url, hash);
+    if (current == NULL && disk)
+        current = search_on_disk(url, hash);
+    if (current == NULL && snapshot)
+        current = search_in_snapshot(url, hash);
+    return current;
+}
+
+/*
+ * search_in_cache - Search a specified object in cache database.
+ * Return the cache object pointer if found, or NULL if not found. The
+ * object is pinned, call release_object() when it is no longer used.
+ */
+struct object *search_in_cache(const char *url, unsigned int hash)
+{
+    struct object *current = search_in_head(get_shard(hash), url, hash);
+
+    return current ? current : search_other_tiers(url, hash);
+}
+
+/*
+ * object_iov - Describe the content of obj with iovecs, one per chunk.
+ *              Return the number of iovecs, or -1 if out of memory. Free
+ *              iov when done.
+ */
+static int object_iov(struct object *obj, struct iovec **iov)
+{
+    struct cache_chunk *chunk;
+    int n = 1;
+
+    for (chunk = obj->chunks; chunk && chunk->next; chunk = chunk->next)
+        n++;
+    if ((*iov = malloc(n * sizeof(struct iovec))) == NULL)
+        return -1;
+    if (obj->chunks == NULL)
+    {
+        (*iov)[0].iov_base = (char*)obj->data;
+        (*iov)[0].iov_len = obj->size;
+        return 1;
+    }
+    for (n = 0, chunk = obj->chunks; chunk; chunk = chunk->next, n++)
+    {
+        (*iov)[n].iov_base = chunk->data;
+        (*iov)[n].iov_len = chunk->len;
+    }
+    return n;
+}
+
+/*
+ * spill_object - Store an evicted object in the disk tier. It is copied
+ *                with the shard lock held, in the mapped segment, so it
+ *                only costs a memcpy in the page cache.
+ */
+static void spill_object(struct object *obj)
+{
+    struct cache_lifetime life;
+    struct iovec *iov;
+    int n;
+
+    if ((n = object_iov(obj, &iov)) < 0)
+        return;
+    get_lifetime(obj, &life);
+    disk_store(disk, obj->key, obj->hash, &life, iov, n);
+    free(iov);
+}
+
+/*
+ * remove_object - Take the object out of head. The caller must hold the lock.
+ */
+static void remove_object(struct objecthead *head, struct object *obj)
+{
+    policy->on_remove(head->policy_ctx, &obj->node, 0);
+    unlink_object(head, obj);
+    head->count--;
+    head->size -= obj->size;
+    head->identity_size -= identity_size(obj);
+    release_object(obj);
+}
+
+/*
+ * drop_stale - A new response of url is inserted in head, remove the
+ *              previous one unless it is still fresh. Return -1 if a fresh
+ *              one is kept. The caller must hold the lock.
+ */
+static int drop_stale(struct objecthead *head, const char *url,
+                      unsigned int hash)
+{
+    struct object *old = lookup_object(head, url, hash);
+    struct cache_lifetime life;
+
+    if (old == NULL)
+        return 0;
+    get_lifetime(old, &life);
+    if (life.expires > cache_clock)
+        return -1;
+    remove_object(head, old);
+    return 0;
+}
+
+/*
+ * drop_moved - A new response of url went to the other head than the
+ *              previous one, because of its size. Remove the stale one.
+ */
+static void drop_moved(struct objecthead *head, const char *url,
+                       unsigned int hash)
+{
+    if (head->buckets == NULL)
+        return;
+    pthread_mutex_lock(&head->mtx);
+    drop_stale(head, url, hash);
+    pthread_mutex_unlock(&head->mtx);
+}
+
+/*
+ * drop_victim - Evict the object, to the disk tier if there is one. The
+ *               lock of the head must be held.
+ */
+static void drop_victim(struct objecthead *head, struct object *eviction)
+{
+    policy->on_remove(head->policy_ctx, &eviction->node, 1);
+    /* A marker would be read back as a response */
+    if (disk && !eviction->vary)
+        spill_object(eviction);
+    unlink_object(head, eviction);
+    head->count--;
+    head->size -= eviction->size;
+    head->identity_size -= identity_size(eviction);
+    release_object(eviction);
+}
+
+/*
+ * evict_object - Evict the victim chosen by the eviction policy.
+ */
+static void evict_object(struct objecthead *head)
+{
+    struct policy_node *node;
+    
+    /*
+     * Caution, the cache database has locked in function insert_object
+     */
+    if ((node = policy->choose_victim(head->policy_ctx)) == NULL)
+        return;
+    drop_victim(head, node_to_object(node));
+}
+
+/*
+ * evict_chunk - Evict the object held in a chunk of a slab page moved to
+ *               another size class. The chunk may not hold an object yet,
+ *               so it is only looked for by address in its bucket.
+ *               Return 1 if it was in the cache.
+ */
+static int evict_chunk(void *ctx, void *chunk)
+{
+    struct object *obj = chunk;
+    struct objecthead *head = get_shard(obj->hash);
+    struct object *current;
+
+    pthread_mutex_lock(&head->mtx);
+    current = head->buckets[obj->hash & (head->nbuckets - 1)];
+    while (current && current != obj)
+        current = current->hnext;
+    if (current)
+        drop_victim(head, obj);
+    pthread_mutex_unlock(&head->mtx);
+
+    return current != NULL;
+}
+
+/*
+ * admit_object - Return 1 if an object of len bytes with the given hash
+ *                should replace the policy victim, 0 if not. fits is 0 if
+ *                the slab arena had no chunk for it.
+ */
+static int admit_object(struct objecthead *head, unsigned int hash, int len,
+                        int fits)
+{
+    struct policy_node *victim;
+
+    if (!admission || (fits && len <= head->capacity - head->size))
+        return 1;
+
+    victim = policy->choose_victim(head->policy_ctx);
+    return victim == NULL ||
+           sketch_estimate(head->sketch, hash) >
+           sketch_estimate(head->sketch, victim->hash);
+}
+
+/*
+ * make_object - Fill a new object in the chunk p, with the content stripped
+ *               of its hop-by-hop headers, followed by its key. A Vary
+ *               marker is copied as is, and can always be replaced. The
+ *               lifetime is read from the headers if life is NULL.
+ */
+static struct object *make_object(void *p, const char *url, unsigned int hash,
+                                  const char *content, int len, int vary,
+                                  const struct cache_lifetime *life)
+{
+    struct object *obj = (struct object*)p;
+    char *data = (char*)(obj + 1);
+
+    if (vary)
+        memcpy(data, content, len);
+    else
+        len = http_strip_hop(content, len, data);
+    init_object(obj, url, hash, len, data + len);
+    obj->data = data;
+    obj->vary = vary;
+    if (!vary)
+        set_expiry(obj, life);
+
+    return obj;
+}
+
+/*
+ * insert_object - Insert a new object of the content, as is but its hop-by-hop
+ *                 headers, or a Vary marker. life is the lifetime kept by
+ *                 the tier it comes from, or NULL for a new response.
+ * Return 0 if success, or -1 if failed.
+ */
+static int insert_object(const char *url, unsigned int hash,
+                         const char *content, int len, int vary,
+                         const struct cache_lifetime *life)
+{
+    struct objecthead *head = get_shard(hash);
+    struct object *p = NULL, *victim;
+    struct policy_node *node;
+    void *chunk;
+    size_t chunk_size, class_size;
+    int size, i, freed = 0;
+    
+    if (len > MAX_OBJECT_SIZE || len <= 0 || strlen(url) >= MAX_REQUEST)
+        return -1;
+    size = vary ? len : http_strip_hop(content, len, NULL);
+    chunk_size = sizeof(struct object) + size + strlen(url) + 1;
+    
+    /* Make an new object, out of the lock if the arena has room */
+    if ((chunk = slab_alloc(arena, chunk_size)) != NULL)
+        p = make_object(chunk, url, hash, content, len, vary, life);
+
+    /* Critical section */
+    pthread_mutex_lock(&head->mtx);
+    /* Let the policy and the admission see the recent hits first */
+    drain_hits(head);
+    /* To avoid insert an exist item, a stale one is replaced */
+    if (drop_stale(head, url, hash) < 0)
+    {
+        pthread_mutex_unlock(&head->mtx);
+        release_object(p);
+        return -1;
+    }
+
+    if (!admit_object(head, hash, size, p != NULL))
+    {
+        pthread_mutex_unlock(&head->mtx);
+        release_object(p);
+        return -1;
+    }
+
+    if (p == NULL)
+    {
+        /*
+         * The arena is full. Evict a few victims, until one frees a chunk
+         * of the size class, or move a page of another class to it
+         */
+        class_size = slab_chunk_size(arena, chunk_size);
+        for (i = 0; i < ALLOC_EVICTIONS && !freed; i++)
+        {
+            if ((node = policy->choose_victim(head->policy_ctx)) == NULL)
+                break;
+            victim = node_to_object(node);
+            freed = slab_chunk_size(arena, object_chunk_size(victim)) == class_size;
+            drop_victim(head, victim);
+        }
+        /* The page objects are evicted from their own shards */
+        pthread_mutex_unlock(&head->mtx);
+        if (freed || slab_reassign(arena, chunk_size) >= 0)
+        {
+            /* The chunks go back to the arena once no search can see them */
+            epoch_synchronize();
+            if ((chunk = slab_alloc(arena, chunk_size)) != NULL)
+                p = make_object(chunk, url, hash, content, len, vary, life);
+        }
+        if (p == NULL)
+            return -1;
+        pthread_mutex_lock(&head->mtx);
+        if (drop_stale(head, url, hash) < 0)
+        {
+            pthread_mutex_unlock(&head->mtx);
+            release_object(p);
+            return -1;
+        }
+    }
+
+    while ((size + head->size) > head->capacity && head->count > 0)
+        evict_object(head);
+
+    link_object(head, p);
+    pthread_mutex_unlock(&head->mtx);
+    drop_moved(&large, url, hash);
+
+    return 0;
+}
+
+/*
+ * insert_in_cache - Insert a new object in the cache database, gzip encoded
+ *                   if compression is enabled and it is worth it.
+ * Return 0 if success, or -1 if failed.
+ */
+int insert_in_cache(const char *url, unsigned int hash,
+                    const char *content, int len)
+{
+    struct timespec start;
+    char *encoded;
+    int n, ret;
+
+    if (!compression || len > MAX_OBJECT_SIZE || !gzip_compressible(content, len) ||
+        (encoded = malloc(len)) == NULL)
+        return insert_object(url, hash, content, len, 0, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = gzip_encode(content, len, encoded, len);
+    __sync_add_and_fetch(&encodes, 1);
+    __sync_add_and_fetch(&encode_ns, (long)(elapsed_ms(&start) * 1e6));
+    ret = n > 0 ? insert_object(url, hash, encoded, n, 0, NULL) :
+                  insert_object(url, hash, content, len, 0, NULL);
+    free(encoded);
+    return ret;
+}
+
+/*
+ * insert_vary_in_cache - Record that the responses of url vary on the
+ *                        request headers named in vary. They are stored
+ *                        under secondary keys, see get_object_vary().
+ * Return 0 if success, or -1 if failed.
+ */
+int insert_vary_in_cache(const char *url, unsigned int hash, const char *vary)
+{
+    return insert_object(url, hash, vary, strlen(vary) + 1, 1, NULL);
+}
+
+/*
+ * insert_chunks - Insert a large object made of a chain of chunks, with the
+ *                 lifetime life, or read from its headers if NULL.
+ */
+static int insert_chunks(const char *url, unsigned int hash,
+                         struct cache_chunk *chunks, int len,
+                         const struct cache_lifetime *life,
+                         struct object **pinned)
+{
+    struct object *p;
+
+    if (large.buckets == NULL || len <= MAX_OBJECT_SIZE ||
+        len > get_cache_object_limit() || strlen(url) >= MAX_REQUEST)
+        return -1;
+    if ((p = malloc(sizeof(struct object) + strlen(url) + 1)) == NULL)
+        return -1;
+    init_object(p, url, hash, len, (char*)(p + 1));
+
+    pthread_mutex_lock(&large.mtx);
+    drain_hits(&large);
+    if (drop_stale(&large, url, hash) < 0 || !admit_object(&large, hash, len, 1))
+    {
+        pthread_mutex_unlock(&large.mtx);
+        free(p);
+        return -1;
+    }
+
+    while ((len + large.size) > large.capacity && large.count > 0)
+        evict_object(&large);
+
+    p->chunks = chunks;
+    set_expiry(p, life);
+    p->refcnt = 2;
+    link_object(&large, p);
+    pthread_mutex_unlock(&large.mtx);
+    drop_moved(get_shard(hash), url, hash);
+
+    *pinned = p;
+    return 0;
+}
+
+/*
+ * insert_chunks_in_cache - Insert a large object made of a chain of chunks.
+ *                          On success the cache owns the chunks, and pinned
+ *                          gets a reference to the new object, so the chunks
+ *                          stay valid for the caller until it releases it.
+ *                          Return 0 if success, or -1 if failed, the chunks
+ *                          still belong to the caller then.
+ */
+int insert_chunks_in_cache(const char *url, unsigned int hash,
+                           struct cache_chunk *chunks, int len,
+                           struct object **pinned)
+{
+    return insert_chunks(url, hash, chunks, len, NULL, pinned);
+}
+
+/*
+ * promote_object - Copy an object found on disk or in the snapshot back to
+ *                  memory, with the lifetime the tier kept.
+ */
+static void promote_object(const char *url, unsigned int hash, const char *data,
+                           int size, const struct cache_lifetime *life)
+{
+    struct cache_chunk *chunks = NULL, **tail = &chunks, *next;
+    struct object *pinned;
+    int len, n;
+
+    if (size <= MAX_OBJECT_SIZE)
+    {
+        /* It is stored as it was in memory, encoded or not */
+        insert_object(url, hash, data, size, 0, life);
+        return;
+    }
+
+    for (len = 0; len < size; len += n)
+    {
+        if ((*tail = malloc(sizeof(struct cache_chunk))) == NULL)
+            break;
+        n = size - len < CACHE_CHUNK_SIZE ? size - len : CACHE_CHUNK_SIZE;
+        memcpy((*tail)->data, data + len, n);
+        (*tail)->len = n;
+        (*tail)->next = NULL;
+        tail = &(*tail)->next;
+    }
+    if (len == size &&
+        insert_chunks(url, hash, chunks, len, life, &pinned) == 0)
+    {
+        release_object(pinned);
+        return;
+    }
+    for (; chunks; chunks = next)
+    {
+        next = chunks->next;
+        free(chunks);
+    }
+}
+
+/*
+ * remove_from_cache - Remove the object of url from memory. Readers holding
+ *                     it keep it until they release it.
+ */
+void remove_from_cache(const char *url, unsigned int hash)
+{
+    struct objecthead *heads[2] = { get_shard(hash), &large };
+    struct object *obj;
+    int i;
+
+    for (i = 0; i < 2 && heads[i]->buckets; i++)
+    {
+        pthread_mutex_lock(&heads[i]->mtx);
+        if ((obj = lookup_object(heads[i], url, hash)) != NULL)
+            remove_object(heads[i], obj);
+        pthread_mutex_unlock(&heads[i]->mtx);
+    }
+}
+
+/*
+ * A purge in progress. The objects it selects in a head are collected
+ * from its trees first, then removed.
+ */
+struct purge {
+    PurgeType type;
+    const char *pattern;
+    int len;
+    struct object **objs;
+    int count;
+    int max;
+};
+
+/*
+ * purge_match - return 1 if the purge selects the object of key, of len
+ *               bytes at data.
+ */
+static int purge_match(void *ctx, const char *key, const char *data, int len)
+{
+    struct purge *purge = ctx;
+    char tags[HTTP_VALIDATOR_LEN];
+    char *tag, *save;
+
+    switch (purge->type)
+    {
+    case PURGE_URL:
+        return !strncmp(key, purge->pattern, purge->len) &&
+               (key[purge->len] == '\0' || key[purge->len] == '\n');
+    case PURGE_PREFIX:
+        return !strncmp(key, purge->pattern, purge->len);
+    default:
+        if (http_header(data, len, "Surrogate-Key", tags, sizeof(tags)) < 0)
+            return 0;
+        for (tag = strtok_r(tags, " \t", &save); tag;
+             tag = strtok_r(NULL, " \t", &save))
+        {
+            if (!strcmp(tag, purge->pattern))
+                return 1;
+        }
+        return 0;
+    }
+}
+
+/*
+ * collect_object - Visit an entry of a purge tree, keep the object if the
+ *                  purge selects it. The trees can't change during a visit.
+ */
+static void collect_object(void *ctx, const char *key, void *value)
+{
+    struct purge *purge = ctx;
+    struct object **objs;
+
+    /* A url is a prefix of other urls than its variants */
+    if (purge->type == PURGE_URL && !purge_match(purge, key, NULL, 0))
+        return;
+    if (purge->count == purge->max)
+    {
+        objs = realloc(purge->objs, (purge->max * 2 + 16) * sizeof(*objs));
+        if (objs == NULL)
+            return;
+        purge->objs = objs;
+        purge->max = purge->max * 2 + 16;
+    }
+    purge->objs[purge->count++] = value;
+}
+
+/*
+ * purge_head - Remove the objects of head the purge selects, found in its
+ *              trees from prefix, without looking at the others. Readers
+ *              keep the objects they hold until they release them.
+ */
+static int purge_head(struct objecthead *head, struct purge *purge,
+                      const char *prefix)
+{
+    int i;
+
+    pthread_mutex_lock(&head->mtx);
+    purge->count = 0;
+    trie_prefix(purge->type == PURGE_TAG ? head->tags : head->keys, prefix,
+                collect_object, purge);
+    for (i = 0; i < purge->count; i++)
+        remove_object(head, purge->objs[i]);
+    pthread_mutex_unlock(&head->mtx);
+    return purge->count;
+}
+
+/*
+ * purge_cache - Remove from every tier the objects of the url pattern, the
+ *               keys starting with pattern, or the responses tagged with
+ *               pattern. Return the number of objects removed.
+ */
+long purge_cache(PurgeType type, const char *pattern)
+{
+    struct purge purge;
+    char prefix[TRIE_MAX_KEY];
+    unsigned int i;
+    long purged = 0;
+
+    memset(&purge, 0, sizeof(purge));
+    purge.type = type;
+    purge.pattern = pattern;
+    purge.len = strlen(pattern);
+    /* A tag entry is the tag, a space, then the key */
+    if (snprintf(prefix, sizeof(prefix), type == PURGE_TAG ? "%s " : "%s",
+                 pattern) >= (int)sizeof(prefix))
+        return 0;
+
+    for (i = 0; i < nshards; i++)
+        purged += purge_head(&shards[i], &purge, prefix);
+    if (large.buckets)
+        purged += purge_head(&large, &purge, prefix);
+    free(purge.objs);
+    if (disk)
+        purged += disk_purge(disk, purge_match, &purge);
+    if (snapshot)
+    {
+        pthread_mutex_lock(&snapshot_mtx);
+        purged += snapshot_purge(snapshot, purge_match, &purge);
+        pthread_mutex_unlock(&snapshot_mtx);
+    }
+
+    __sync_add_and_fetch(&purges, 1);
+    __sync_add_and_fetch(&purged_objects, purged);
+    return purged;
+}
+
+/*
+ * get_object_vary - return the Vary header of the responses of the url if
+ *                   obj is its Vary marker, or NULL if obj is a response.
+ *                   A request for the url is then looked up again, with
+ *                   the secondary key of its values of these headers.
+ */
+const char *get_object_vary(struct object *obj)
+{
+    return obj->vary ? obj->data : NULL;
+}
+
+/*
+ * get_object_content - return the pointer of object data, NULL for a large
+ *                      object, read it with read_object() instead.
+ */
+const char* get_object_content(struct object *obj)
+{
+    return obj->data;
+}
+
+/*
+ * get_object_head - return the pointer of the first bytes of the object, the
+ *                   whole content or its first chunk, and set len to their
+ *                   size. The response headers are parsed from there.
+ */
+const char* get_object_head(struct object *obj, int *len)
+{
+    if (obj->chunks)
+    {
+        *len = obj->chunks->len;
+        return obj->chunks->data;
+    }
+    *len = obj->size;
+    return obj->data;
+}
+
+/*
+ * negotiate_object - return the object to send to a client, given whether
+ *                    it accepts gzip: obj itself, or if the cache encoded it
+ *                    and the client does not accept gzip, a private decoded
+ *                    copy, and obj is released. Return NULL and release obj
+ *                    if it can't be decoded.
+ */
+struct object *negotiate_object(struct object *obj, int gzip)
+{
+    struct timespec start;
+    struct cache_lifetime life;
+    struct object *p;
+    int len;
+
+    if (obj->identity == 0)
+        return obj;
+    if (gzip)
+    {
+        __sync_add_and_fetch(&encoded_hits, 1);
+        return obj;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((p = malloc(sizeof(struct object) + obj->identity +
+                    strlen(obj->key) + 1)) != NULL)
+    {
+        init_object(p, obj->key, obj->hash, obj->identity,
+                    (char*)(p + 1) + obj->identity);
+        p->data = (char*)(p + 1);
+        p->decoded = 1;
+        get_lifetime(obj, &life);
+        store_lifetime(p, &life);
+        len = gzip_decode(obj->data, obj->size, (char*)p->data, obj->identity);
+        if (len != obj->identity)
+        {
+            free(p);
+            p = NULL;
+        }
+        else
+        {
+            parse_head(p);
+            set_patch_point(p);
+        }
+    }
+    __sync_add_and_fetch(&decodes, 1);
+    __sync_add_and_fetch(&decode_ns, (long)(elapsed_ms(&start) * 1e6));
+    release_object(obj);
+    return p;
+}
+
+/*
+ * get_object_freshness - return whether the object may be served without
+ *                        asking the origin, served while it is refreshed,
+ *                        or must be revalidated first.
+ */
+Freshness get_object_freshness(struct object *obj)
+{
+    struct cache_lifetime life;
+
+    get_lifetime(obj, &life);
+    if (life.expires > cache_clock)
+        return OBJECT_FRESH;
+    return life.grace > cache_clock ? OBJECT_STALE : OBJECT_EXPIRED;
+}
+
+/*
+ * update_lifetime - Give the object of url in memory its new lifetime.
+ */
+static void update_lifetime(const char *url, unsigned int hash,
+                            const struct cache_lifetime *life)
+{
+    struct objecthead *heads[2] = { get_shard(hash), &large };
+    struct object *obj;
+    int i;
+
+    for (i = 0; i < 2 && heads[i]->buckets; i++)
+    {
+        pthread_mutex_lock(&heads[i]->mtx);
+        if ((obj = lookup_object(heads[i], url, hash)) != NULL)
+            store_lifetime(obj, life);
+        pthread_mutex_unlock(&heads[i]->mtx);
+    }
+}
+
+/*
+ * revalidate_object - The origin answered 304 Not Modified to a conditional
+ *                     request for obj, its headers give the new lifetime.
+ *                     obj may be a disk or snapshot hit, or a decoded copy:
+ *                     the tiers holding the object get it too.
+ */
+void revalidate_object(struct object *obj, const char *response, int len)
+{
+    struct cache_lifetime life;
+
+    read_lifetime(response, len, &life);
+    store_lifetime(obj, &life);
+    update_lifetime(obj->key, obj->hash, &life);
+    if (disk)
+        disk_set_lifetime(disk, obj->key, obj->hash, &life);
+}
+
+/*
+ * get_object_size - return the size of object content
+ */
+int get_object_size(struct object *obj)
+{
+    return obj->size;
+}
+
+/*
+ * drop_slot - Release the object of an L1 slot of this thread.
+ */
+static void drop_slot(struct l1_slot *slot)
+{
+    /* The cache it came from is gone, and its memory with it */
+    if (slot->instance == cache_instance)
+        release_object(slot->obj);
+    l1_bytes -= slot->size;
+    slot->obj = NULL;
+}
+
+/*
+ * slot_valid - Return 1 if the object of the slot is still in the cache.
+ */
+static int slot_valid(struct l1_slot *slot)
+{
+    return slot->instance == cache_instance &&
+           __atomic_load_n(&slot->obj->generation, __ATOMIC_ACQUIRE) ==
+           slot->generation;
+}
+
+/*
+ * search_in_cache_local - Search the cache like search_in_cache(), through
+ *                         the L1 table of the calling thread. The objects
+ *                         hit in the shards are kept there, so the next
+ *                         hits don't touch any shared structure.
+ */
+struct object *search_in_cache_local(const char *url, unsigned int hash)
+{
+    struct l1_slot *slot = &l1[hash % L1_SLOTS];
+    struct l1_slot *sweep = &l1[l1_sweep++ % L1_SLOTS];
+    struct objecthead *head;
+    struct object *obj;
+
+    if (sweep->obj && !slot_valid(sweep))
+        drop_slot(sweep);
+
+    if (slot->obj && slot_valid(slot) && slot->obj->hash == hash &&
+        strcmp(slot->obj->key, url) == 0)
+    {
+        obj = pin_object(slot->obj);
+        if (++slot->hits % L1_SAMPLE == 0)
+            count_hit(slot->head, obj);
+        else
+        {
+            obj->atime = cache_clock;
+            if (++l1_pending == L1_BATCH)
+            {
+                __sync_add_and_fetch(&l1_hits, l1_pending);
+                l1_pending = 0;
+            }
+        }
+        return obj;
+    }
+
+    head = get_shard(hash);
+    if ((obj = search_in_head(head, url, hash)) == NULL)
+        return search_other_tiers(url, hash);
+
+    if (slot->obj)
+        drop_slot(slot);
+    if (l1_bytes + obj->size <= l1_budget)
+    {
+        slot->obj = pin_object(obj);
+        slot->head = head;
+        slot->instance = cache_instance;
+        slot->hits = 0;
+        slot->size = obj->size;
+        l1_bytes += obj->size;
+        /* Unlinked before this load, the next search sees it */
+        slot->generation = __atomic_load_n(&obj->generation, __ATOMIC_ACQUIRE);
+    }
+    return obj;
+}
+
+/*
+ * flush_local_cache - Release the objects of the L1 table of the calling
+ *                     thread, before it exits or the cache is destroyed.
+ */
+void flush_local_cache(void)
+{
+    int i;
+
+    for (i = 0; i < L1_SLOTS; i++)
+    {
+        if (l1[i].obj)
+            drop_slot(&l1[i]);
+    }
+    __sync_add_and_fetch(&l1_hits, l1_pending);
+    l1_pending = 0;
+}
+
+/*
+ * get_object_file - Return the file descriptor holding the content of obj,
+ *                   and set offset to its position, or return -1 if the
+ *                   object is in memory only.
+ */
+int get_object_file(struct object *obj, off_t *offset)
+{
+    if (!obj->mapped)
+        return obj->chunks ? -1 : slab_fd(arena, obj->data, offset);
+    if (obj->segment)
+        return disk_segment_fd(obj->segment, obj->data, offset);
+    return snapshot_fd(snapshot, obj->data, offset);
+}
+
+/*
+ * open_object - Start sending obj to a client. The cursor gets the hop
+ *               headers of this response, sent in place of the stored Age
+ *               header or before the blank line ending the headers. The
+ *               rest of the response goes as stored.
+ */
+void open_object(struct object *obj, struct object_cursor *cursor)
+{
+    struct cache_lifetime life;
+    long age;
+
+    get_lifetime(obj, &life);
+    age = cache_clock - life.generated;
+    memset(cursor, 0, sizeof(*cursor));
+    if (obj->patch_at < 0)
+        return;
+    cursor->patch_len = snprintf(cursor->patch, sizeof(cursor->patch),
+                                 "Connection: close\r\n" VIA_HEADER "Age: %ld\r\n",
+                                 age > 0 ? age : 0);
+}
+
+/*
+ * patching - return 1 if the hop headers of the cursor are not all sent yet.
+ */
+static int patching(const struct object_cursor *cursor)
+{
+    return cursor->patched < cursor->patch_len;
+}
+
+/*
+ * get_object_offset - return the offset in obj of the next byte to send, or
+ *                     -1 while the hop headers are not all sent, the bytes
+ *                     to send are not contiguous in obj until then.
+ */
+long get_object_offset(struct object *obj, struct object_cursor *cursor)
+{
+    return patching(cursor) ? -1 : cursor->sent;
+}
+
+/*
+ * get_object_pending - return the bytes of the response still to send.
+ */
+long get_object_pending(struct object *obj, struct object_cursor *cursor)
+{
+    long pending = obj->size - cursor->sent;
+
+    if (patching(cursor))
+        pending += cursor->patch_len - cursor->patched - obj->patch_over;
+    return pending;
+}
+
+/*
+ * read_range - Fill at most max iovecs with the content of obj from offset
+ *              pos, which is at offset in chunk for a large object, up to
+ *              offset end. Return the number of iovecs.
+ */
+static int read_range(struct object *obj, const struct cache_chunk *chunk,
+                      int offset, long pos, long end, struct iovec *iov, int max)
+{
+    long n;
+    int i = 0;
+
+    if (obj->chunks == NULL)
+    {
+        if (pos >= end || max < 1)
+            return 0;
+        iov[0].iov_base = (char*)obj->data + pos;
+        iov[0].iov_len = end - pos;
+        return 1;
+    }
+
+    for (; chunk && i < max && pos < end; chunk = chunk->next, offset = 0)
+    {
+        n = chunk->len - offset < end - pos ? chunk->len - offset : end - pos;
+        if (n > 0)
+        {
+            iov[i].iov_base = (char*)chunk->data + offset;
+            iov[i].iov_len = n;
+            pos += n;
+            i++;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * read_object - Fill at most max iovecs with the response after the cursor:
+ *               the stored head up to the patch point, the hop headers, then
+ *               the rest of the content. Return the number of iovecs, 0 if
+ *               all was read.
+ */
+int read_object(struct object *obj, struct object_cursor *cursor,
+                struct iovec *iov, int max)
+{
+    int i, rest;
+
+    if (cursor->chunk == NULL && cursor->sent == 0)
+        cursor->chunk = obj->chunks;
+    if (!patching(cursor))
+        return read_range(obj, cursor->chunk, cursor->offset, cursor->sent,
+                          obj->size, iov, max);
+
+    i = read_range(obj, cursor->chunk, cursor->offset, cursor->sent,
+                   obj->patch_at, iov, max);
+    if (i < max)
+    {
+        iov[i].iov_base = cursor->patch + cursor->patched;
+        iov[i].iov_len = cursor->patch_len - cursor->patched;
+        i++;
+    }
+    /* The patch point is in the first chunk */
+    rest = obj->patch_at + obj->patch_over;
+    return i + read_range(obj, obj->chunks, rest, rest, obj->size,
+                          iov + i, max - i);
+}
+
+/*
+ * advance_object - Move the cursor len bytes forward in the content of obj.
+ */
+static void advance_object(struct object *obj, struct object_cursor *cursor,
+                           long len)
+{
+    int n;
+
+    if (cursor->chunk == NULL && cursor->sent == 0)
+        cursor->chunk = obj->chunks;
+    cursor->sent += len;
+    while (obj->chunks && cursor->chunk && len > 0)
+    {
+        n = cursor->chunk->len - cursor->offset;
+        if (len < n)
+        {
+            cursor->offset += len;
+            break;
+        }
+        len -= n;
+        cursor->chunk = cursor->chunk->next;
+        cursor->offset = 0;
+    }
+}
+
+/*
+ * consume_object - Move the cursor len bytes of the response forward, after
+ *                  a write of the iovecs returned by read_object.
+ */
+void consume_object(struct object *obj, struct object_cursor *cursor, long len)
+{
+    long n;
+
+    while (len > 0)
+    {
+        if (!patching(cursor))
+        {
+            advance_object(obj, cursor, len);
+            return;
+        }
+        if (cursor->sent < obj->patch_at)
+        {
+            n = obj->patch_at - cursor->sent < len ? obj->patch_at - cursor->sent : len;
+            advance_object(obj, cursor, n);
+            len -= n;
+            continue;
+        }
+        n = cursor->patch_len - cursor->patched < len ?
+            cursor->patch_len - cursor->patched : len;
+        cursor->patched += n;
+        len -= n;
+        /* The stored header the patch replaces is never sent */
+        if (!patching(cursor))
+            advance_object(obj, cursor, obj->patch_over);
+    }
+}
+
+/*
+ * update_object_age - Update the object aging time
+ */
+void update_object_age(struct object *obj, time_t time)
+{
+    obj->atime = time;
+}
+
+/*
+ * count_stale_hit - A stale object was served while refreshed.
+ */
+void count_stale_hit(void)
+{
+    __sync_add_and_fetch(&stale_hits, 1);
+}
+
+/*
+ * count_refresh - Count an outcome of a background refresh.
+ */
+void count_refresh(RefreshResult result)
+{
+    __sync_add_and_fetch(&refreshes[result], 1);
+}
+
+/*
+ * get_cache_false_positive_rate - return the ratio of the misses in memory
+ *                                 the filters failed to tell. If filtered
+ *                                 is not NULL, set it to the number of
+ *                                 misses they told.
+ */
+double get_cache_false_positive_rate(long *filtered)
+{
+    unsigned int i;
+    long told = 0, passed = 0;
+
+    for (i = 0; i < nshards; i++)
+    {
+        told += __atomic_load_n(&shards[i].filtered, __ATOMIC_RELAXED);
+        passed += __atomic_load_n(&shards[i].false_positives, __ATOMIC_RELAXED);
+    }
+    if (large.buckets)
+    {
+        told += __atomic_load_n(&large.filtered, __ATOMIC_RELAXED);
+        passed += __atomic_load_n(&large.false_positives, __ATOMIC_RELAXED);
+    }
+    if (filtered)
+        *filtered = told;
+    return told + passed ? (double)passed / (told + passed) : 0;
+}
+
+/*
+ * get_cache_hit_ratio - return the ratio of the searches that found the
+ *                       object. If restored is not NULL, set it to the
+ *                       ratio of the searches that found an object restored
+ *                       from the snapshot of the previous run.
+ */
+double get_cache_hit_ratio(double *restored)
+{
+    unsigned int i;
+    long lookups = 0, hits = 0, restored_hits = 0;
+
+    for (i = 0; i < nshards; i++)
+    {
+        pthread_mutex_lock(&shards[i].mtx);
+        lookups += shards[i].lookups;
+        hits += shards[i].hits;
+        restored_hits += shards[i].restored_hits;
+        pthread_mutex_unlock(&shards[i].mtx);
+    }
+    if (large.buckets)
+    {
+        pthread_mutex_lock(&large.mtx);
+        hits += large.hits;
+        restored_hits += large.restored_hits;
+        pthread_mutex_unlock(&large.mtx);
+    }
+    hits += disk_hits + snapshot_hits;
+    restored_hits += snapshot_hits;
+    /* The L1 hits not reported to the shards */
+    lookups += l1_hits;
+    hits += l1_hits;
+
+    if (restored)
+        *restored = lookups ? (double)restored_hits / lookups : 0;
+    return lookups ? (double)hits / lookups : 0;
+}
+
+/*
+ * load_cache_snapshot - Map the snapshot saved at path by a previous run.
+ *                       Only its index is read, the objects are restored
+ *                       to memory when they are hit. The load time is
+ *                       reported to fp. Return the number of objects, or -1
+ *                       if there is no valid snapshot.
+ */
+int load_cache_snapshot(const char *path, FILE *fp)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((snapshot = snapshot_open(path)) == NULL)
+        return -1;
+    fprintf(fp, "snapshot: %d objects, %ld bytes loaded from %s in %.3f ms, "
+            "hit ratio %.1f%% when saved\n", snapshot_count(snapshot),
+            snapshot_bytes(snapshot), path, elapsed_ms(&start),
+            100 * snapshot_hit_ratio(snapshot));
+    return snapshot_count(snapshot);
+}
+
+static void save_object(SnapshotWriter *writer, struct object *obj)
+{
+    struct cache_lifetime life;
+    struct iovec *iov;
+    int n;
+
+    if ((n = object_iov(obj, &iov)) < 0)
+        return;
+    get_lifetime(obj, &life);
+    snapshot_writer_add(writer, obj->key, obj->hash, &life, iov, n);
+    free(iov);
+}
+
+/*
+ * save_head - Write the objects of head to the snapshot. They are pinned
+ *             under the lock and written out of it.
+ */
+static long save_head(SnapshotWriter *writer, struct objecthead *head)
+{
+    struct object **objs, *current;
+    unsigned int b;
+    int i, n = 0;
+    long bytes = 0;
+
+    pthread_mutex_lock(&head->mtx);
+    if ((objs = malloc((head->count + 1) * sizeof(struct object*))) == NULL)
+    {
+        pthread_mutex_unlock(&head->mtx);
+        return 0;
+    }
+    for (b = 0; b < head->nbuckets; b++)
+    {
+        for (current = head->buckets[b]; current; current = current->hnext)
+        {
+            __sync_add_and_fetch(&current->refcnt, 1);
+            objs[n++] = current;
+        }
+    }
+    pthread_mutex_unlock(&head->mtx);
+
+    for (i = 0; i < n; i++)
+    {
+        /* Markers are learnt again from the next responses */
+        if (!objs[i]->vary)
+        {
+            save_object(writer, objs[i]);
+            bytes += objs[i]->size;
+        }
+        release_object(objs[i]);
+    }
+    free(objs);
+    return bytes;
+}
+
+struct carry_ctx {
+    SnapshotWriter *writer;
+    long budget;
+};
+
+/*
+ * carry_object - Keep an object of the previous snapshot that was not hit
+ *                yet, while the snapshot is smaller than the cache.
+ */
+static void carry_object(void *ctx, const char *url, unsigned int hash,
+                         const struct cache_lifetime *life,
+                         const char *data, int len)
+{
+    struct carry_ctx *carry = ctx;
+    struct objecthead *heads[2] = { get_shard(hash), &large };
+    struct iovec iov;
+    struct object *obj = NULL;
+    int i;
+
+    if (len > carry->budget)
+        return;
+    for (i = 0; i < 2 && obj == NULL && heads[i]->buckets; i++)
+    {
+        pthread_mutex_lock(&heads[i]->mtx);
+        obj = lookup_object(heads[i], url, hash);
+        pthread_mutex_unlock(&heads[i]->mtx);
+    }
+    if (obj)
+        return;
+
+    iov.iov_base = (char*)data;
+    iov.iov_len = len;
+    if (snapshot_writer_add(carry->writer, url, hash, life, &iov, 1) == 0)
+        carry->budget -= len;
+}
+
+/*
+ * save_cache_snapshot - Write the objects in memory to a snapshot at path,
+ *                       for the next run. The result is reported to fp.
+ *                       Return the number of objects saved, or -1 if failed.
+ */
+int save_cache_snapshot(const char *path, FILE *fp)
+{
+    struct timespec start;
+    struct carry_ctx carry;
+    double ratio, restored;
+    unsigned int i;
+    int count, ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&snapshot_mtx);
+    if ((carry.writer = snapshot_writer_create(path)) == NULL)
+    {
+        pthread_mutex_unlock(&snapshot_mtx);
+        return -1;
+    }
+    carry.budget = 0;
+    for (i = 0; i < nshards; i++)
+        carry.budget += shards[i].capacity - save_head(carry.writer, &shards[i]);
+    if (large.buckets)
+        carry.budget += large.capacity - save_head(carry.writer, &large);
+    if (snapshot)
+        snapshot_foreach(snapshot, carry_object, &carry);
+
+    count = snapshot_writer_count(carry.writer);
+    ratio = get_cache_hit_ratio(&restored);
+    ret = snapshot_writer_commit(carry.writer, ratio);
+    pthread_mutex_unlock(&snapshot_mtx);
+    if (ret < 0)
+        return -1;
+    fprintf(fp, "snapshot: %d objects saved to %s in %.3f ms, hit ratio %.1f%%, "
+            "%.1f%% from restored objects\n", count, path, elapsed_ms(&start),
+            100 * ratio, 100 * restored);
+    return count;
+}
+
+#ifdef CACHE_TEST
+
+#include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+
+void* test_insert_single_thread(void *arg)
+{
+    int i;
+    int size = MAX_OBJECT_SIZE;
+    char url[64] = "http://www.baidu.com";
+    char *content;
+    struct object *ptr;
+    
+    /* 1. test whether it inserts an exist item? */  
+    content = malloc(size);
+    assert(0 == insert_in_cache(url, cache_hash(url), content, size));
+    assert(shards[0].count == 1);
+    assert(shards[0].size == size);
+
+    content = malloc(size);
+    assert(-1 == insert_in_cache(url, cache_hash(url), content, size));
+
+    /* 2. test the cache size */
+    for (i = 0; i < 10; i++)
+    {
+        sprintf(url, "www.biadu.com%d", i);
+        content = malloc(size); 
+        if (i < 9)
+        {
+            assert(0 == insert_in_cache(url, cache_hash(url), content, size));
+            assert(shards[0].count == i + 2);
+            assert(shards[0].size == (i+2)*MAX_OBJECT_SIZE);
+        }
+        
+        /* Eviction occurred */
+        if (i >= 9)
+        {
+            insert_in_cache(url, cache_hash(url), content, size);
+            assert(shards[0].count == 10);
+            assert(shards[0].size == 10*MAX_OBJECT_SIZE); 
+        }
+    }
+    for (i = 0; i < shards[0].nbuckets; i++)
+    {
+        for (ptr = shards[0].buckets[i]; ptr; ptr = ptr->hnext)
+            printf("%p: %s, %d\n", ptr, ptr->key, ptr->size);
+    }
+
+    return NULL;
+}
+
+void* thread_func(void *argv)
+{
+    char url[] = "http://www.hao123.com";
+    int size = MAX_OBJECT_SIZE;
+    char *content = (char*)malloc(size);
+    struct object *first;
+
+    insert_in_cache(url, cache_hash(url), content, size);
+    
+    pthread_mutex_lock(&shards[0].mtx);
+    assert(shards[0].count == 1);
+    assert(shards[0].size == MAX_OBJECT_SIZE);
+    first = lookup_object(&shards[0], url, cache_hash(url));
+    printf("Accessed at %ld seconds\n", (long)first->atime);
+    pthread_mutex_unlock(&shards[0].mtx);
+
+    return NULL;
+}
+
+void test_insert_multi_thread(void)
+{
+    int threadNum = 4;
+    int i;
+    pthread_t tid[4];
+
+    for (i = 0; i < threadNum; i++)
+    {
+        pthread_create(&tid[i], NULL, thread_func, NULL);
+    }
+    
+    for (i = 0; i < threadNum; i++)
+       pthread_join(tid[i], NULL); 
+
+}
+
+void* test_search(void *argv)
+{
+    char url1[64] = "http://www.baidu.com";
+    char url2[64] = "http://www.alibaba.com";
+    char url3[64] = "http://www.tecent.com";
+    char *ptr;
+    struct object *obj;
+
+    ptr = malloc(64);
+    strncpy(ptr, url1, 64);
+    assert(0 == insert_in_cache(url1, cache_hash(url1), ptr, strlen(url1) + 1));
+    free(ptr);
+    obj = search_in_cache(url1, cache_hash(url1));
+    assert(strcmp(get_object_content(obj), url1) == 0);
+    release_object(obj);
+    
+    ptr = malloc(64);
+    strncpy(ptr, url2, 64);
+    assert(0 == insert_in_cache(url2, cache_hash(url2), ptr, strlen(url2) + 1));
+    free(ptr);
+    obj = search_in_cache(url2, cache_hash(url2));
+    assert(strcmp(get_object_content(obj), url2) == 0);
+    release_object(obj);
+    
+    ptr = malloc(64);
+    strncpy(ptr, url3, 64);
+    assert(0 == insert_in_cache(url3, cache_hash(url3), ptr, strlen(url3) + 1));
+    free(ptr);
+    obj = search_in_cache(url3, cache_hash(url3));
+    assert(strcmp(get_object_content(obj), url3) == 0);
+    release_object(obj);
+
+    return NULL;
+}
 
 /*
- * init_cache - Initialize the cache database
+ * test_lru_order - A touched object must survive the eviction of a full
+ *                  cache, the least recently used one must not.
  */
-void init_cache(void)
+void test_lru_order(void)
 {
-    head.first = NULL;
-    head.last = NULL;
-    head.size = 0;
-    head.count = 0;
-    pthread_mutex_init(&head.mtx, NULL);
+    int i;
+    int size = MAX_OBJECT_SIZE;
+    char url[64];
+    char *content = calloc(1, size);
+    struct object *ptr;
+
+    for (i = 0; i < 10; i++)
+    {
+        sprintf(url, "http://lru.test/%d", i);
+        assert(0 == insert_in_cache(url, cache_hash(url), content, size));
+    }
+
+    /* Touch the oldest object, so object 1 becomes the victim */
+    ptr = search_in_cache("http://lru.test/0", cache_hash("http://lru.test/0"));
+    assert(ptr != NULL);
+    release_object(ptr);
+
+    assert(0 == insert_in_cache("http://lru.test/10",
+                                cache_hash("http://lru.test/10"), content, size));
+    assert(shards[0].count == 10);
+    ptr = search_in_cache("http://lru.test/0", cache_hash("http://lru.test/0"));
+    assert(ptr != NULL);
+    release_object(ptr);
+    assert(NULL == search_in_cache("http://lru.test/1",
+                                   cache_hash("http://lru.test/1")));
+    free(content);
 }
 
 /*
- * search_in_cache - Search a specified object in cache database.
- * Return the cache object pointer if found, or NULL if not found
+ * test_pinned_eviction - An evicted object must stay readable until the
+ *                        last reader releases it.
  */
-char *search_in_cache(const char *url)
+void test_pinned_eviction(void)
 {
-    struct object *current;
-    char *ptr;
-    
-    pthread_mutex_lock(&head.mtx);
-    current = head.first;
+    int i;
+    int size = MAX_OBJECT_SIZE;
+    char url[64];
+    char *content = malloc(size);
+    struct object *obj;
 
-    while (current)
+    memset(content, 'p', size);
+    assert(0 == insert_in_cache("http://pin.test/", cache_hash("http://pin.test/"),
+                                content, size));
+    obj = search_in_cache("http://pin.test/", cache_hash("http://pin.test/"));
+    assert(obj != NULL);
+
+    memset(content, 'q', size);
+    for (i = 0; i < 10; i++)
     {
-        if (!strcmp(current->key, url))
-        {
-            /* Update time */
-            gettimeofday(&(current->ctime), NULL);
-            ptr = (char*)malloc(current->size + 1);
-            if (ptr)
-            {
-                strncpy(ptr, current->data, current->size);
-                ptr[current->size] = '\0';
-            }
-            pthread_mutex_unlock(&head.mtx);
-            return ptr;
-        }
-        current = current->next;
+        sprintf(url, "http://pin.test/%d", i);
+        assert(0 == insert_in_cache(url, cache_hash(url), content, size));
     }
+    assert(NULL == search_in_cache("http://pin.test/",
+                                   cache_hash("http://pin.test/")));
+    assert(get_object_size(obj) == size);
+    assert(get_object_content(obj)[size - 1] == 'p');
+    release_object(obj);
+    free(content);
+}
 
-    pthread_mutex_unlock(&head.mtx);
-    return NULL;
+/*
+ * test_binary_object - Objects with NUL bytes must be stored and returned
+ *                      at full size.
+ */
+void test_binary_object(void)
+{
+    int i;
+    int size = 4096;
+    char *content = malloc(size);
+    struct object *obj;
+
+    for (i = 0; i < size; i++)
+        content[i] = i % 7 == 0 ? '\0' : (char)i;
+    assert(0 == insert_in_cache("http://bin.test/godzilla.jpg",
+                                cache_hash("http://bin.test/godzilla.jpg"),
+                                content, size));
+    obj = search_in_cache("http://bin.test/godzilla.jpg",
+                          cache_hash("http://bin.test/godzilla.jpg"));
+    assert(obj != NULL);
+    assert(get_object_size(obj) == size);
+    assert(memcmp(get_object_content(obj), content, size) == 0);
+    release_object(obj);
+    free(content);
 }
 
 /*
- * Little helper function. If t1 > t2, return 1, else return 0
+ * test_admission - A cold object must not evict a hot one.
  */
-static int compare_time(struct timeval t1, struct timeval t2)
+void test_admission(void)
 {
-    if (t1.tv_sec > t2.tv_sec)
-        return 1;
-    else if ((t1.tv_sec == t2.tv_sec) && (t1.tv_usec >= t2.tv_usec))
-        return 1;
-    else
-        return 0;
+    int i;
+    int size = MAX_OBJECT_SIZE;
+    char url[64];
+    char *content = calloc(1, size);
+    struct object *obj;
+
+    set_cache_admission(1);
+    for (i = 0; i < 10; i++)
+    {
+        sprintf(url, "http://hot.test/%d", i);
+        assert(0 == insert_in_cache(url, cache_hash(url), content, size));
+        obj = search_in_cache(url, cache_hash(url));
+        release_object(obj);
+        obj = search_in_cache(url, cache_hash(url));
+        release_object(obj);
+    }
+
+    /* Requested once only, less than the LRU victim */
+    assert(NULL == search_in_cache("http://cold.test/", cache_hash("http://cold.test/")));
+    assert(-1 == insert_in_cache("http://cold.test/", cache_hash("http://cold.test/"),
+                                 content, size));
+    assert(shards[0].count == 10);
+
+    /* Requested more often than the victim */
+    for (i = 0; i < 3; i++)
+        assert(NULL == search_in_cache("http://warm.test/",
+                                       cache_hash("http://warm.test/")));
+    assert(0 == insert_in_cache("http://warm.test/", cache_hash("http://warm.test/"),
+                                content, size));
+    set_cache_admission(0);
+    free(content);
 }
 
-static char *search_in_cache_without_lock(const char *url)
+/*
+ * test_policies - Every policy must keep the shard within its budget and
+ *                 the index consistent with the policy queues.
+ */
+void test_policies(void)
 {
-    struct object *current;
-    char *ptr;
-    
-    current = head.first;
+    const char *names[] = {"lru", "arc", "s3fifo", "gdsf"};
+    unsigned int seed = 3;
+    char url[64];
+    char *content = calloc(1, MAX_OBJECT_SIZE);
+    struct object *obj;
+    int n, i, hits;
 
-    while (current)
+    for (n = 0; n < 4; n++)
     {
-        if (!strcmp(current->key, url))
+        assert(0 == set_cache_policy(names[n]));
+        init_cache(1, MAX_CACHE_SIZE);
+        hits = 0;
+        for (i = 0; i < 20000; i++)
         {
-            /* Update time */
-            gettimeofday(&(current->ctime), NULL);
-            ptr = (char*)malloc(current->size + 1);
-            if (ptr)
+            sprintf(url, "http://policy.test/%d", rand_r(&seed) % (i % 3 ? 50 : 2000));
+            if ((obj = search_in_cache(url, cache_hash(url))) != NULL)
             {
-                strncpy(ptr, current->data, current->size);
-                ptr[current->size] = '\0';
+                hits++;
+                release_object(obj);
+                continue;
             }
-            return ptr;
+            insert_in_cache(url, cache_hash(url), content,
+                            1 + cache_hash(url) % (MAX_OBJECT_SIZE / 4));
+            assert(shards[0].size <= shards[0].capacity);
         }
-        current = current->next;
+        /* Evict everything, the policy must hand out every object once */
+        while (shards[0].count > 0)
+            evict_object(&shards[0]);
+        assert(shards[0].size == 0);
+        assert(policy->choose_victim(shards[0].policy_ctx) == NULL);
+        printf("%s: %d hits\n", names[n], hits);
+        assert(hits > 0);
+        deinit_cache();
     }
-
-    return NULL;
+    assert(-1 == set_cache_policy("fifo"));
+    set_cache_policy("lru");
+    free(content);
 }
 
 /*
- * evict_object - Evict object based on least-recently-used (LRU) policy.
+ * test_large_object - A chunked object must be served in full from the
+ *                     large cache, within its own budget.
  */
-static void evict_object(void)
+void test_large_object(void)
 {
-    struct object *current, *prev;
-    struct object *prev_eviction, *eviction;
-    
-    /*
-     * Caution, the cache database has locked in function insert_in_cache
-     */
-    current = head.first;
-    prev = NULL;
-    eviction = head.first;
-    prev_eviction = NULL;
+    int i, n, len, size = 7 * CACHE_CHUNK_SIZE + 1000;
+    char url[64];
+    char *out = malloc(size);
+    struct cache_chunk *chunks, **tail;
+    struct object *obj, *pinned;
+    struct object_cursor cursor;
+    struct iovec iov[2];
 
-    /* Find the least-recently-used object */
-    while (current)
+    assert(0 == init_large_cache(2 * size + size / 2));
+    assert(get_cache_object_limit() == 2 * size + size / 2);
+    for (i = 0; i < 3; i++)
     {
-        if (compare_time(eviction->ctime, current->ctime))
+        tail = &chunks;
+        for (len = 0; len < size; len += n)
         {
-            eviction = current;
-            prev_eviction = prev;
+            *tail = malloc(sizeof(struct cache_chunk));
+            n = size - len < CACHE_CHUNK_SIZE ? size - len : CACHE_CHUNK_SIZE;
+            memset((*tail)->data, 'a' + i, n);
+            (*tail)->len = n;
+            tail = &(*tail)->next;
         }
-        
-        /* Update */
-        prev = current;
-        current = current->next;
+        *tail = NULL;
+        sprintf(url, "http://large.test/%d", i);
+        assert(0 == insert_chunks_in_cache(url, cache_hash(url), chunks,
+                                           size, &pinned));
+        release_object(pinned);
     }
+    /* Only two fit the budget, the small objects are not touched */
+    assert(large.count == 2 && large.size == 2 * size);
+    assert(NULL == search_in_cache("http://large.test/0",
+                                   cache_hash("http://large.test/0")));
 
-    /* Delete the least recently used object */
-    if (eviction == head.first)
-        head.first = eviction->next;
-    if (eviction == head.last)
-        head.last = prev_eviction;
-    
-    if (prev_eviction)
-       prev_eviction->next = eviction->next; 
-    head.count--;
-    head.size -= eviction->size;
-    free(eviction->data);
-    free(eviction);
+    obj = search_in_cache("http://large.test/2", cache_hash("http://large.test/2"));
+    assert(obj != NULL && get_object_size(obj) == size);
+    memset(&cursor, 0, sizeof(cursor));
+    len = 0;
+    while ((n = read_object(obj, &cursor, iov, 2)) > 0)
+    {
+        /* Consume a bit less than read, like a short write */
+        n = iov[0].iov_len > 100 ? iov[0].iov_len - 100 : iov[0].iov_len;
+        memcpy(out + len, iov[0].iov_base, n);
+        len += n;
+        consume_object(obj, &cursor, n);
+    }
+    assert(len == size && cursor.sent == size);
+    for (i = 0; i < size; i++)
+        assert(out[i] == 'c');
+    release_object(obj);
+
+    /* Too small or too large for the large cache */
+    assert(-1 == insert_chunks_in_cache(url, cache_hash(url), NULL, 100, &pinned));
+    assert(-1 == insert_chunks_in_cache("http://large.test/x",
+                                        cache_hash("http://large.test/x"),
+                                        NULL, 3 * size, &pinned));
+    free(out);
 }
 
 /*
- * insert_in_cache - Insert a new object in the cache database
- * Return 0 if success, or -1 if failed.
+ * test_disk_tier - Evicted objects must be found on disk, and come back to
+ *                  memory when hit again.
  */
-int insert_in_cache(const char *url, const char *content, int len)
+void test_disk_tier(void)
 {
-    struct object *p;
-    struct object *last = NULL;
-    int url_len = strlen(url);
-    
-    if (len > MAX_OBJECT_SIZE || len <= 0 || url_len >= MAX_REQUEST)
-        return -1;
-    
-    /* Make an new object */
-    p = (struct object*)malloc(sizeof(struct object));
-    if (p == NULL)
-        return -1;
-    p->data = (char*)malloc(len);
-    if (p->data == NULL)
+    int i;
+    int size = MAX_OBJECT_SIZE;
+    char url[64];
+    char *content = malloc(size);
+    struct object *obj;
+    off_t offset;
+
+    assert(0 == init_disk_cache("/tmp/cache_test_disk", 4L * DISK_SEGMENT_SIZE));
+    for (i = 0; i < 12; i++)
     {
-        free(p);
-        return -1;
+        sprintf(url, "http://disk.test/%d", i);
+        memset(content, 'a' + i, size);
+        assert(0 == insert_in_cache(url, cache_hash(url), content, size));
     }
-    strncpy(p->data, content, len);
-    strncpy(p->key, url, url_len);
-    p->key[url_len] = '\0';
-    p->size = len; 
-    p->next = NULL;    
-    gettimeofday(&(p->ctime), NULL);
+    assert(shards[0].count == 10);
 
-    /* Critical section */
-    pthread_mutex_lock(&head.mtx);
-    while ((len + head.size) > MAX_CACHE_SIZE)
-        evict_object();
-    /* To avoid insert an exist item */
-    if (!search_in_cache_without_lock(url))
-    {
-        last = head.last;
-        if (!head.first)
-            head.first = p;
-        if (last)
-            last->next = p;
-        head.last = p;
-        head.size += len;
-        head.count++;
-        pthread_mutex_unlock(&head.mtx);
+    /* Object 0 was spilled, the first hit is served from the segment */
+    obj = search_in_cache("http://disk.test/0", cache_hash("http://disk.test/0"));
+    assert(obj != NULL && get_object_size(obj) == size);
+    assert(get_object_file(obj, &offset) >= 0);
+    assert(get_object_content(obj)[size - 1] == 'a');
+    release_object(obj);
+    assert(shards[0].count == 10);
 
-        return 0;
+    /* The second one promotes it, object 2 goes to disk instead */
+    obj = search_in_cache("http://disk.test/0", cache_hash("http://disk.test/0"));
+    release_object(obj);
+    obj = search_in_cache("http://disk.test/0", cache_hash("http://disk.test/0"));
+    assert(obj != NULL && get_object_file(obj, &offset) == -1);
+    assert(get_object_content(obj)[0] == 'a');
+    release_object(obj);
+    obj = search_in_cache("http://disk.test/2", cache_hash("http://disk.test/2"));
+    assert(obj != NULL && get_object_file(obj, &offset) >= 0);
+    release_object(obj);
+
+    dump_cache_stats(stdout);
+    free(content);
+}
+
+/*
+ * test_tier_lifetime - A response spilled to disk keeps its lifetime, and a
+ *                      revalidation of a disk hit is seen by the next ones.
+ */
+void test_tier_lifetime(void)
+{
+    const char *url = "http://life.test/";
+    const char *response = "HTTP/1.0 200 OK\r\nCache-Control: max-age=60\r\n\r\nlife";
+    const char *not_modified = "HTTP/1.0 304 Not Modified\r\nCache-Control: max-age=10\r\n\r\n";
+    int size = MAX_OBJECT_SIZE;
+    char other[64], *content = malloc(size);
+    struct object *obj;
+    off_t offset;
+    int i;
+
+    assert(0 == init_disk_cache("/tmp/cache_test_life", 4L * DISK_SEGMENT_SIZE));
+    assert(0 == insert_in_cache(url, cache_hash(url), response, strlen(response)));
+    memset(content, 'l', size);
+    for (i = 0; i < 11; i++)
+    {
+        sprintf(other, "http://life.test/%d", i);
+        assert(0 == insert_in_cache(other, cache_hash(other), content, size));
     }
-    
-        pthread_mutex_unlock(&head.mtx);
-    return -1;
+
+    /* Read back later, it is not fresh again */
+    cache_clock += 61;
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL && get_object_file(obj, &offset) >= 0);
+    assert(get_object_freshness(obj) != OBJECT_FRESH);
+    revalidate_object(obj, not_modified, strlen(not_modified));
+    assert(get_object_freshness(obj) == OBJECT_FRESH);
+    release_object(obj);
+
+    /* The next hit promotes it, with the lifetime of the revalidation */
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL && get_object_freshness(obj) == OBJECT_FRESH);
+    release_object(obj);
+    cache_clock += 20;
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL && get_object_file(obj, &offset) == -1);
+    assert(get_object_freshness(obj) != OBJECT_FRESH);
+    release_object(obj);
+    free(content);
 }
 
 /*
- * get_object_content - return the pointer of object data 
+ * test_snapshot - Objects saved before a restart must be served from the
+ *                 snapshot, and restored to memory on their first hit.
  */
-char* get_object_content(void *obj)
+void test_snapshot(void)
 {
-    return ((struct object*)obj)->data;
+    const char *path = "/tmp/cache_test.snapshot";
+    int size = 7 * CACHE_CHUNK_SIZE + 1000;
+    char *content = malloc(size);
+    struct object *obj;
+    off_t offset;
+    double restored;
+
+    memset(content, 's', size);
+    assert(0 == insert_in_cache("http://snap.test/small", cache_hash("http://snap.test/small"), "small", 5));
+    assert(0 == insert_in_cache("http://snap.test/cold", cache_hash("http://snap.test/cold"), "cold", 4));
+    promote_object("http://snap.test/large", cache_hash("http://snap.test/large"), content, size, NULL);
+    assert(large.count == 1);
+    assert(3 == save_cache_snapshot(path, stdout));
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    init_large_cache(LARGE_CACHE_SIZE);
+    assert(3 == load_cache_snapshot(path, stdout));
+    obj = search_in_cache("http://snap.test/large", cache_hash("http://snap.test/large"));
+    assert(obj != NULL && get_object_size(obj) == size);
+    assert(get_object_file(obj, &offset) >= 0);
+    assert(get_object_content(obj)[size - 1] == 's');
+    release_object(obj);
+
+    obj = search_in_cache("http://snap.test/large", cache_hash("http://snap.test/large"));
+    assert(obj != NULL && get_object_file(obj, &offset) == -1);
+    release_object(obj);
+    obj = search_in_cache("http://snap.test/small", cache_hash("http://snap.test/small"));
+    assert(obj != NULL && memcmp(get_object_content(obj), "small", 5) == 0);
+    release_object(obj);
+    assert(get_cache_hit_ratio(&restored) == 1 && restored == 1);
+
+    /* The cold object was never hit, it is carried to the next snapshot */
+    assert(3 == save_cache_snapshot(path, stdout));
+    deinit_cache();
+    init_cache(1, MAX_CACHE_SIZE);
+    assert(3 == load_cache_snapshot(path, stdout));
+    obj = search_in_cache("http://snap.test/cold", cache_hash("http://snap.test/cold"));
+    assert(obj != NULL && memcmp(get_object_content(obj), "cold", 4) == 0);
+    release_object(obj);
+
+    unlink(path);
+    free(content);
 }
 
 /*
- * get_object_size - return the size of object content
+ * test_freshness - Objects go stale then expire as their headers say, a 304
+ *                  makes them fresh again, and a newer response replaces a
+ *                  stale one.
  */
-int get_object_size(void *obj)
+void test_freshness(void)
 {
-    return ((struct object*)obj)->size;
+    const char *url = "http://fresh.test/";
+    const char *fresh = "HTTP/1.0 200 OK\r\nCache-Control: max-age=60, stale-while-revalidate=30\r\n\r\nold";
+    const char *newer = "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\n\r\nnew";
+    const char *not_modified = "HTTP/1.0 304 Not Modified\r\nCache-Control: max-age=10\r\n\r\n";
+    struct object *obj, *old;
+
+    assert(0 == insert_in_cache(url, cache_hash(url), fresh, strlen(fresh)));
+    old = search_in_cache(url, cache_hash(url));
+    assert(old != NULL && get_object_freshness(old) == OBJECT_FRESH);
+    /* A fresh object is not replaced */
+    assert(-1 == insert_in_cache(url, cache_hash(url), newer, strlen(newer)));
+    cache_clock += 61;
+    assert(get_object_freshness(old) == OBJECT_STALE);
+    cache_clock += 30;
+    assert(get_object_freshness(old) == OBJECT_EXPIRED);
+    revalidate_object(old, not_modified, strlen(not_modified));
+    assert(get_object_freshness(old) == OBJECT_FRESH);
+
+    /* A stale one is, the reader of the old version keeps it */
+    cache_clock += 10;
+    assert(0 == insert_in_cache(url, cache_hash(url), newer, strlen(newer)));
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL && obj != old);
+    assert(get_object_freshness(obj) == OBJECT_EXPIRED);
+    assert(memcmp(get_object_content(old) + strlen(fresh) - 3, "old", 3) == 0);
+    release_object(obj);
+    release_object(old);
+    assert(shards[0].count == 1);
+
+    remove_from_cache(url, cache_hash(url));
+    assert(search_in_cache(url, cache_hash(url)) == NULL);
+    assert(shards[0].count == 0);
 }
 
 /*
- * update_object_age - Update the object aging time
+ * test_compression - Text responses are stored gzip encoded, sent as is to
+ *                    the clients accepting gzip, decoded for the others.
  */
-void update_object_age(void *obj, struct timeval time)
+void test_compression(void)
 {
-    ((struct object*)obj)->ctime = time;
+    const char *url = "http://gzip.test/";
+    char response[8192];
+    struct object *obj, *decoded;
+    int head, len, identity, i;
+
+    head = sprintf(response, "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
+    for (len = head, i = 0; len < (int)sizeof(response) - 32; i++)
+        len += sprintf(response + len, "<p>line %d</p>\n", i % 50);
+    /* Decoding adds the Content-Length */
+    identity = len + strlen("Content-Length: \r\n") +
+               snprintf(NULL, 0, "%d", len - head);
+
+    set_cache_compression(1);
+    assert(0 == insert_in_cache(url, cache_hash(url), response, len));
+    assert(shards[0].size < len / 2 && shards[0].identity_size == identity);
+    assert(get_cache_compression() > 2);
+
+    obj = search_in_cache(url, cache_hash(url));
+    assert(negotiate_object(obj, 1) == obj);
+    assert(strstr(get_object_content(obj), "Content-Encoding: gzip") != NULL);
+    decoded = negotiate_object(pin_object(obj), 0);
+    assert(decoded != NULL && decoded != obj);
+    assert(get_object_size(decoded) == identity);
+    assert(memcmp(get_object_content(decoded) + identity - (len - head),
+                  response + head, len - head) == 0);
+    assert(get_object_freshness(decoded) == get_object_freshness(obj));
+    release_object(decoded);
+    release_object(obj);
+
+    /* Binary responses are stored as they are */
+    memcpy(strstr(response, "text/html"), "image/gif", 9);
+    assert(0 == insert_in_cache("http://gzip.test/gif", cache_hash("http://gzip.test/gif"),
+                                response, len));
+    obj = search_in_cache("http://gzip.test/gif", cache_hash("http://gzip.test/gif"));
+    assert(negotiate_object(obj, 0) == obj && get_object_size(obj) == len);
+    release_object(obj);
+
+    remove_from_cache(url, cache_hash(url));
+    assert(get_cache_compression() == 1);
+    set_cache_compression(0);
 }
 
-#ifdef CACHE_TEST
+#define LOCKFREE_READERS 4
+#define LOCKFREE_URLS 64
+#define LOCKFREE_ROUNDS 4000
 
-#include <assert.h>
+static volatile int lockfree_done;
 
-void* test_insert_single_thread(void *arg)
+static void* lockfree_reader(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    char url[64];
+    struct object *obj;
+    long found = 0;
+
+    while (!lockfree_done)
+    {
+        sprintf(url, "http://lockfree.test/%d", rand_r(&seed) % LOCKFREE_URLS);
+        if ((obj = search_in_cache(url, cache_hash(url))) == NULL)
+            continue;
+        /* Never freed or reused under the reader */
+        assert(strcmp(get_object_content(obj), url) == 0);
+        release_object(obj);
+        /* Give the writer a chance on a small machine */
+        if (++found % 64 == 0)
+            sched_yield();
+    }
+    return (void*)found;
+}
+
+/*
+ * test_lockfree_search - Searches without the lock see consistent objects
+ *                        while a writer replaces, removes and evicts them.
+ */
+void test_lockfree_search(void)
 {
+    pthread_t tid[LOCKFREE_READERS];
+    char url[64];
+    char *content = calloc(1, 8 * 1024);
+    void *found;
+    long total = 0;
     int i;
-    int size = MAX_OBJECT_SIZE;
-    char url[64] = "http://www.baidu.com";
-    char *content;
-    struct object *ptr;
-    
-    /* 1. test whether it inserts an exist item? */  
-    content = malloc(size);
-    assert(0 == insert_in_cache(url, content, size));
-    assert(head.count == 1);
-    assert(head.size == size);
 
-    content = malloc(size);
-    assert(-1 == insert_in_cache(url, content, size));
+    for (i = 0; i < LOCKFREE_READERS; i++)
+        pthread_create(&tid[i], NULL, lockfree_reader, (void*)(long)i);
+    for (i = 0; i < LOCKFREE_ROUNDS; i++)
+    {
+        sprintf(url, "http://lockfree.test/%d", i % LOCKFREE_URLS);
+        if (i % 3 == 0)
+            remove_from_cache(url, cache_hash(url));
+        insert_in_cache(url, cache_hash(url), url, strlen(url) + 1);
+        /* Large objects grow the index and force evictions */
+        sprintf(url, "http://lockfree.test/cold/%d", i);
+        insert_in_cache(url, cache_hash(url), content, (i % 8 + 1) * 1024);
+    }
+    lockfree_done = 1;
+    for (i = 0; i < LOCKFREE_READERS; i++)
+    {
+        pthread_join(tid[i], &found);
+        total += (long)found;
+    }
+    printf("lock-free search: %ld hits\n", total);
+    assert(total > 0);
+    assert(shards[0].size <= shards[0].capacity);
+    free(content);
+}
 
-    /* 2. test the cache size */
-    for (i = 0; i < 10; i++)
+#define LIFETIME_ROUNDS 20000
+
+static const char *lifetime_responses[2] = {
+    "HTTP/1.0 304 Not Modified\r\nCache-Control: max-age=100, stale-while-revalidate=1\r\n\r\n",
+    "HTTP/1.0 304 Not Modified\r\nCache-Control: max-age=200, stale-while-revalidate=50\r\n\r\n"
+};
+
+static void* lifetime_writer(void *arg)
+{
+    struct object *obj = arg;
+    int i;
+
+    for (i = 0; i < LIFETIME_ROUNDS; i++)
+        revalidate_object(obj, lifetime_responses[i % 2],
+                          strlen(lifetime_responses[i % 2]));
+    return NULL;
+}
+
+/*
+ * test_lifetime_race - Revalidations racing with readers never let them see
+ *                      the expiry of one with the grace of another.
+ */
+void test_lifetime_race(void)
+{
+    const char *url = "http://lifetime.test/";
+    const char *response = "HTTP/1.0 200 OK\r\nCache-Control: max-age=100, stale-while-revalidate=1\r\n\r\nrace";
+    struct cache_lifetime life;
+    struct object *obj;
+    pthread_t tid[2];
+    int i, seen[2] = { 0, 0 };
+
+    assert(0 == insert_in_cache(url, cache_hash(url), response, strlen(response)));
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL);
+    for (i = 0; i < 2; i++)
+        pthread_create(&tid[i], NULL, lifetime_writer, obj);
+    for (i = 0; i < 4 * LIFETIME_ROUNDS; i++)
     {
-        sprintf(url, "www.biadu.com%d", i);
-        content = malloc(size); 
-        if (i < 9)
-        {
-            assert(0 == insert_in_cache(url, content, size));
-            assert(head.count == i + 2);
-            assert(head.size == (i+2)*MAX_OBJECT_SIZE);
-        }
-        
-        /* Eviction occurred */
-        if (i >= 9)
+        get_lifetime(obj, &life);
+        if (life.expires == cache_clock + 100)
+            assert(life.grace == life.expires + 1 && ++seen[0]);
+        else
+            assert(life.expires == cache_clock + 200 &&
+                   life.grace == life.expires + 50 && ++seen[1]);
+        if (i % 64 == 0)
+            sched_yield();
+    }
+    for (i = 0; i < 2; i++)
+        pthread_join(tid[i], NULL);
+    printf("lifetime race: %d and %d reads\n", seen[0], seen[1]);
+    release_object(obj);
+}
+
+/*
+ * send_object - Read the response of obj through a patched cursor, consuming
+ *               step bytes at most at a time, and return its length.
+ */
+static int send_object(struct object *obj, char *out, int step)
+{
+    struct object_cursor cursor;
+    struct iovec iov[4];
+    int i, n, m, len = 0, copied;
+
+    open_object(obj, &cursor);
+    while ((n = read_object(obj, &cursor, iov, 4)) > 0)
+    {
+        assert(get_object_pending(obj, &cursor) > 0);
+        for (copied = 0, i = 0; i < n && copied < step; i++)
         {
-            insert_in_cache(url, content, size);
-            assert(head.count == 10);
-            assert(head.size == 10*MAX_OBJECT_SIZE); 
+            m = (int)iov[i].iov_len < step - copied ? (int)iov[i].iov_len : step - copied;
+            memcpy(out + len + copied, iov[i].iov_base, m);
+            copied += m;
         }
+        consume_object(obj, &cursor, copied);
+        len += copied;
     }
-    ptr = head.first; 
-    while (ptr)
+    assert(get_object_pending(obj, &cursor) == 0);
+    return len;
+}
+
+void test_hop_headers(void)
+{
+    const char *url = "http://hop.test/";
+    const char *response = "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\n"
+        "Age: 5\r\nKeep-Alive: timeout=5\r\nContent-Length: 4\r\n\r\nbody";
+    const char *stored = "HTTP/1.0 200 OK\r\nAge: 5\r\nContent-Length: 4\r\n\r\nbody";
+    const char *sent = "HTTP/1.0 200 OK\r\nConnection: close\r\n" VIA_HEADER
+        "Age: 105\r\nContent-Length: 4\r\n\r\nbody";
+    char out[256];
+    struct object *obj;
+    int step;
+
+    assert(0 == insert_in_cache(url, cache_hash(url), response, strlen(response)));
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL);
+    /* Stored without its hop-by-hop headers */
+    assert(get_object_size(obj) == (int)strlen(stored));
+    assert(memcmp(get_object_content(obj), stored, strlen(stored)) == 0);
+
+    /* Sent with the proxy ones, however the writes split it */
+    cache_clock += 100;
+    for (step = 1; step <= 256; step *= 4)
     {
-        printf("%p: %s, %d\n", ptr, ptr->key, ptr->size);
-        ptr = ptr->next;
+        assert(send_object(obj, out, step) == (int)strlen(sent));
+        assert(memcmp(out, sent, strlen(sent)) == 0);
     }
+    release_object(obj);
+}
 
-    return NULL;
+void test_vary_keys(void)
+{
+    const char *url = "http://vary.test/";
+    const char *gzip = "http://vary.test/\naccept-encoding:gzip";
+    const char *response = "HTTP/1.0 200 OK\r\nVary: Accept-Encoding\r\n\r\nzipped";
+    char key[MAX_REQUEST + 1];
+    struct object *obj;
+
+    /* Keys far longer than the ones of the old fixed size, to a limit */
+    memset(key, 'k', MAX_REQUEST);
+    key[MAX_REQUEST] = '\0';
+    assert(-1 == insert_in_cache(key, cache_hash(key), response, strlen(response)));
+    key[1500] = '\0';
+    assert(0 == insert_in_cache(key, cache_hash(key), response, strlen(response)));
+    obj = search_in_cache(key, cache_hash(key));
+    assert(obj != NULL && get_object_vary(obj) == NULL);
+    release_object(obj);
+
+    /* The url gets a marker, the response a secondary key */
+    assert(0 == insert_vary_in_cache(url, cache_hash(url), "Accept-Encoding"));
+    assert(0 == insert_in_cache(gzip, cache_hash(gzip), response, strlen(response)));
+    obj = search_in_cache(url, cache_hash(url));
+    assert(obj != NULL && strcmp(get_object_vary(obj), "Accept-Encoding") == 0);
+    release_object(obj);
+    obj = search_in_cache(gzip, cache_hash(gzip));
+    assert(obj != NULL && get_object_vary(obj) == NULL);
+    release_object(obj);
+
+    /* A marker never blocks the next one */
+    assert(0 == insert_vary_in_cache(url, cache_hash(url), "Accept-Language"));
+    obj = search_in_cache(url, cache_hash(url));
+    assert(strcmp(get_object_vary(obj), "Accept-Language") == 0);
+    release_object(obj);
+    assert(shards[0].count == 3);
 }
 
-void* thread_func(void *argv)
+void test_purge(void)
 {
-    char url[] = "http://www.hao123.com";
+    const char *fr = "http://purge.test/page\naccept-language:fr";
+    const char *tagged = "HTTP/1.0 200 OK\r\nSurrogate-Key: red blue\r\n\r\nred";
+    const char *plain = "HTTP/1.0 200 OK\r\n\r\nplain";
     int size = MAX_OBJECT_SIZE;
-    char *content = (char*)malloc(size);
-    struct object *first;
+    char *content = malloc(size);
+    char url[64];
+    struct object *obj;
+    int i;
 
-    insert_in_cache(url, content, size);
-    
-    pthread_mutex_lock(&head.mtx);
-    assert(head.count == 1);
-    assert(head.size == MAX_OBJECT_SIZE);
-    first = head.first;
-    printf("Elapsed %lu seconds, %lu microseconds\n",
-            first->ctime.tv_sec, first->ctime.tv_usec);
-    pthread_mutex_unlock(&head.mtx);
+    /* A url purge takes the marker and the variants, not the longer urls */
+    assert(0 == insert_vary_in_cache("http://purge.test/page",
+                                     cache_hash("http://purge.test/page"),
+                                     "Accept-Language"));
+    assert(0 == insert_in_cache(fr, cache_hash(fr), plain, strlen(plain)));
+    assert(0 == insert_in_cache("http://purge.test/pages",
+                                cache_hash("http://purge.test/pages"),
+                                plain, strlen(plain)));
+    obj = search_in_cache(fr, cache_hash(fr));
+    assert(purge_cache(PURGE_URL, "http://purge.test/page") == 2);
+    /* A reader keeps the purged object it holds */
+    assert(search_in_cache(fr, cache_hash(fr)) == NULL);
+    assert(memcmp(get_object_content(obj), plain, strlen(plain)) == 0);
+    release_object(obj);
+    assert(shards[0].count == 1);
 
-    return NULL;
+    /* Tags match whole tokens */
+    assert(0 == insert_in_cache("http://purge.test/a", cache_hash("http://purge.test/a"),
+                                tagged, strlen(tagged)));
+    assert(0 == insert_in_cache("http://other.test/b", cache_hash("http://other.test/b"),
+                                tagged, strlen(tagged)));
+    assert(purge_cache(PURGE_TAG, "re") == 0);
+    assert(purge_cache(PURGE_TAG, "blue") == 2);
+    assert(purge_cache(PURGE_TAG, "blue") == 0);
+    assert(shards[0].count == 1);
+
+    /* A prefix purge reaches the objects spilled to disk */
+    assert(0 == init_disk_cache("/tmp/cache_test_purge", 4L * DISK_SEGMENT_SIZE));
+    for (i = 0; i < 12; i++)
+    {
+        sprintf(url, "http://purge.test/big/%d", i);
+        memset(content, 'a' + i, size);
+        assert(0 == insert_in_cache(url, cache_hash(url), content, size));
+    }
+    assert(shards[0].count < 13);
+    assert(purge_cache(PURGE_PREFIX, "http://purge.test/big/") == 12);
+    assert(search_in_cache("http://purge.test/big/0",
+                           cache_hash("http://purge.test/big/0")) == NULL);
+    assert(purge_cache(PURGE_PREFIX, "http://purge.test/") == 1);
+    assert(shards[0].count == 0 && shards[0].size == 0);
+    free(content);
 }
 
-void test_insert_multi_thread(void)
+void test_local_cache(void)
 {
-    int threadNum = 4;
+    const char *url = "http://l1.test/hot";
+    const char *response = "HTTP/1.0 200 OK\r\n\r\nhot";
+    struct object *obj, *first;
+    long lookups;
     int i;
-    pthread_t tid[4];
 
-    for (i = 0; i < threadNum; i++)
+    assert(0 == insert_in_cache(url, cache_hash(url), response, strlen(response)));
+    first = search_in_cache_local(url, cache_hash(url));
+    assert(first != NULL);
+    lookups = shards[0].lookups;
+
+    /* The next hits come from the table, one in L1_SAMPLE reaches the shard */
+    for (i = 0; i < 4 * L1_SAMPLE; i++)
     {
-        pthread_create(&tid[i], NULL, thread_func, NULL);
+        obj = search_in_cache_local(url, cache_hash(url));
+        assert(obj == first);
+        release_object(obj);
     }
-    
-    for (i = 0; i < threadNum; i++)
-       pthread_join(tid[i], NULL); 
+    assert(shards[0].lookups - lookups == 4);
+    assert(search_in_cache_local("http://l1.test/cold", cache_hash("http://l1.test/cold")) == NULL);
+
+    /* A replaced object is never returned again, even if still pinned */
+    cache_clock += 3600;
+    assert(0 == insert_in_cache(url, cache_hash(url), response, strlen(response)));
+    obj = search_in_cache_local(url, cache_hash(url));
+    assert(obj != NULL && obj != first);
+    release_object(obj);
+    assert(memcmp(get_object_content(first), response, strlen(response)) == 0);
+    release_object(first);
 
+    remove_from_cache(url, cache_hash(url));
+    assert(search_in_cache_local(url, cache_hash(url)) == NULL);
+    flush_local_cache();
+    assert(l1_bytes == 0);
+    assert(get_cache_hit_ratio(NULL) > 0.5);
 }
 
-void* test_search(void *argv)
+/*
+ * test_miss_filter - Absent urls are told by the filter without a lookup,
+ *                    and an object removed then inserted again is found.
+ */
+void test_miss_filter(void)
 {
-    char url1[64] = "http://www.baidu.com";
-    char url2[64] = "http://www.alibaba.com";
-    char url3[64] = "http://www.tecent.com";
-    char *ptr;
+    const char *response = "HTTP/1.0 200 OK\r\n\r\nfilter";
+    char url[64];
+    struct object *obj;
+    long filtered;
+    int i;
 
-    ptr = malloc(64);
-    strncpy(ptr, url1, 64);
-    assert(0 == insert_in_cache(url1, ptr, strlen(url1) + 1));
-    free(ptr);
-    ptr = search_in_cache(url1);
-    assert(strcmp(ptr, url1) == 0);
-    free(ptr);
-    
-    ptr = malloc(64);
-    strncpy(ptr, url2, 64);
-    assert(0 == insert_in_cache(url2, ptr, strlen(url2) + 1));
-    free(ptr);
-    ptr = search_in_cache(url2);
-    assert(strcmp(ptr, url2) == 0);
-    free(ptr);
-    
-    ptr = malloc(64);
-    strncpy(ptr, url3, 64);
-    assert(0 == insert_in_cache(url3, ptr, strlen(url3) + 1));
-    free(ptr);
-    ptr = search_in_cache(url3);
-    assert(strcmp(ptr, url3) == 0);
-    free(ptr);
+    for (i = 0; i < 100; i++)
+    {
+        sprintf(url, "http://filter.test/%d", i);
+        assert(0 == insert_in_cache(url, cache_hash(url), response, strlen(response)));
+    }
+    for (i = 0; i < 100; i++)
+    {
+        sprintf(url, "http://filter.test/%d", i);
+        assert((obj = search_in_cache(url, cache_hash(url))) != NULL);
+        release_object(obj);
+    }
+    for (i = 0; i < 1000; i++)
+    {
+        sprintf(url, "http://filter.test/absent/%d", i);
+        assert(search_in_cache(url, cache_hash(url)) == NULL);
+    }
+    assert(shards[0].filtered + shards[0].false_positives == 1000);
+    assert(get_cache_false_positive_rate(&filtered) < 0.01 && filtered > 990);
 
-    return NULL;
+    /* Once all removed, nothing is left in the filter */
+    for (i = 0; i < 100; i++)
+    {
+        sprintf(url, "http://filter.test/%d", i);
+        remove_from_cache(url, cache_hash(url));
+    }
+    assert(search_in_cache("http://filter.test/7",
+                           cache_hash("http://filter.test/7")) == NULL);
+    assert(shards[0].filtered == filtered + 1);
+    assert(0 == insert_in_cache("http://filter.test/7",
+                                cache_hash("http://filter.test/7"),
+                                response, strlen(response)));
+    obj = search_in_cache("http://filter.test/7", cache_hash("http://filter.test/7"));
+    assert(obj != NULL);
+    release_object(obj);
+}
+
+void test_slab_reassign(void)
+{
+    char url[64], small[200], *big;
+    SlabClassStats stats[64];
+    struct object *obj;
+    int i, n, count, perpage;
+
+    /* The pages of the arena all go to small objects */
+    memset(small, 'a', sizeof(small));
+    memcpy(small, "HTTP/1.0 200 OK\r\n\r\n", 19);
+    for (i = 0; i < 20000; i++)
+    {
+        sprintf(url, "http://reassign.test/small/%d", i);
+        insert_in_cache(url, cache_hash(url), small, sizeof(small));
+    }
+    assert(slab_alloc(arena, 50000) == NULL);
+    n = slab_get_stats(arena, stats, 64);
+    count = shards[0].count;
+    perpage = stats[0].chunks / stats[0].pages;
+
+    /* One victim of the class makes room for another small one */
+    assert(0 == insert_in_cache("http://reassign.test/small",
+                                cache_hash("http://reassign.test/small"),
+                                small, sizeof(small)));
+    assert(shards[0].count == count);
+
+    /* A page of them is moved to the bigger class, the rest stay */
+    big = malloc(50000);
+    memset(big, 'b', 50000);
+    memcpy(big, "HTTP/1.0 200 OK\r\n\r\n", 19);
+    assert(0 == insert_in_cache("http://reassign.test/big",
+                                cache_hash("http://reassign.test/big"),
+                                big, 50000));
+    obj = search_in_cache("http://reassign.test/big",
+                          cache_hash("http://reassign.test/big"));
+    assert(obj != NULL);
+    release_object(obj);
+    assert(slab_get_stats(arena, stats, 64) == n + 1);
+    printf("%d of %d objects left, %d per page\n", shards[0].count - 1, count, perpage);
+    assert(shards[0].count - 1 >= count - perpage - ALLOC_EVICTIONS);
+    free(big);
 }
 
 int main()
 {
-    init_cache();
+    init_cache(1, MAX_CACHE_SIZE);
     //test_insert_single_thread(NULL);
     test_insert_multi_thread();
     test_search(NULL);
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_lru_order();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_pinned_eviction();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_binary_object();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_admission();
+    deinit_cache();
+
+    test_policies();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_large_object();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_disk_tier();
+    deinit_cache();
+    rmdir("/tmp/cache_test_disk");
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_tier_lifetime();
+    deinit_cache();
+    rmdir("/tmp/cache_test_life");
+
+    init_cache(1, MAX_CACHE_SIZE);
+    init_large_cache(LARGE_CACHE_SIZE);
+    test_snapshot();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_freshness();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_lockfree_search();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_lifetime_race();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_compression();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_hop_headers();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_vary_keys();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_purge();
+    deinit_cache();
+    rmdir("/tmp/cache_test_purge");
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_local_cache();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_miss_filter();
+    deinit_cache();
+
+    init_cache(1, MAX_CACHE_SIZE);
+    test_slab_reassign();
+    deinit_cache();
     return 0;
 }
 #endif 
@@ -11,9 +11,132 @@
 #define MAX_CACHE_SIZE (1024*1024)
 #define MAX_OBJECT_SIZE 102400
 
-#define MAX_REQUEST 128
+/* Longest cache key, keys are stored at their length */
+#define MAX_REQUEST 2048
 
-void init_cache(void);
-char *search_in_cache(const char *url);
-int insert_in_cache(const char *url, const char *content, int len);
+/* Objects larger than MAX_OBJECT_SIZE go to the large object cache */
+#define LARGE_CACHE_SIZE (256*1024*1024)
+#define MAX_LARGE_OBJECT_SIZE (64*1024*1024)
+#define CACHE_CHUNK_SIZE 16384
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct object;
+
+/*
+ * Large objects are stored as a chain of chunks, every chunk but the last
+ * one is full.
+ */
+struct cache_chunk {
+    struct cache_chunk *next;
+    int len;
+    char data[CACHE_CHUNK_SIZE];
+};
+
+/* Room for the hop-by-hop headers added to a cached response */
+#define OBJECT_PATCH_SIZE 96
+
+/*
+ * Position of a reader in the content of an object. A client served from
+ * the cache gets its hop headers from patch, see open_object().
+ */
+struct object_cursor {
+    const struct cache_chunk *chunk;
+    int offset;   /* Offset in chunk */
+    long sent;    /* Bytes of the object consumed so far */
+    char patch[OBJECT_PATCH_SIZE]; /* Hop headers of this response */
+    int patch_len;
+    int patched;  /* Bytes of patch consumed so far */
+};
+
+/*
+ * Freshness of a cached response. A stale object can still be served while
+ * it is refreshed in the background, an expired one must be revalidated
+ * first.
+ */
+typedef enum _Freshness {
+    OBJECT_FRESH,
+    OBJECT_STALE,
+    OBJECT_EXPIRED
+} Freshness;
+
+/*
+ * Lifetime of a cached response, as unix times. It is computed once when
+ * the response is stored and changed by revalidations, so the tiers keep
+ * it along with the response.
+ */
+struct cache_lifetime {
+    time_t expires;    /* Stale after this time */
+    time_t grace;      /* Served stale, while refreshed, until this time */
+    time_t generated;  /* Generated by the origin at this time, for the Age */
+};
+
+/* Outcomes of the background refreshes of stale objects */
+typedef enum _RefreshResult {
+    REFRESH_STARTED,
+    REFRESH_NOT_MODIFIED,   /* 304, the object got a new lifetime */
+    REFRESH_REPLACED,       /* A new response replaced the object */
+    REFRESH_FAILED,         /* The fetch failed or was not stored */
+    REFRESH_RESULTS
+} RefreshResult;
+
+/* What purge_cache() removes */
+typedef enum _PurgeType {
+    PURGE_URL,      /* The url, with its Vary marker and variants */
+    PURGE_PREFIX,   /* Every key starting with the pattern */
+    PURGE_TAG       /* Every response with the tag in its Surrogate-Key */
+} PurgeType;
+
+unsigned int cache_hash(const char *url);
+void cache_tick(void);
+int init_cache(int nshard, int capacity);
+int init_large_cache(int capacity);
+int init_disk_cache(const char *dir, long capacity);
+int load_cache_snapshot(const char *path, FILE *fp);
+int save_cache_snapshot(const char *path, FILE *fp);
+double get_cache_hit_ratio(double *restored);
+double get_cache_false_positive_rate(long *filtered);
+int get_cache_object_limit(void);
+int get_cache_shards(void);
+void deinit_cache(void);
+int set_cache_policy(const char *name);
+const char *get_cache_policy(void);
+void set_cache_admission(int enable);
+void set_cache_memfd(int enable);
+void set_cache_compression(int enable);
+double get_cache_compression(void);
+void dump_cache_stats(FILE *fp);
+void count_stale_hit(void);
+void count_refresh(RefreshResult result);
+struct object *search_in_cache(const char *url, unsigned int hash);
+struct object *search_in_cache_local(const char *url, unsigned int hash);
+void flush_local_cache(void);
+int insert_in_cache(const char *url, unsigned int hash,
+                    const char *content, int len);
+int insert_chunks_in_cache(const char *url, unsigned int hash,
+                           struct cache_chunk *chunks, int len,
+                           struct object **pinned);
+int insert_vary_in_cache(const char *url, unsigned int hash, const char *vary);
+void remove_from_cache(const char *url, unsigned int hash);
+long purge_cache(PurgeType type, const char *pattern);
+struct object *pin_object(struct object *obj);
+void release_object(struct object *obj);
+const char *get_object_vary(struct object *obj);
+const char* get_object_content(struct object *obj);
+const char* get_object_head(struct object *obj, int *len);
+struct object *negotiate_object(struct object *obj, int gzip);
+Freshness get_object_freshness(struct object *obj);
+void revalidate_object(struct object *obj, const char *response, int len);
+int get_object_size(struct object *obj);
+int get_object_file(struct object *obj, off_t *offset);
+void open_object(struct object *obj, struct object_cursor *cursor);
+long get_object_offset(struct object *obj, struct object_cursor *cursor);
+long get_object_pending(struct object *obj, struct object_cursor *cursor);
+int read_object(struct object *obj, struct object_cursor *cursor,
+                struct iovec *iov, int max);
+void consume_object(struct object *obj, struct object_cursor *cursor, long len);
+void update_object_age(struct object *obj, time_t time);
 #endif
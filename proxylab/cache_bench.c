@@ -0,0 +1,1040 @@
+/*************************************************************************
+	> File Name: cache_bench.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Micro benchmarks of the proxy cache, and the Zipf, scan and
+	>        churn workloads of make bench-cache.
+ ************************************************************************/
+#define _GNU_SOURCE
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define LOOKUPS 1000000
+#define MAX_THREADS 32
+#define OPS_PER_THREAD 200000
+#define HOT_OBJECTS 512
+#define HOT_SET 32
+#define OBJECT_SIZE 1024
+#define TRACE_URLS 20000
+#define TRACE_LENGTH 1000000
+#define TEXT_URLS 200
+#define TEXT_HITS 100000
+#define SEND_OBJECTS 64
+#define SEND_OBJECT_SIZE (96 * 1024)
+#define SEND_BYTES (512L * 1024 * 1024)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Zipf distributed ranks, drawn by a binary search in the cumulative
+ * distribution.
+ */
+struct zipf {
+    double *cdf;
+    int n;
+};
+
+/*
+ * Headers of the responses of fill_response(), their length does not depend
+ * on the Content-Length, padded. Objects are at least RESPONSE_MIN bytes.
+ */
+#define RESPONSE_HEADERS "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\n" \
+                         "Content-Length: %-6d\r\n\r\n"
+#define RESPONSE_MIN 80
+
+/*
+ * fill_response - Fill buf with a response of size bytes, headers included,
+ *                 like the proxy stores them.
+ */
+static void fill_response(char *buf, int size)
+{
+    int head = snprintf(NULL, 0, RESPONSE_HEADERS, 0);
+
+    sprintf(buf, RESPONSE_HEADERS, size - head);
+    memset(buf + head, 'x', size - head);
+}
+
+static void zipf_init(struct zipf *z, int n, double alpha)
+{
+    int i;
+    double sum = 0;
+
+    z->n = n;
+    z->cdf = malloc(n * sizeof(double));
+    for (i = 0; i < n; i++)
+    {
+        sum += 1.0 / pow(i + 1, alpha);
+        z->cdf[i] = sum;
+    }
+    for (i = 0; i < n; i++)
+        z->cdf[i] /= sum;
+}
+
+static int zipf_next(struct zipf *z, unsigned int *seed)
+{
+    double u = (double)rand_r(seed) / RAND_MAX;
+    int lo = 0, hi = z->n - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (z->cdf[mid] >= u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/*
+ * bench_lookup - Fill the cache with count one-byte objects, then measure
+ *                the average latency of hits and misses, most of which the
+ *                filter tells.
+ */
+static void bench_lookup(int count)
+{
+    int i;
+    char url[64];
+    char content = 'x';
+    struct object *obj;
+    double start, hit, miss;
+
+    /* Leave room for the object headers, the data is one byte only */
+    init_cache(1, count * 256);
+    for (i = 0; i < count; i++)
+    {
+        sprintf(url, "http://www.example.com/%d", i);
+        insert_in_cache(url, cache_hash(url), &content, 1);
+    }
+
+    start = now();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        sprintf(url, "http://www.example.com/%d", i % count);
+        obj = search_in_cache(url, cache_hash(url));
+        release_object(obj);
+    }
+    hit = now() - start;
+
+    start = now();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        sprintf(url, "http://www.example.org/%d", i % count);
+        obj = search_in_cache(url, cache_hash(url));
+        release_object(obj);
+    }
+    miss = now() - start;
+
+    printf("%8d objects: hit %7.1f ns/lookup, miss %7.1f ns/lookup, "
+           "%.1f%% false positives\n", count, hit * 1e9 / LOOKUPS,
+           miss * 1e9 / LOOKUPS, 100 * get_cache_false_positive_rate(NULL));
+    deinit_cache();
+}
+
+/*
+ * throughput_thread - Hit heavy workload, one insert every 32 searches.
+ */
+static void *throughput_thread(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    char url[64];
+    char *content = calloc(1, OBJECT_SIZE);
+    struct object *obj;
+    int i;
+
+    for (i = 0; i < OPS_PER_THREAD; i++)
+    {
+        sprintf(url, "http://www.example.com/%d", rand_r(&seed) % HOT_OBJECTS);
+        if (i % 32 == 0)
+        {
+            insert_in_cache(url, cache_hash(url), content, OBJECT_SIZE);
+        }
+        else
+        {
+            obj = search_in_cache(url, cache_hash(url));
+            release_object(obj);
+        }
+    }
+    free(content);
+
+    return NULL;
+}
+
+/*
+ * bench_throughput - Run the workload on 1 to MAX_THREADS threads against
+ *                    a cache with nshard shards.
+ */
+static void bench_throughput(int nshard)
+{
+    pthread_t tid[MAX_THREADS];
+    int threads, i;
+    double start, elapsed;
+
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        init_cache(nshard, MAX_CACHE_SIZE);
+        start = now();
+        for (i = 0; i < threads; i++)
+            pthread_create(&tid[i], NULL, throughput_thread, (void*)(long)i);
+        for (i = 0; i < threads; i++)
+            pthread_join(tid[i], NULL);
+        elapsed = now() - start;
+
+        printf("%2d shards, %2d threads: %10.0f ops/sec\n", get_cache_shards(),
+                threads, (double)threads * OPS_PER_THREAD / elapsed);
+        deinit_cache();
+    }
+}
+
+/*
+ * hot_set_thread - Search the HOT_SET objects only, through the L1 table of
+ *                  the thread if local is set.
+ */
+static void *hot_set_thread(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg >> 1;
+    int local = (long)arg & 1;
+    char url[64];
+    struct object *obj;
+    int i;
+
+    for (i = 0; i < OPS_PER_THREAD; i++)
+    {
+        sprintf(url, "http://hot.example.com/%d", rand_r(&seed) % HOT_SET);
+        if (local)
+            obj = search_in_cache_local(url, cache_hash(url));
+        else
+            obj = search_in_cache(url, cache_hash(url));
+        release_object(obj);
+    }
+    flush_local_cache();
+    return NULL;
+}
+
+/*
+ * bench_hot_set - Compare the hits on a few hot objects searched in the
+ *                 shard with the ones served by the per-thread L1 tables.
+ */
+static void bench_hot_set(void)
+{
+    pthread_t tid[MAX_THREADS];
+    char *content = calloc(1, OBJECT_SIZE);
+    char url[64];
+    int local, threads, i;
+    double start, elapsed;
+
+    for (local = 0; local <= 1; local++)
+    {
+        for (threads = 1; threads <= MAX_THREADS; threads *= 4)
+        {
+            init_cache(1, MAX_CACHE_SIZE);
+            for (i = 0; i < HOT_SET; i++)
+            {
+                sprintf(url, "http://hot.example.com/%d", i);
+                insert_in_cache(url, cache_hash(url), content, OBJECT_SIZE);
+            }
+            start = now();
+            for (i = 0; i < threads; i++)
+                pthread_create(&tid[i], NULL, hot_set_thread,
+                               (void*)(long)(i << 1 | local));
+            for (i = 0; i < threads; i++)
+                pthread_join(tid[i], NULL);
+            elapsed = now() - start;
+
+            printf("hot set, %2d threads, %s: %10.0f hits/sec\n", threads,
+                   local ? "L1    " : "shared",
+                   (double)threads * OPS_PER_THREAD / elapsed);
+            deinit_cache();
+        }
+    }
+    free(content);
+}
+
+static volatile int readers_done;
+
+/*
+ * contention_writer - Insert new objects until the readers are done, so the
+ *                     shard keeps evicting under them.
+ */
+static void *contention_writer(void *arg)
+{
+    char url[64];
+    char *content = calloc(1, OBJECT_SIZE);
+    long i;
+
+    for (i = 0; !readers_done; i++)
+    {
+        sprintf(url, "http://www.example.com/cold/%ld", i);
+        insert_in_cache(url, cache_hash(url), content, OBJECT_SIZE);
+    }
+    free(content);
+
+    return (void*)i;
+}
+
+/*
+ * contention_reader - Search the hot objects only.
+ */
+static void *contention_reader(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    char url[64];
+    struct object *obj;
+    int i;
+
+    for (i = 0; i < OPS_PER_THREAD; i++)
+    {
+        sprintf(url, "http://www.example.com/%d", rand_r(&seed) % HOT_OBJECTS);
+        obj = search_in_cache(url, cache_hash(url));
+        release_object(obj);
+    }
+
+    return NULL;
+}
+
+/*
+ * bench_contention - One writer and 1 to MAX_THREADS readers on a single
+ *                    shard, the worst case of a hot shard.
+ */
+static void bench_contention(void)
+{
+    pthread_t tid[MAX_THREADS], writer;
+    char url[64];
+    char *content = calloc(1, OBJECT_SIZE);
+    int threads, i;
+    double start, elapsed;
+    void *inserts;
+
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        init_cache(1, MAX_CACHE_SIZE);
+        for (i = 0; i < HOT_OBJECTS; i++)
+        {
+            sprintf(url, "http://www.example.com/%d", i);
+            insert_in_cache(url, cache_hash(url), content, OBJECT_SIZE);
+        }
+
+        readers_done = 0;
+        start = now();
+        pthread_create(&writer, NULL, contention_writer, NULL);
+        for (i = 0; i < threads; i++)
+            pthread_create(&tid[i], NULL, contention_reader, (void*)(long)i);
+        for (i = 0; i < threads; i++)
+            pthread_join(tid[i], NULL);
+        elapsed = now() - start;
+        readers_done = 1;
+        pthread_join(writer, &inserts);
+
+        printf("1 writer, %2d readers: %10.0f reads/sec, %8.0f inserts/sec, "
+               "hit ratio %.1f%%\n", threads,
+               (double)threads * OPS_PER_THREAD / elapsed,
+               (long)inserts / elapsed, get_cache_hit_ratio(NULL) * 100);
+        deinit_cache();
+    }
+    free(content);
+}
+
+/*
+ * text_response - Make a text/plain response of up to len bytes of the file
+ *                 at path, from offset on. Return its length, or -1.
+ */
+static int text_response(const char *path, long offset, int len, char *buf)
+{
+    FILE *fp = fopen(path, "r");
+    int head, n;
+
+    if (fp == NULL)
+        return -1;
+    head = sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n"
+                   "Content-type: text/plain\r\n\r\n");
+    fseek(fp, offset, SEEK_SET);
+    n = fread(buf + head, 1, len - head, fp);
+    fclose(fp);
+    return n > 0 ? head + n : -1;
+}
+
+/*
+ * fill_text - Insert TEXT_URLS text responses of 2 to 34KB, pieces of the
+ *             sources, in a cache of MAX_CACHE_SIZE. Return how many stay.
+ */
+static int fill_text(int compression)
+{
+    static const char *files[] = { "csapp.c", "cache.c", "ConnectionOperation.c" };
+    char *buf = malloc(MAX_OBJECT_SIZE);
+    char url[64];
+    struct object *obj;
+    int i, len, resident = 0;
+
+    init_cache(1, MAX_CACHE_SIZE);
+    set_cache_admission(0);
+    set_cache_compression(compression);
+    for (i = 0; i < TEXT_URLS; i++)
+    {
+        len = text_response(files[i % 3], (i * 977) % 20000,
+                            2048 + (i * 7919) % 32768, buf);
+        sprintf(url, "http://www.example.com/text/%d", i);
+        if (len > 0)
+            insert_in_cache(url, cache_hash(url), buf, len);
+    }
+    for (i = 0; i < TEXT_URLS; i++)
+    {
+        sprintf(url, "http://www.example.com/text/%d", i);
+        if ((obj = search_in_cache(url, cache_hash(url))) != NULL)
+            resident++;
+        release_object(obj);
+    }
+    free(buf);
+    return resident;
+}
+
+/*
+ * time_text_hits - return the average time of a hit on the resident text
+ *                  objects, sent to a client accepting gzip or not.
+ */
+static double time_text_hits(int gzip)
+{
+    unsigned int seed = 1;
+    char url[64];
+    struct object *obj;
+    double start = now();
+    int i;
+
+    for (i = 0; i < TEXT_HITS; i++)
+    {
+        sprintf(url, "http://www.example.com/text/%d", rand_r(&seed) % TEXT_URLS);
+        if ((obj = search_in_cache(url, cache_hash(url))) != NULL)
+            release_object(negotiate_object(obj, gzip));
+    }
+    return (now() - start) / TEXT_HITS;
+}
+
+/*
+ * bench_compression - Show how many more text objects a compressed cache
+ *                     holds, and what a hit costs when it must be decoded.
+ */
+static void bench_compression(void)
+{
+    int plain, compressed;
+    double plain_hit, gzip_hit, identity_hit, ratio;
+
+    plain = fill_text(0);
+    plain_hit = time_text_hits(0);
+    deinit_cache();
+
+    compressed = fill_text(1);
+    ratio = get_cache_compression();
+    gzip_hit = time_text_hits(1);
+    identity_hit = time_text_hits(0);
+    set_cache_compression(0);
+    deinit_cache();
+
+    if (plain == 0)
+    {
+        printf("gzip: no text sources found, run from the proxy directory\n");
+        return;
+    }
+    printf("gzip: %d of %d text objects resident, %d compressed: "
+           "capacity x%.2f (stored x%.2f)\n", plain, TEXT_URLS, compressed,
+           (double)compressed / plain, ratio);
+    printf("gzip: hit %.2f us plain, %.2f us sent encoded, %.2f us decoded\n",
+           plain_hit * 1e6, gzip_hit * 1e6, identity_hit * 1e6);
+}
+
+/*
+ * loopback_pair - Connect two TCP sockets through the loopback, as a client
+ *                 of the proxy would be. Return 0 if success, or -1.
+ */
+static int loopback_pair(int *client, int *server)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, len) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0 ||
+        (*client = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(*client, (struct sockaddr *)&addr, len) < 0 ||
+        (*server = accept(listenfd, NULL, NULL)) < 0)
+        return -1;
+    close(listenfd);
+    return 0;
+}
+
+static void *drain_socket(void *arg)
+{
+    char buf[65536];
+    int fd = (long)arg;
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static double thread_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * send_hits - Send hits on the resident objects to fd as the proxy does,
+ *             with sendfile once the hop headers are out if the object is
+ *             in a file, until SEND_BYTES are sent. Return the bytes sent.
+ */
+static long send_hits(int fd)
+{
+    struct object_cursor cursor;
+    struct iovec iov[16];
+    struct object *obj;
+    char url[64];
+    long sent, total = 0;
+    ssize_t nwrite = 0;
+    off_t offset;
+    int i, file;
+
+    for (i = 0; total < SEND_BYTES && nwrite >= 0; i++)
+    {
+        sprintf(url, "http://send.example.com/%d", i % SEND_OBJECTS);
+        if ((obj = search_in_cache(url, cache_hash(url))) == NULL)
+            return total;
+        open_object(obj, &cursor);
+        while (get_object_pending(obj, &cursor) > 0)
+        {
+            file = get_object_file(obj, &offset);
+            if (file >= 0 && (sent = get_object_offset(obj, &cursor)) >= 0)
+            {
+                offset += sent;
+                nwrite = sendfile(fd, file, &offset, get_object_size(obj) - sent);
+            }
+            else
+                /* Only the head of an object in a file */
+                nwrite = writev(fd, iov, read_object(obj, &cursor, iov,
+                                                     file >= 0 ? 2 : 16));
+            if (nwrite <= 0)
+                break;
+            consume_object(obj, &cursor, nwrite);
+            total += nwrite;
+        }
+        release_object(obj);
+    }
+    return total;
+}
+
+/*
+ * time_send - Send the hits to a loopback client draining them, with the
+ *             objects in a memfd or not, and show the throughput and the
+ *             CPU time of the sending thread per GB.
+ */
+static void time_send(int memfd)
+{
+    char *buf = malloc(SEND_OBJECT_SIZE);
+    char url[64];
+    int i, len, client, server;
+    pthread_t tid;
+    double start, cpu, elapsed;
+    long bytes;
+
+    set_cache_memfd(memfd);
+    init_cache(1, 2 * SEND_OBJECTS * MAX_OBJECT_SIZE);
+    set_cache_admission(0);
+    len = sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n", 0);
+    len = sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n",
+                  SEND_OBJECT_SIZE - len);
+    memset(buf + len, 'x', SEND_OBJECT_SIZE - len);
+    for (i = 0; i < SEND_OBJECTS; i++)
+    {
+        sprintf(url, "http://send.example.com/%d", i);
+        insert_in_cache(url, cache_hash(url), buf, SEND_OBJECT_SIZE);
+    }
+
+    if (loopback_pair(&client, &server) < 0)
+    {
+        printf("send: no loopback connection\n");
+        deinit_cache();
+        free(buf);
+        return;
+    }
+    pthread_create(&tid, NULL, drain_socket, (void*)(long)client);
+    start = now();
+    cpu = thread_cpu();
+    bytes = send_hits(server);
+    cpu = thread_cpu() - cpu;
+    elapsed = now() - start;
+    close(server);
+    pthread_join(tid, NULL);
+    close(client);
+
+    printf("send: %-8s %.0f MB/s, %.3f CPU s per GB sent\n",
+           memfd ? "sendfile" : "writev", bytes / elapsed / 1e6,
+           cpu / (bytes / 1e9));
+    set_cache_memfd(0);
+    deinit_cache();
+    free(buf);
+}
+
+/*
+ * bench_send - Compare the hit path writing objects from memory with the
+ *              one sending them from a memfd.
+ */
+static void bench_send(void)
+{
+    time_send(0);
+    time_send(1);
+}
+
+/*
+ * bench_size_mix - Fill the cache with small objects, then switch to large
+ *                  ones, and show how the slab classes follow the shift.
+ */
+static void bench_size_mix(void)
+{
+    char url[64];
+    char *content = calloc(1, MAX_OBJECT_SIZE);
+    unsigned int seed = 1;
+    int i, stored = 0;
+
+    init_cache(1, MAX_CACHE_SIZE);
+    for (i = 0; i < 20000; i++)
+    {
+        sprintf(url, "http://small.example.com/%d", i);
+        insert_in_cache(url, cache_hash(url), content, 100 + rand_r(&seed) % 900);
+    }
+    printf("After small objects:\n");
+    dump_cache_stats(stdout);
+
+    for (i = 0; i < 200; i++)
+    {
+        sprintf(url, "http://large.example.com/%d", i);
+        if (insert_in_cache(url, cache_hash(url), content,
+                            10000 + rand_r(&seed) % (MAX_OBJECT_SIZE - 10000)) == 0)
+            stored++;
+    }
+    printf("After large objects (%d of 200 stored):\n", stored);
+    dump_cache_stats(stdout);
+    deinit_cache();
+    free(content);
+}
+
+/*
+ * trace_object_size - Four objects in five are small JSON like responses,
+ *                     the others are images of up to MAX_OBJECT_SIZE.
+ */
+static int trace_object_size(unsigned int hash)
+{
+    if (hash % 5)
+        return 100 + hash % 2000;
+    return 20000 + hash % (MAX_OBJECT_SIZE - 20000);
+}
+
+/*
+ * replay_trace - Replay a Zipf trace interrupted by scans of one hit
+ *                wonders, inserting every miss like the proxy does. Return
+ *                the object hit ratio and set the byte hit ratio.
+ */
+static double replay_trace(const char *policy, int admission, double *byte_ratio)
+{
+    struct zipf z;
+    unsigned int seed = 7;
+    char url[64];
+    char *content = malloc(MAX_OBJECT_SIZE);
+    struct object *obj;
+    int i, hits = 0, scan = 0;
+    unsigned int hash;
+    double bytes = 0, hit_bytes = 0;
+
+    zipf_init(&z, TRACE_URLS, 0.8);
+    set_cache_policy(policy);
+    init_cache(1, MAX_CACHE_SIZE * 4);
+    set_cache_admission(admission);
+    for (i = 0; i < TRACE_LENGTH; i++)
+    {
+        /* One request in four belongs to a scan */
+        if (i % 4 == 3)
+            sprintf(url, "http://scan.example.com/%d", scan++);
+        else
+            sprintf(url, "http://www.example.com/%d", zipf_next(&z, &seed));
+        hash = cache_hash(url);
+        bytes += trace_object_size(hash);
+        if ((obj = search_in_cache(url, hash)) != NULL)
+        {
+            hits++;
+            hit_bytes += get_object_size(obj);
+            release_object(obj);
+            continue;
+        }
+        fill_response(content, trace_object_size(hash));
+        insert_in_cache(url, hash, content, trace_object_size(hash));
+    }
+    deinit_cache();
+    set_cache_admission(0);
+    set_cache_policy("lru");
+    free(z.cdf);
+    free(content);
+
+    *byte_ratio = hit_bytes / bytes;
+    return (double)hits / TRACE_LENGTH;
+}
+
+/*
+ * bench_policies - Compare the object and byte hit ratios of the eviction
+ *                  policies, with and without TinyLFU admission.
+ */
+static void bench_policies(void)
+{
+    const char *names[] = {"lru", "arc", "s3fifo", "gdsf"};
+    double objects, bytes;
+    int i, admission;
+
+    for (admission = 0; admission <= 1; admission++)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            objects = replay_trace(names[i], admission, &bytes);
+            printf("%-7s%-9s object hit ratio %5.1f%%, byte hit ratio %5.1f%%\n",
+                    names[i], admission ? "+TinyLFU" : "",
+                    100 * objects, 100 * bytes);
+        }
+    }
+}
+
+/*
+ * Workloads of bench-cache. Every thread runs ops requests, each a search
+ * followed by an insert on a miss, like the proxy does, and times them in
+ * a histogram of LATENCY_STEPS buckets per power of two nanoseconds.
+ */
+#define LATENCY_STEPS 16
+#define LATENCY_BUCKETS (64 * LATENCY_STEPS)
+/* One churn request in CHURN_REMOVE invalidates a key instead */
+#define CHURN_REMOVE 8
+
+enum workload {ZIPF, SCAN, CHURN};
+
+struct load {
+    enum workload workload;
+    int keys;              /* Distinct urls requested */
+    int size;              /* Object size */
+    int ops;               /* Requests per thread */
+    double alpha;          /* Skew of the Zipf workload */
+    struct zipf zipf;
+    char *content;
+};
+
+struct load_thread {
+    pthread_t tid;
+    struct load *load;
+    int id;
+    int ops;
+    int first;             /* First key of the scan */
+    long searches;
+    long hits;
+    long latency[LATENCY_BUCKETS];
+};
+
+static const char *workload_names[] = {"zipf", "scan", "churn"};
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * latency_bucket - Index of the histogram bucket of ns, the value of a
+ *                  bucket is latency_value() within 1/LATENCY_STEPS.
+ */
+static int latency_bucket(long ns)
+{
+    int log;
+
+    if (ns < LATENCY_STEPS)
+        return ns < 0 ? 0 : ns;
+    log = 63 - __builtin_clzl(ns);
+    return (log - 3) * LATENCY_STEPS + (ns >> (log - 4) & (LATENCY_STEPS - 1));
+}
+
+static long latency_value(int bucket)
+{
+    if (bucket < LATENCY_STEPS)
+        return bucket;
+    return (long)(LATENCY_STEPS + bucket % LATENCY_STEPS) <<
+           (bucket / LATENCY_STEPS - 1);
+}
+
+/*
+ * latency_percentile - return the latency in ns under which the fraction p
+ *                      of the count requests of the histogram completed.
+ */
+static long latency_percentile(const long *latency, long count, double p)
+{
+    long seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += latency[i];
+        if (seen > 0 && seen >= p * count)
+            return latency_value(i);
+    }
+    return latency_value(LATENCY_BUCKETS - 1);
+}
+
+/*
+ * resident_size - return the resident set size of the process in bytes.
+ */
+static long resident_size(void)
+{
+    long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * load_key - return the key of the i-th request of the thread.
+ */
+static int load_key(struct load_thread *t, int i, unsigned int *seed)
+{
+    struct load *load = t->load;
+
+    switch (load->workload)
+    {
+    case ZIPF:
+        return zipf_next(&load->zipf, seed);
+    case SCAN:
+        return (t->first + i) % load->keys;
+    default:
+        return rand_r(seed) % load->keys;
+    }
+}
+
+static void *load_thread(void *arg)
+{
+    struct load_thread *t = arg;
+    struct load *load = t->load;
+    unsigned int seed = t->id + 1, hash;
+    char url[64];
+    struct object *obj;
+    long start;
+    int i, key;
+
+    for (i = 0; i < t->ops; i++)
+    {
+        key = load_key(t, i, &seed);
+        sprintf(url, "http://load.example.com/%d", key);
+        start = now_ns();
+        hash = cache_hash(url);
+        if (load->workload == CHURN && i % CHURN_REMOVE == CHURN_REMOVE - 1)
+        {
+            remove_from_cache(url, hash);
+        }
+        else
+        {
+            t->searches++;
+            if ((obj = search_in_cache_local(url, hash)) != NULL)
+            {
+                t->hits++;
+                release_object(obj);
+            }
+            else
+            {
+                insert_in_cache(url, hash, load->content, load->size);
+            }
+        }
+        t->latency[latency_bucket(now_ns() - start)]++;
+    }
+    flush_local_cache();
+
+    return NULL;
+}
+
+/*
+ * run_load - Warm a new cache up with one pass over the keys, then run the
+ *            workload on threads threads and print the results.
+ */
+static void run_load(struct load *load, int nshard, int capacity, int threads)
+{
+    struct load_thread *t = calloc(threads + 1, sizeof(struct load_thread));
+    long latency[LATENCY_BUCKETS] = {0}, ops = 0, searches = 0, hits = 0;
+    double start, elapsed;
+    int i, j;
+
+    init_cache(nshard, capacity);
+    t[threads].load = load;
+    t[threads].id = threads;
+    t[threads].ops = load->keys;
+    load_thread(&t[threads]);
+
+    start = now();
+    for (i = 0; i < threads; i++)
+    {
+        t[i].load = load;
+        t[i].id = i;
+        t[i].ops = load->ops;
+        t[i].first = (long)load->keys * i / threads;
+        pthread_create(&t[i].tid, NULL, load_thread, &t[i]);
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(t[i].tid, NULL);
+    elapsed = now() - start;
+
+    for (i = 0; i < threads; i++)
+    {
+        ops += t[i].ops;
+        searches += t[i].searches;
+        hits += t[i].hits;
+        for (j = 0; j < LATENCY_BUCKETS; j++)
+            latency[j] += t[i].latency[j];
+    }
+    printf("%-5s %2d threads: %10.0f ops/sec, p50 %6.2f us, p99 %6.2f us, "
+           "hit ratio %5.1f%%, rss %6.1f MB\n", workload_names[load->workload],
+           threads, ops / elapsed, latency_percentile(latency, ops, 0.5) / 1e3,
+           latency_percentile(latency, ops, 0.99) / 1e3,
+           searches ? 100.0 * hits / searches : 0, resident_size() / 1048576.0);
+    deinit_cache();
+    free(t);
+}
+
+static void load_usage(const char *progname)
+{
+    fprintf(stderr, "%s [-w zipf|scan|churn] [-t max_threads] [-n ops_per_thread] "
+            "[-k keys] [-o object_bytes] [-e zipf_alpha] [-s shards] "
+            "[-m cache_bytes] [-a 0|1] [-p lru|arc|s3fifo|gdsf]\n"
+            "without options, run the micro benchmarks\n", progname);
+    exit(-1);
+}
+
+/*
+ * bench_load - Run the workload of the options on 1, 2, 4... up to the
+ *              maximum thread count.
+ */
+static void bench_load(int argc, char *argv[])
+{
+    struct load load = {ZIPF, 100000, OBJECT_SIZE, OPS_PER_THREAD, 0.99};
+    int nshard = 8, capacity = 64 * MAX_CACHE_SIZE, max_threads = 8;
+    int admission = 1, threads, opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "w:t:n:k:o:e:s:m:a:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            for (load.workload = ZIPF; load.workload <= CHURN; load.workload++)
+            {
+                if (!strcmp(optarg, workload_names[load.workload]))
+                    break;
+            }
+            if (load.workload > CHURN)
+                load_usage(argv[0]);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            load.ops = atoi(optarg);
+            break;
+        case 'k':
+            load.keys = atoi(optarg);
+            break;
+        case 'o':
+            load.size = atoi(optarg);
+            break;
+        case 'e':
+            load.alpha = atof(optarg);
+            break;
+        case 's':
+            nshard = atoi(optarg);
+            break;
+        case 'm':
+            capacity = atoi(optarg);
+            break;
+        case 'a':
+            admission = atoi(optarg);
+            break;
+        case 'p':
+            if (set_cache_policy(optarg) < 0)
+                load_usage(argv[0]);
+            break;
+        default:
+            load_usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || load.ops < 1 ||
+        load.keys < 1 || load.size < RESPONSE_MIN || load.size > MAX_OBJECT_SIZE)
+        load_usage(argv[0]);
+
+    set_cache_admission(admission);
+    load.content = malloc(load.size);
+    fill_response(load.content, load.size);
+    if (load.workload == ZIPF)
+        zipf_init(&load.zipf, load.keys, load.alpha);
+    printf("%s: %d keys of %d bytes, %d requests per thread, %d bytes cache "
+           "in %d shards, %s policy, admission %s\n",
+           workload_names[load.workload], load.keys, load.size, load.ops,
+           capacity, nshard, get_cache_policy(), admission ? "on" : "off");
+    for (threads = 1; ; threads *= 2)
+    {
+        if (threads > max_threads)
+            threads = max_threads;
+        run_load(&load, nshard, capacity, threads);
+        if (threads == max_threads)
+            break;
+    }
+    if (load.workload == ZIPF)
+        free(load.zipf.cdf);
+    free(load.content);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        bench_load(argc, argv);
+        return 0;
+    }
+
+    bench_lookup(100);
+    bench_lookup(10000);
+    bench_lookup(1000000);
+
+    bench_size_mix();
+    bench_policies();
+
+    bench_throughput(1);
+    bench_throughput(MAX_CACHE_SIZE / MAX_OBJECT_SIZE);
+    bench_contention();
+    bench_hot_set();
+    bench_compression();
+    bench_send();
+    return 0;
+}
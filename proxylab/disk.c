@@ -0,0 +1,518 @@
+/*************************************************************************
+	> File Name: disk.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Disk tier of the cache, memory mapped segment files.
+	>
+	> Objects evicted from memory are appended to the current segment, a
+	> file of segment_size bytes mapped in memory. The index of the objects
+	> on disk stays in memory. When the current segment is full a new one
+	> is started, and once the tier holds more than capacity bytes of
+	> segments the oldest one is dropped with all its objects, like a log.
+	> A segment is referenced by every reader of one of its objects, so a
+	> dropped segment is unlinked at once but unmapped by its last reader.
+> A counting Bloom filter of the hashes on disk tells most misses before
+> the lock is taken.
+ ************************************************************************/
+#include "disk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "typedef.h"
+#include "bloom.h"
+
+#define DISK_BUCKETS 1024
+/* Filter counters per byte of capacity, and at least */
+#define DISK_FILTER_RATIO 512
+#define DISK_FILTER_MIN 1024
+
+struct _DiskSegment
+{
+    int id;
+    int fd;
+    char *base;              /* The mapped file */
+    long size;               /* Size of the file */
+    long used;               /* Bytes appended so far */
+    int refcnt;              /* One for the tier while live, one per reader */
+    struct _DiskSegment *next; /* Next newer segment */
+};
+
+struct disk_entry {
+    unsigned int hash;
+    DiskSegment *segment;
+    long offset;
+    int len;
+    int hits;
+    struct cache_lifetime life;  /* Kept up to date by the revalidations */
+    struct disk_entry *hnext;
+    char key[];              /* Allocated at its length */
+};
+
+struct _DiskTier
+{
+    char dir[256];
+    long segment_size;
+    int max_segments;
+    DiskSegment *oldest;
+    DiskSegment *current;    /* Newest segment, objects are appended to it */
+    int nsegments;
+    int next_id;
+    struct disk_entry **buckets;
+    unsigned int nbuckets;
+    int count;
+    long bytes;
+    long stores;
+    long hits;
+    long dropped;            /* Objects lost with their segment */
+    CountingBloom *filter;   /* Hashes of the entries, read without the lock */
+    long filtered;           /* Misses told by the filter */
+    long false_positives;    /* Misses the filter let through */
+    pthread_mutex_t mtx;
+};
+
+static void segment_path(DiskTier *thiz, int id, char *path, size_t size)
+{
+    snprintf(path, size, "%s/segment-%06d", thiz->dir, id);
+}
+
+/*
+ * open_segment - Create and map a new empty segment file.
+ */
+static DiskSegment* open_segment(DiskTier *thiz)
+{
+    char path[320];
+    DiskSegment *seg = calloc(1, sizeof(DiskSegment));
+
+    return_val_if_fail(seg != NULL, NULL);
+
+    seg->id = thiz->next_id++;
+    segment_path(thiz, seg->id, path, sizeof(path));
+    if ((seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+    {
+        fprintf(stderr, "open %s error, %s\n", path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+    seg->base = MAP_FAILED;
+    if (ftruncate(seg->fd, thiz->segment_size) == 0)
+        seg->base = mmap(NULL, thiz->segment_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, seg->fd, 0);
+    if (seg->base == MAP_FAILED)
+    {
+        fprintf(stderr, "map %s error, %s\n", path, strerror(errno));
+        close(seg->fd);
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+    seg->size = thiz->segment_size;
+    seg->refcnt = 1;
+
+    return seg;
+}
+
+void disk_release(DiskSegment *segment)
+{
+    if (segment && __sync_sub_and_fetch(&segment->refcnt, 1) == 0)
+    {
+        munmap(segment->base, segment->size);
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+/*
+ * drop_oldest - Forget the oldest segment and the objects stored in it.
+ */
+static void drop_oldest(DiskTier *thiz)
+{
+    char path[320];
+    unsigned int b;
+    struct disk_entry **pp, *entry;
+    DiskSegment *seg = thiz->oldest;
+
+    for (b = 0; b < thiz->nbuckets; b++)
+    {
+        pp = &thiz->buckets[b];
+        while ((entry = *pp) != NULL)
+        {
+            if (entry->segment == seg)
+            {
+                *pp = entry->hnext;
+                thiz->count--;
+                thiz->bytes -= entry->len;
+                thiz->dropped++;
+                bloom_remove(thiz->filter, entry->hash);
+                free(entry);
+            }
+            else
+            {
+                pp = &entry->hnext;
+            }
+        }
+    }
+
+    thiz->oldest = seg->next;
+    thiz->nsegments--;
+    segment_path(thiz, seg->id, path, sizeof(path));
+    unlink(path);
+    disk_release(seg);
+}
+
+static struct disk_entry* find_entry(DiskTier *thiz, const char *url,
+                                     unsigned int hash)
+{
+    struct disk_entry *entry = thiz->buckets[hash & (thiz->nbuckets - 1)];
+
+    while (entry && (entry->hash != hash || strcmp(entry->key, url)))
+        entry = entry->hnext;
+    return entry;
+}
+
+static void grow_index(DiskTier *thiz)
+{
+    unsigned int i, n = thiz->nbuckets * 2;
+    struct disk_entry **buckets, *entry, *next;
+
+    if ((buckets = calloc(n, sizeof(struct disk_entry*))) == NULL)
+        return;
+    for (i = 0; i < thiz->nbuckets; i++)
+    {
+        for (entry = thiz->buckets[i]; entry; entry = next)
+        {
+            next = entry->hnext;
+            entry->hnext = buckets[entry->hash & (n - 1)];
+            buckets[entry->hash & (n - 1)] = entry;
+        }
+    }
+    free(thiz->buckets);
+    thiz->buckets = buckets;
+    thiz->nbuckets = n;
+}
+
+/*
+ * disk_create - Create a disk tier of capacity bytes in the directory dir,
+ *               made of segment files of segment_size bytes.
+ */
+DiskTier* disk_create(const char *dir, long capacity, long segment_size)
+{
+    DiskTier *thiz;
+
+    return_val_if_fail(dir != NULL && segment_size > 0, NULL);
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "mkdir %s error, %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    if ((thiz = calloc(1, sizeof(DiskTier))) == NULL)
+        return NULL;
+    snprintf(thiz->dir, sizeof(thiz->dir), "%s", dir);
+    thiz->segment_size = segment_size;
+    /* Keep at least the segment being filled and the previous one */
+    thiz->max_segments = capacity / segment_size;
+    if (thiz->max_segments < 2)
+        thiz->max_segments = 2;
+    thiz->nbuckets = DISK_BUCKETS;
+    thiz->buckets = calloc(thiz->nbuckets, sizeof(struct disk_entry*));
+    thiz->filter = bloom_create(capacity / DISK_FILTER_RATIO > DISK_FILTER_MIN ?
+                                capacity / DISK_FILTER_RATIO : DISK_FILTER_MIN);
+    if (thiz->buckets == NULL || thiz->filter == NULL)
+    {
+        bloom_destroy(thiz->filter);
+        free(thiz->buckets);
+        free(thiz);
+        return NULL;
+    }
+    pthread_mutex_init(&thiz->mtx, NULL);
+
+    return thiz;
+}
+
+/*
+ * disk_store - Append the object made of the iovecs to the current segment.
+ *              Return 0 if success, or -1 if the object is already on disk
+ *              or can't be stored.
+ */
+int disk_store(DiskTier *thiz, const char *url, unsigned int hash,
+               const struct cache_lifetime *life,
+               const struct iovec *iov, int iovcnt)
+{
+    struct disk_entry *entry;
+    DiskSegment *seg;
+    long len = 0;
+    int i;
+
+    return_val_if_fail(thiz != NULL && life != NULL, -1);
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len <= 0 || len > thiz->segment_size || strlen(url) >= MAX_REQUEST)
+        return -1;
+
+    pthread_mutex_lock(&thiz->mtx);
+    if (find_entry(thiz, url, hash) ||
+        (entry = malloc(sizeof(struct disk_entry) + strlen(url) + 1)) == NULL)
+    {
+        pthread_mutex_unlock(&thiz->mtx);
+        return -1;
+    }
+
+    if (thiz->current == NULL ||
+        thiz->current->used + len > thiz->segment_size)
+    {
+        if ((seg = open_segment(thiz)) == NULL)
+        {
+            pthread_mutex_unlock(&thiz->mtx);
+            free(entry);
+            return -1;
+        }
+        if (thiz->current)
+            thiz->current->next = seg;
+        else
+            thiz->oldest = seg;
+        thiz->current = seg;
+        thiz->nsegments++;
+        while (thiz->nsegments > thiz->max_segments)
+            drop_oldest(thiz);
+    }
+
+    seg = thiz->current;
+    strcpy(entry->key, url);
+    entry->hash = hash;
+    entry->segment = seg;
+    entry->offset = seg->used;
+    entry->len = len;
+    entry->hits = 0;
+    entry->life = *life;
+    for (i = 0; i < iovcnt; i++)
+    {
+        memcpy(seg->base + seg->used, iov[i].iov_base, iov[i].iov_len);
+        seg->used += iov[i].iov_len;
+    }
+
+    entry->hnext = thiz->buckets[hash & (thiz->nbuckets - 1)];
+    thiz->buckets[hash & (thiz->nbuckets - 1)] = entry;
+    bloom_add(thiz->filter, hash);
+    thiz->count++;
+    thiz->bytes += len;
+    thiz->stores++;
+    if ((unsigned int)thiz->count > thiz->nbuckets)
+        grow_index(thiz);
+    pthread_mutex_unlock(&thiz->mtx);
+
+    return 0;
+}
+
+/*
+ * disk_lookup - Find the object of url on disk. Return 0 and fill ref if
+ *               found, or -1 if not. Call disk_release(ref->segment) when
+ *               the data is no longer used.
+ */
+int disk_lookup(DiskTier *thiz, const char *url, unsigned int hash,
+                struct disk_ref *ref)
+{
+    struct disk_entry *entry;
+
+    return_val_if_fail(thiz != NULL && ref != NULL, -1);
+
+    if (!bloom_may_contain(thiz->filter, hash))
+    {
+        __sync_add_and_fetch(&thiz->filtered, 1);
+        return -1;
+    }
+    pthread_mutex_lock(&thiz->mtx);
+    if ((entry = find_entry(thiz, url, hash)) == NULL)
+    {
+        thiz->false_positives++;
+        pthread_mutex_unlock(&thiz->mtx);
+        return -1;
+    }
+    __sync_add_and_fetch(&entry->segment->refcnt, 1);
+    ref->segment = entry->segment;
+    ref->data = entry->segment->base + entry->offset;
+    ref->len = entry->len;
+    ref->hits = ++entry->hits;
+    ref->life = entry->life;
+    thiz->hits++;
+    pthread_mutex_unlock(&thiz->mtx);
+
+    return 0;
+}
+
+/*
+ * disk_set_lifetime - The object of url was revalidated, the next hits get
+ *                     its new lifetime. Return 0, or -1 if it is not on disk.
+ */
+int disk_set_lifetime(DiskTier *thiz, const char *url, unsigned int hash,
+                      const struct cache_lifetime *life)
+{
+    struct disk_entry *entry;
+
+    return_val_if_fail(thiz != NULL && life != NULL, -1);
+
+    pthread_mutex_lock(&thiz->mtx);
+    if ((entry = find_entry(thiz, url, hash)) != NULL)
+        entry->life = *life;
+    pthread_mutex_unlock(&thiz->mtx);
+
+    return entry ? 0 : -1;
+}
+
+/*
+ * disk_purge - Forget the objects match selects, their bytes are reclaimed
+ *              with their segment. Return the number of objects purged.
+ */
+int disk_purge(DiskTier *thiz, DiskMatchFunc match, void *ctx)
+{
+    unsigned int b;
+    struct disk_entry **pp, *entry;
+    int purged = 0;
+
+    return_val_if_fail(thiz != NULL && match != NULL, 0);
+
+    pthread_mutex_lock(&thiz->mtx);
+    for (b = 0; b < thiz->nbuckets; b++)
+    {
+        pp = &thiz->buckets[b];
+        while ((entry = *pp) != NULL)
+        {
+            if (match(ctx, entry->key, entry->segment->base + entry->offset,
+                      entry->len))
+            {
+                *pp = entry->hnext;
+                thiz->count--;
+                thiz->bytes -= entry->len;
+                bloom_remove(thiz->filter, entry->hash);
+                free(entry);
+                purged++;
+            }
+            else
+            {
+                pp = &entry->hnext;
+            }
+        }
+    }
+    pthread_mutex_unlock(&thiz->mtx);
+    return purged;
+}
+
+/*
+ * disk_segment_fd - Return the file descriptor of the segment, and set
+ *                   offset to the file offset of data, so it can be sent
+ *                   with sendfile().
+ */
+int disk_segment_fd(DiskSegment *segment, const char *data, off_t *offset)
+{
+    *offset = data - segment->base;
+    return segment->fd;
+}
+
+void disk_dump_stats(DiskTier *thiz, FILE *fp)
+{
+    return_if_fail(thiz != NULL);
+
+    pthread_mutex_lock(&thiz->mtx);
+    fprintf(fp, "disk: %d objects, %ld bytes in %d segments, "
+            "%ld stores, %ld hits, %ld dropped\n", thiz->count, thiz->bytes,
+            thiz->nsegments, thiz->stores, thiz->hits, thiz->dropped);
+    if (thiz->filtered || thiz->false_positives)
+        fprintf(fp, "disk filter: %ld misses told without the lock, "
+                "false positive rate %.2f%%\n", thiz->filtered,
+                100.0 * thiz->false_positives /
+                (thiz->filtered + thiz->false_positives));
+    pthread_mutex_unlock(&thiz->mtx);
+}
+
+void disk_destroy(DiskTier *thiz)
+{
+    if (thiz != NULL)
+    {
+        while (thiz->oldest)
+            drop_oldest(thiz);
+        free(thiz->buckets);
+        bloom_destroy(thiz->filter);
+        pthread_mutex_destroy(&thiz->mtx);
+        free(thiz);
+    }
+}
+
+#ifdef DISK_TEST
+
+#include <assert.h>
+
+static void disk_store_test(void)
+{
+    char url[64];
+    char buf[4096];
+    struct iovec iov[2];
+    struct disk_ref ref, old;
+    struct cache_lifetime life = { 100, 130, 40 };
+    off_t offset;
+    int i, fd;
+    DiskTier *thiz = disk_create("/tmp/disk_test", 3 * 16384, 16384);
+
+    assert(thiz != NULL);
+    memset(buf, 'x', sizeof(buf));
+    iov[0].iov_base = "head";
+    iov[0].iov_len = 4;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = sizeof(buf);
+    assert(0 == disk_store(thiz, "http://disk.test/0", 0, &life, iov, 2));
+    assert(-1 == disk_store(thiz, "http://disk.test/0", 0, &life, iov, 2));
+
+    assert(0 == disk_lookup(thiz, "http://disk.test/0", 0, &ref));
+    assert(ref.len == 4 + sizeof(buf) && ref.hits == 1);
+    assert(ref.life.expires == 100 && ref.life.grace == 130 &&
+           ref.life.generated == 40);
+    assert(!memcmp(ref.data, "headxxx", 7));
+    fd = disk_segment_fd(ref.segment, ref.data, &offset);
+    assert(offset == 0 && pread(fd, buf, 4, offset) == 4);
+    assert(!memcmp(buf, "head", 4));
+    /* A revalidation is seen by the next hits */
+    life.expires = 200;
+    assert(0 == disk_set_lifetime(thiz, "http://disk.test/0", 0, &life));
+    assert(-1 == disk_set_lifetime(thiz, "http://disk.test/1", 1, &life));
+    assert(0 == disk_lookup(thiz, "http://disk.test/0", 0, &old));
+    assert(old.hits == 2 && old.life.expires == 200);
+    disk_release(ref.segment);
+
+    /* Fill 3 segments, the first one is dropped with object 0 */
+    for (i = 1; i < 12; i++)
+    {
+        sprintf(url, "http://disk.test/%d", i);
+        assert(0 == disk_store(thiz, url, i, &life, iov, 2));
+    }
+    assert(-1 == disk_lookup(thiz, "http://disk.test/0", 0, &ref));
+    /* Most urls never stored are told by the filter */
+    for (i = 100; i < 200; i++)
+    {
+        sprintf(url, "http://disk.test/%d", i);
+        assert(-1 == disk_lookup(thiz, url, i, &ref));
+    }
+    assert(thiz->filtered >= 90);
+    assert(0 == disk_lookup(thiz, "http://disk.test/11", 11, &ref));
+    disk_release(ref.segment);
+
+    /* The dropped segment stays mapped for its reader */
+    assert(!memcmp(old.data, "headxxx", 7));
+    disk_release(old.segment);
+
+    disk_dump_stats(thiz, stdout);
+    disk_destroy(thiz);
+    rmdir("/tmp/disk_test");
+}
+
+int main(int argc, char* argv[])
+{
+    disk_store_test();
+    return 0;
+}
+#endif
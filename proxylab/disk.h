@@ -0,0 +1,58 @@
+/*************************************************************************
+	> File Name: disk.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Disk tier of the cache, memory mapped segment files
+ ************************************************************************/
+
+#ifndef _DISK_H
+#define _DISK_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+
+#define DISK_CACHE_SIZE (1024L*1024*1024)
+#define DISK_SEGMENT_SIZE MAX_LARGE_OBJECT_SIZE
+/* Disk hits before an object is copied back to memory */
+#define DISK_PROMOTE_HITS 2
+
+struct _DiskTier;
+typedef struct _DiskTier DiskTier;
+
+struct _DiskSegment;
+typedef struct _DiskSegment DiskSegment;
+
+/* Return 1 if the object of url, of len bytes at data, must be purged */
+typedef int (*DiskMatchFunc)(void *ctx, const char *url, const char *data,
+                             int len);
+
+/*
+ * An object found on disk. The segment is referenced, so data stays
+ * mapped until disk_release().
+ */
+struct disk_ref {
+    DiskSegment *segment;
+    const char *data;
+    int len;
+    int hits;    /* Disk hits of the object, this one included */
+    struct cache_lifetime life;
+};
+
+DiskTier* disk_create(const char *dir, long capacity, long segment_size);
+int       disk_store(DiskTier *thiz, const char *url, unsigned int hash,
+                     const struct cache_lifetime *life,
+                     const struct iovec *iov, int iovcnt);
+int       disk_lookup(DiskTier *thiz, const char *url, unsigned int hash,
+                      struct disk_ref *ref);
+int       disk_set_lifetime(DiskTier *thiz, const char *url, unsigned int hash,
+                            const struct cache_lifetime *life);
+void      disk_release(DiskSegment *segment);
+int       disk_purge(DiskTier *thiz, DiskMatchFunc match, void *ctx);
+int       disk_segment_fd(DiskSegment *segment, const char *data, off_t *offset);
+void      disk_dump_stats(DiskTier *thiz, FILE *fp);
+void      disk_destroy(DiskTier *thiz);
+
+#endif
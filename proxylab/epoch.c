@@ -0,0 +1,352 @@
+/*************************************************************************
+	> File Name: epoch.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Epoch based reclamation for the lock-free cache readers.
+	>
+	> Readers walk the cache index without taking any lock, between
+	> epoch_enter() and epoch_exit(). A writer that unlinks something
+	> retires it instead of freeing it. Every thread in a read section
+	> announces the global epoch it saw; the global epoch only moves on
+	> once every reader has seen the current one, and a pointer retired in
+	> epoch e is freed when the global epoch reaches e + 2: by then no
+	> reader can still hold it. Readers never wait, only a writer short of
+	> memory may wait for the readers in epoch_synchronize().
+ ************************************************************************/
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "typedef.h"
+
+/*
+ * One slot per thread that ever entered a read section, on its own cache
+ * line so readers don't share the lines they write.
+ */
+struct epoch_slot {
+    volatile unsigned long epoch;   /* Global epoch seen on entry */
+    volatile int active;            /* In a read section */
+    volatile int used;              /* Owned by a live thread */
+} __attribute__((aligned(64)));
+
+struct retired {
+    void *ptr;
+    EpochFreeFunc free_func;
+    unsigned long epoch;            /* Global epoch when retired */
+    struct retired *next;
+};
+
+static struct epoch_slot slots[EPOCH_MAX_THREADS];
+static volatile unsigned long global_epoch = 2;
+
+static __thread struct epoch_slot *self;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+/* Retired pointers, oldest first */
+static struct retired *retired_head;
+static struct retired **retired_tail = &retired_head;
+static long retired_count;
+static pthread_mutex_t retired_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * release_slot - The thread exits, its slot can be reused.
+ */
+static void release_slot(void *ptr)
+{
+    struct epoch_slot *slot = ptr;
+
+    slot->active = 0;
+    __sync_synchronize();
+    slot->used = 0;
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+/*
+ * claim_slot - Give the calling thread a slot, released when it exits.
+ */
+static struct epoch_slot *claim_slot(void)
+{
+    int i;
+
+    pthread_once(&slot_once, create_key);
+    while (1)
+    {
+        for (i = 0; i < EPOCH_MAX_THREADS; i++)
+        {
+            if (!slots[i].used &&
+                __sync_bool_compare_and_swap(&slots[i].used, 0, 1))
+            {
+                pthread_setspecific(slot_key, &slots[i]);
+                return &slots[i];
+            }
+        }
+        /* More threads than slots, wait for one to exit */
+        sched_yield();
+    }
+}
+
+/*
+ * epoch_enter - Start a read section. Pointers read from the shared
+ *               structures stay valid until epoch_exit(). Sections don't
+ *               nest.
+ */
+void epoch_enter(void)
+{
+    if (self == NULL)
+        self = claim_slot();
+    self->epoch = global_epoch;
+    self->active = 1;
+    /* Announce the section before reading any pointer */
+    __sync_synchronize();
+}
+
+/*
+ * epoch_exit - End the read section.
+ */
+void epoch_exit(void)
+{
+    __atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * try_advance - Move the global epoch on if every reader has seen it.
+ *               Return 1 if the epoch moved on.
+ */
+static int try_advance(void)
+{
+    unsigned long epoch = global_epoch;
+    int i;
+
+    __sync_synchronize();
+    for (i = 0; i < EPOCH_MAX_THREADS; i++)
+    {
+        if (slots[i].used && slots[i].active && slots[i].epoch != epoch)
+            return 0;
+    }
+    return __sync_bool_compare_and_swap(&global_epoch, epoch, epoch + 1);
+}
+
+/*
+ * epoch_reclaim - Free the retired pointers no reader can hold anymore.
+ */
+void epoch_reclaim(void)
+{
+    struct retired *list = NULL, **tail = &list, *next;
+    unsigned long epoch;
+
+    try_advance();
+    epoch = global_epoch;
+
+    pthread_mutex_lock(&retired_mtx);
+    while (retired_head && retired_head->epoch + 2 <= epoch)
+    {
+        *tail = retired_head;
+        tail = &retired_head->next;
+        retired_head = retired_head->next;
+        retired_count--;
+    }
+    if (retired_head == NULL)
+        retired_tail = &retired_head;
+    *tail = NULL;
+    pthread_mutex_unlock(&retired_mtx);
+
+    for (; list; list = next)
+    {
+        next = list->next;
+        list->free_func(list->ptr);
+        free(list);
+    }
+}
+
+/*
+ * epoch_retire - ptr was unlinked from the shared structures, free it with
+ *                free_func once the readers that may have seen it are
+ *                gone.
+ */
+void epoch_retire(void *ptr, EpochFreeFunc free_func)
+{
+    struct retired *node;
+    long count;
+
+    if ((node = malloc(sizeof(struct retired))) == NULL)
+    {
+        epoch_synchronize();
+        free_func(ptr);
+        return;
+    }
+    node->ptr = ptr;
+    node->free_func = free_func;
+    node->next = NULL;
+    __sync_synchronize();
+    node->epoch = global_epoch;
+
+    pthread_mutex_lock(&retired_mtx);
+    *retired_tail = node;
+    retired_tail = &node->next;
+    count = ++retired_count;
+    pthread_mutex_unlock(&retired_mtx);
+
+    if (count % EPOCH_RECLAIM_BATCH == 0)
+        epoch_reclaim();
+}
+
+/*
+ * epoch_synchronize - Wait until the readers in a section when it was called
+ *                     are gone, and free what they could hold. Never call
+ *                     it from a read section.
+ */
+void epoch_synchronize(void)
+{
+    unsigned long target = global_epoch + 2;
+
+    while (global_epoch < target)
+    {
+        if (!try_advance())
+            sched_yield();
+    }
+    epoch_reclaim();
+}
+
+/*
+ * epoch_drain - Free every retired pointer. The caller guarantees there are
+ *               no readers left.
+ */
+void epoch_drain(void)
+{
+    struct retired *list, *next;
+
+    pthread_mutex_lock(&retired_mtx);
+    list = retired_head;
+    retired_head = NULL;
+    retired_tail = &retired_head;
+    retired_count = 0;
+    pthread_mutex_unlock(&retired_mtx);
+
+    for (; list; list = next)
+    {
+        next = list->next;
+        list->free_func(list->ptr);
+        free(list);
+    }
+}
+
+/*
+ * epoch_pending - return the number of retired pointers not freed yet.
+ */
+long epoch_pending(void)
+{
+    long count;
+
+    pthread_mutex_lock(&retired_mtx);
+    count = retired_count;
+    pthread_mutex_unlock(&retired_mtx);
+    return count;
+}
+
+#ifdef EPOCH_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+#define READERS 4
+#define ROUNDS 200000
+
+/*
+ * A shared pointer replaced by the writer, the readers check that what
+ * they read was never freed under them.
+ */
+struct cell {
+    volatile int alive;
+};
+
+static struct cell *volatile shared;
+static volatile int stop;
+static long freed;
+
+static void free_cell(void *ptr)
+{
+    struct cell *cell = ptr;
+
+    cell->alive = 0;
+    __sync_add_and_fetch(&freed, 1);
+    free(cell);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct cell *cell;
+
+    while (!stop)
+    {
+        epoch_enter();
+        cell = shared;
+        assert(cell->alive);
+        sched_yield();
+        assert(cell->alive);
+        epoch_exit();
+    }
+    return NULL;
+}
+
+static void epoch_stress_test(void)
+{
+    pthread_t tid[READERS];
+    struct cell *cell, *old;
+    int i;
+
+    shared = calloc(1, sizeof(struct cell));
+    shared->alive = 1;
+    for (i = 0; i < READERS; i++)
+        pthread_create(&tid[i], NULL, reader_thread, NULL);
+
+    for (i = 0; i < ROUNDS; i++)
+    {
+        cell = calloc(1, sizeof(struct cell));
+        cell->alive = 1;
+        old = shared;
+        __sync_synchronize();
+        shared = cell;
+        epoch_retire(old, free_cell);
+    }
+    stop = 1;
+    for (i = 0; i < READERS; i++)
+        pthread_join(tid[i], NULL);
+
+    /* The reader threads exited, everything can go */
+    epoch_synchronize();
+    assert(epoch_pending() == 0);
+    assert(freed == ROUNDS);
+    free_cell(shared);
+}
+
+static void epoch_slot_test(void)
+{
+    int n;
+
+    /* A thread in a read section holds the epoch back */
+    epoch_enter();
+    n = epoch_pending();
+    epoch_retire(malloc(1), free);
+    epoch_reclaim();
+    epoch_reclaim();
+    assert(epoch_pending() == n + 1);
+    epoch_exit();
+    epoch_synchronize();
+    assert(epoch_pending() == 0);
+}
+
+int main(int argc, char* argv[])
+{
+    epoch_slot_test();
+    epoch_stress_test();
+    printf("epoch test passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,26 @@
+/*************************************************************************
+	> File Name: epoch.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Epoch based reclamation for the lock-free cache readers
+ ************************************************************************/
+
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+/* Threads that can be in a read section at the same time */
+#define EPOCH_MAX_THREADS 256
+/* Retired pointers between two reclaim attempts */
+#define EPOCH_RECLAIM_BATCH 64
+
+typedef void (*EpochFreeFunc)(void *ptr);
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, EpochFreeFunc free_func);
+void epoch_reclaim(void);
+void epoch_synchronize(void);
+void epoch_drain(void);
+long epoch_pending(void);
+
+#endif
@@ -0,0 +1,625 @@
+/*************************************************************************
+	> File Name: fill.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: In-flight cache fills shared by concurrent misses.
+	>
+	> The first miss on a url becomes the leader of a fill and fetches the
+	> object from the origin. Later misses on the same url, from any proxy
+	> thread, join the fill as waiters instead of opening their own origin
+	> connection. The leader appends the response to a chain of chunks and
+	> every waiter streams it from there at its own pace, once the leader has
+> seen the head of the response and found that it may be shared. A waiter
+> of a response that may not has to fetch it again. A waiter that has
+	> caught up disables EPOLLOUT on its socket, the leader enables it again
+	> when more data arrives. epoll_ctl is safe across threads, and both
+	> sides do it under the fill mutex, so no wake up is lost.
+ ************************************************************************/
+#include "fill.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#define FILL_BUCKETS 256
+
+struct fill_waiter {
+    int epfd;
+    int fd;
+    struct fill_waiter *next;
+};
+
+struct fill {
+    unsigned int hash;
+    struct cache_chunk *first;
+    struct cache_chunk *last;
+    long length;                 /* Bytes appended so far */
+    long limit;                  /* Largest response kept for the cache */
+    FillState state;
+    int storing;                 /* 0 once the chunks are dropped */
+    int joinable;                /* 1 while the fill is in the table */
+    int shared;                  /* -1 until the head is seen, then 1 if
+                                    the waiters may get the response */
+    struct object *obj;          /* Cache object owning the chunks */
+    struct fill_waiter *waiters;
+    int refcnt;
+    pthread_mutex_t mtx;
+    struct fill *hnext;
+    char key[];                  /* Allocated at its length */
+};
+
+/*
+ * The in-flight fills, indexed by url.
+ */
+static struct fill *fills[FILL_BUCKETS];
+static pthread_mutex_t fills_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_chunks(struct fill *fill)
+{
+    struct cache_chunk *chunk, *next;
+
+    for (chunk = fill->first; chunk; chunk = next)
+    {
+        next = chunk->next;
+        free(chunk);
+    }
+    fill->first = fill->last = NULL;
+}
+
+/*
+ * detach - Remove the fill from the table, later misses start a new one.
+ */
+static void detach(struct fill *fill)
+{
+    struct fill **pp;
+
+    pthread_mutex_lock(&fills_mtx);
+    if (fill->joinable)
+    {
+        pp = &fills[fill->hash % FILL_BUCKETS];
+        while (*pp && *pp != fill)
+            pp = &(*pp)->hnext;
+        if (*pp)
+            *pp = fill->hnext;
+        fill->joinable = 0;
+    }
+    pthread_mutex_unlock(&fills_mtx);
+}
+
+/*
+ * wake_waiters - Enable EPOLLOUT of every waiter. Call it with fill->mtx.
+ */
+static void wake_waiters(struct fill *fill)
+{
+    struct fill_waiter *w;
+    struct epoll_event ev;
+
+    for (w = fill->waiters; w; w = w->next)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.data.fd = w->fd;
+        ev.events = EPOLLIN | EPOLLOUT;
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, w->fd, &ev);
+    }
+}
+
+/*
+ * fill_join - Join the in-flight fill of url, or start one. leader is set
+ *             to 1 if the caller started it and must fetch the object.
+ *             Return the fill with a reference, or NULL if out of memory.
+ */
+struct fill* fill_join(const char *url, unsigned int hash, int *leader)
+{
+    struct fill *fill;
+
+    if (strlen(url) >= MAX_REQUEST)
+        return NULL;
+
+    pthread_mutex_lock(&fills_mtx);
+    for (fill = fills[hash % FILL_BUCKETS]; fill; fill = fill->hnext)
+    {
+        if (fill->hash == hash && !strcmp(fill->key, url))
+        {
+            __sync_add_and_fetch(&fill->refcnt, 1);
+            pthread_mutex_unlock(&fills_mtx);
+            *leader = 0;
+            return fill;
+        }
+    }
+
+    if ((fill = calloc(1, sizeof(struct fill) + strlen(url) + 1)) != NULL)
+    {
+        strcpy(fill->key, url);
+        fill->hash = hash;
+        fill->state = FILL_ACTIVE;
+        fill->storing = 1;
+        fill->joinable = 1;
+        fill->shared = -1;
+        fill->limit = get_cache_object_limit();
+        fill->refcnt = 1;
+        pthread_mutex_init(&fill->mtx, NULL);
+        fill->hnext = fills[hash % FILL_BUCKETS];
+        fills[hash % FILL_BUCKETS] = fill;
+        *leader = 1;
+    }
+    pthread_mutex_unlock(&fills_mtx);
+
+    return fill;
+}
+
+/*
+ * fill_append - Append response bytes and wake the waiters. Once the
+ *               response outgrows the largest cacheable object nobody can
+ *               join anymore, and the chunks are dropped if nobody is
+ *               waiting for them.
+ */
+void fill_append(struct fill *fill, const char *buf, int len)
+{
+    struct cache_chunk *chunk;
+    int n;
+
+    pthread_mutex_lock(&fill->mtx);
+    if (fill->length + len > fill->limit && fill->joinable)
+    {
+        pthread_mutex_unlock(&fill->mtx);
+        detach(fill);
+        pthread_mutex_lock(&fill->mtx);
+        if (fill->waiters == NULL)
+        {
+            fill->storing = 0;
+            free_chunks(fill);
+        }
+    }
+
+    while (fill->storing && len > 0)
+    {
+        chunk = fill->last;
+        if (chunk == NULL || chunk->len == CACHE_CHUNK_SIZE)
+        {
+            if ((chunk = malloc(sizeof(struct cache_chunk))) == NULL)
+            {
+                /* Waiters can't get the rest, let them fail */
+                fill->state = FILL_ABORTED;
+                break;
+            }
+            chunk->next = NULL;
+            chunk->len = 0;
+            if (fill->last)
+                fill->last->next = chunk;
+            else
+                fill->first = chunk;
+            fill->last = chunk;
+        }
+        n = CACHE_CHUNK_SIZE - chunk->len < len ? CACHE_CHUNK_SIZE - chunk->len : len;
+        memcpy(chunk->data + chunk->len, buf, n);
+        chunk->len += n;
+        buf += n;
+        len -= n;
+        fill->length += n;
+    }
+    wake_waiters(fill);
+    pthread_mutex_unlock(&fill->mtx);
+}
+
+/*
+ * fill_finish - The leader is done, complete is 1 if the whole response was
+ *               received. The waiters are woken to send the rest or fail.
+ */
+void fill_finish(struct fill *fill, int complete)
+{
+    detach(fill);
+    pthread_mutex_lock(&fill->mtx);
+    if (fill->state == FILL_ACTIVE)
+        fill->state = complete ? FILL_DONE : FILL_ABORTED;
+    wake_waiters(fill);
+    pthread_mutex_unlock(&fill->mtx);
+}
+
+/*
+ * fill_share - The leader has seen the head of the response. If it may not
+ *              be shared, nobody joins the fill anymore and the waiters
+ *              are told to fetch it on their own. They have not been sent
+ *              anything yet.
+ */
+void fill_share(struct fill *fill, int shared)
+{
+    if (!shared)
+        detach(fill);
+    pthread_mutex_lock(&fill->mtx);
+    fill->shared = shared;
+    wake_waiters(fill);
+    pthread_mutex_unlock(&fill->mtx);
+}
+
+/*
+ * fill_held - Return 1 until the leader has called fill_share.
+ */
+int fill_held(struct fill *fill)
+{
+    int held;
+
+    pthread_mutex_lock(&fill->mtx);
+    held = fill->shared < 0;
+    pthread_mutex_unlock(&fill->mtx);
+
+    return held;
+}
+
+/*
+ * fill_add_waiter - Register the socket fd of epoll instance epfd to be
+ *                   woken when data arrives. Return 0 if success, or -1 if
+ *                   the fill can't be followed anymore.
+ */
+int fill_add_waiter(struct fill *fill, int epfd, int fd)
+{
+    struct fill_waiter *w;
+    int ret = -1;
+
+    pthread_mutex_lock(&fill->mtx);
+    if (fill->storing && fill->shared != 0 &&
+        (w = malloc(sizeof(struct fill_waiter))) != NULL)
+    {
+        w->epfd = epfd;
+        w->fd = fd;
+        w->next = fill->waiters;
+        fill->waiters = w;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&fill->mtx);
+
+    return ret;
+}
+
+void fill_remove_waiter(struct fill *fill, int fd)
+{
+    struct fill_waiter **pp, *w;
+
+    pthread_mutex_lock(&fill->mtx);
+    for (pp = &fill->waiters; *pp; pp = &(*pp)->next)
+    {
+        if ((*pp)->fd == fd)
+        {
+            w = *pp;
+            *pp = w->next;
+            free(w);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fill->mtx);
+}
+
+/*
+ * fill_read - Fill at most max iovecs with the bytes of the response after
+ *             the cursor. Return the number of iovecs, and set state.
+ */
+int fill_read(struct fill *fill, struct fill_cursor *cursor,
+              struct iovec *iov, int max, FillState *state)
+{
+    struct cache_chunk *chunk;
+    long avail;
+    int offset, n, i = 0;
+
+    pthread_mutex_lock(&fill->mtx);
+    *state = fill->state;
+    if (fill->shared == 0)
+        *state = FILL_PRIVATE;
+    else if (!fill->storing || (fill->shared < 0 && fill->state != FILL_ACTIVE))
+        *state = FILL_ABORTED;
+    if (fill->shared <= 0 || !fill->storing)
+    {
+        pthread_mutex_unlock(&fill->mtx);
+        return 0;
+    }
+    if (cursor->chunk == NULL)
+    {
+        cursor->chunk = fill->first;
+        cursor->offset = 0;
+    }
+    else if (cursor->offset == CACHE_CHUNK_SIZE && cursor->chunk->next)
+    {
+        cursor->chunk = cursor->chunk->next;
+        cursor->offset = 0;
+    }
+
+    avail = fill->length - cursor->sent;
+    chunk = cursor->chunk;
+    offset = cursor->offset;
+    while (chunk && avail > 0 && i < max)
+    {
+        n = chunk->len - offset;
+        if (n > avail)
+            n = avail;
+        if (n > 0)
+        {
+            iov[i].iov_base = chunk->data + offset;
+            iov[i].iov_len = n;
+            avail -= n;
+            i++;
+        }
+        chunk = chunk->next;
+        offset = 0;
+    }
+    pthread_mutex_unlock(&fill->mtx);
+
+    return i;
+}
+
+/*
+ * fill_consume - Move the cursor len bytes forward, after a write of the
+ *                iovecs returned by fill_read.
+ */
+void fill_consume(struct fill_cursor *cursor, long len)
+{
+    long n;
+
+    cursor->sent += len;
+    while (len > 0)
+    {
+        n = CACHE_CHUNK_SIZE - cursor->offset;
+        if (len < n || cursor->chunk->next == NULL)
+        {
+            cursor->offset += len;
+            break;
+        }
+        len -= n;
+        cursor->chunk = cursor->chunk->next;
+        cursor->offset = 0;
+    }
+}
+
+/*
+ * fill_wait - If the cursor has caught up with an active fill, disable
+ *             EPOLLOUT of fd until the leader appends more. Return 1 if the
+ *             caller has to wait, 0 if there is something to do.
+ */
+int fill_wait(struct fill *fill, struct fill_cursor *cursor, int epfd, int fd)
+{
+    struct epoll_event ev;
+    int wait = 0;
+
+    pthread_mutex_lock(&fill->mtx);
+    if (fill->state == FILL_ACTIVE && fill->storing &&
+        (fill->shared < 0 || cursor->sent == fill->length))
+    {
+        /* Only errors and hang ups, the request has been read already */
+        memset(&ev, 0, sizeof(ev));
+        ev.data.fd = fd;
+        ev.events = 0;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        wait = 1;
+    }
+    pthread_mutex_unlock(&fill->mtx);
+
+    return wait;
+}
+
+/*
+ * fill_done - Return 1 if the whole response has been received.
+ */
+int fill_done(struct fill *fill)
+{
+    int done;
+
+    pthread_mutex_lock(&fill->mtx);
+    done = fill->state == FILL_DONE;
+    pthread_mutex_unlock(&fill->mtx);
+
+    return done;
+}
+
+long fill_length(struct fill *fill)
+{
+    long length;
+
+    pthread_mutex_lock(&fill->mtx);
+    length = fill->length;
+    pthread_mutex_unlock(&fill->mtx);
+
+    return length;
+}
+
+/*
+ * fill_copy - Copy the whole response into buf. Return its length, or -1
+ *             if it is larger than max or was not kept.
+ */
+int fill_copy(struct fill *fill, char *buf, int max)
+{
+    struct cache_chunk *chunk;
+    int len = -1;
+
+    pthread_mutex_lock(&fill->mtx);
+    if (fill->storing && fill->length <= max)
+    {
+        len = 0;
+        for (chunk = fill->first; chunk; chunk = chunk->next)
+        {
+            memcpy(buf + len, chunk->data, chunk->len);
+            len += chunk->len;
+        }
+    }
+    pthread_mutex_unlock(&fill->mtx);
+
+    return len;
+}
+
+/*
+ * fill_chunks - Return the chunks of the whole response, or NULL if they
+ *               were not kept.
+ */
+struct cache_chunk* fill_chunks(struct fill *fill)
+{
+    struct cache_chunk *chunks;
+
+    pthread_mutex_lock(&fill->mtx);
+    chunks = fill->storing ? fill->first : NULL;
+    pthread_mutex_unlock(&fill->mtx);
+
+    return chunks;
+}
+
+/*
+ * fill_attach_object - The chunks were inserted in the cache as obj, so they
+ *                      now belong to it. The fill keeps the reference of obj
+ *                      and drops it instead of the chunks when released.
+ */
+void fill_attach_object(struct fill *fill, struct object *obj)
+{
+    pthread_mutex_lock(&fill->mtx);
+    fill->obj = obj;
+    pthread_mutex_unlock(&fill->mtx);
+}
+
+void fill_release(struct fill *fill)
+{
+    struct fill_waiter *w;
+
+    if (fill && __sync_sub_and_fetch(&fill->refcnt, 1) == 0)
+    {
+        detach(fill);
+        while ((w = fill->waiters) != NULL)
+        {
+            fill->waiters = w->next;
+            free(w);
+        }
+        if (fill->obj)
+            release_object(fill->obj);
+        else
+            free_chunks(fill);
+        pthread_mutex_destroy(&fill->mtx);
+        free(fill);
+    }
+}
+
+#ifdef FILL_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "http.h"
+
+static void fill_stream_test(void)
+{
+    static char body[7 * CACHE_CHUNK_SIZE + 100];
+    static char out[sizeof(body)];
+    struct fill *leader, *waiter;
+    struct fill_cursor cursor = { NULL, 0, 0 };
+    struct iovec iov[8];
+    FillState state;
+    int is_leader, i, n, len = 0;
+
+    for (i = 0; i < (int)sizeof(body); i++)
+        body[i] = i % 251;
+
+    leader = fill_join("http://a/x", 1, &is_leader);
+    assert(leader && is_leader);
+    waiter = fill_join("http://a/x", 1, &is_leader);
+    assert(waiter == leader && !is_leader);
+    assert(fill_add_waiter(waiter, -1, -1) == 0);
+
+    /* Nothing yet, the waiter has to wait */
+    assert(fill_read(waiter, &cursor, iov, 8, &state) == 0);
+    assert(state == FILL_ACTIVE);
+    fill_share(leader, 1);
+
+    /* Append in odd sizes, read in between */
+    for (i = 0; i < (int)sizeof(body); i += n)
+    {
+        n = sizeof(body) - i < 7000 ? sizeof(body) - i : 7000;
+        fill_append(leader, body + i, n);
+        while (fill_read(waiter, &cursor, iov, 1, &state) > 0)
+        {
+            memcpy(out + len, iov[0].iov_base, iov[0].iov_len);
+            len += iov[0].iov_len;
+            fill_consume(&cursor, iov[0].iov_len);
+        }
+    }
+    assert(len == sizeof(body));
+    assert(!memcmp(out, body, len));
+
+    /* Too large to cache, a new request starts its own fill */
+    assert(fill_copy(leader, out, MAX_OBJECT_SIZE) == -1);
+    fill_finish(leader, 1);
+    assert(fill_done(waiter));
+    fill_remove_waiter(waiter, -1);
+    fill_release(waiter);
+    fill_release(leader);
+}
+
+static void fill_abort_test(void)
+{
+    struct fill *leader, *waiter;
+    struct fill_cursor cursor = { NULL, 0, 0 };
+    struct iovec iov[8];
+    FillState state;
+    int is_leader;
+    char buf[16];
+
+    leader = fill_join("http://a/y", 2, &is_leader);
+    waiter = fill_join("http://a/y", 2, &is_leader);
+    fill_append(leader, "HTTP/1.0 200 OK", 15);
+    assert(fill_copy(leader, buf, sizeof(buf)) == 15);
+    fill_finish(leader, 0);
+    fill_release(leader);
+
+    /* Once finished the fill is gone from the table */
+    leader = fill_join("http://a/y", 2, &is_leader);
+    assert(leader != waiter && is_leader);
+    fill_finish(leader, 1);
+    fill_release(leader);
+
+    fill_read(waiter, &cursor, iov, 8, &state);
+    assert(state == FILL_ABORTED);
+    fill_release(waiter);
+}
+
+static void fill_private_test(void)
+{
+    const char *head = "HTTP/1.0 200 OK\r\nCache-Control: private\r\n\r\n";
+    struct fill *leader, *waiter, *other;
+    struct fill_cursor cursor = { NULL, 0, 0 };
+    struct iovec iov[8];
+    FillState state;
+    int is_leader;
+    char buf[64];
+
+    leader = fill_join("http://a/z", 3, &is_leader);
+    waiter = fill_join("http://a/z", 3, &is_leader);
+    assert(fill_add_waiter(waiter, -1, -1) == 0);
+
+    /* The head is in, but the waiter gets nothing until it is checked */
+    fill_append(leader, head, strlen(head));
+    assert(fill_held(leader));
+    assert(fill_read(waiter, &cursor, iov, 8, &state) == 0);
+    assert(state == FILL_ACTIVE);
+
+    /* A private response is for the client of the leader only */
+    fill_share(leader, http_shareable(head, strlen(head)));
+    assert(!fill_held(leader));
+    fill_append(leader, "body", 4);
+    assert(fill_read(waiter, &cursor, iov, 8, &state) == 0);
+    assert(state == FILL_PRIVATE && cursor.sent == 0);
+    assert(fill_add_waiter(leader, -1, -2) == -1);
+
+    /* Nobody joins it anymore, the leader still gets the whole response */
+    other = fill_join("http://a/z", 3, &is_leader);
+    assert(other != leader && is_leader);
+    fill_finish(other, 1);
+    fill_release(other);
+    assert(fill_copy(leader, buf, sizeof(buf)) == (int)strlen(head) + 4);
+    fill_finish(leader, 1);
+    fill_read(waiter, &cursor, iov, 8, &state);
+    assert(state == FILL_PRIVATE);
+    fill_remove_waiter(waiter, -1);
+    fill_release(waiter);
+    fill_release(leader);
+}
+
+int main(int argc, char* argv[])
+{
+    fill_stream_test();
+    fill_abort_test();
+    fill_private_test();
+    return 0;
+}
+#endif
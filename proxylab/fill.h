@@ -0,0 +1,52 @@
+/*************************************************************************
+	> File Name: fill.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: In-flight cache fills shared by concurrent misses
+ ************************************************************************/
+
+#ifndef _FILL_H
+#define _FILL_H
+
+#include <sys/uio.h>
+
+#include "cache.h"
+
+typedef enum _FillState {
+    FILL_ACTIVE,   /* The response is still being received */
+    FILL_DONE,     /* The whole response has been received */
+    FILL_ABORTED,  /* The origin fetch failed */
+    FILL_PRIVATE   /* The response is not shared, fetch it again */
+} FillState;
+
+struct fill;
+
+/*
+ * Position of a reader in the response of a fill.
+ */
+struct fill_cursor {
+    struct cache_chunk *chunk;
+    int offset;   /* Offset in chunk */
+    long sent;    /* Bytes consumed so far */
+};
+
+struct fill* fill_join(const char *url, unsigned int hash, int *leader);
+void         fill_append(struct fill *fill, const char *buf, int len);
+void         fill_finish(struct fill *fill, int complete);
+void         fill_share(struct fill *fill, int shared);
+int          fill_held(struct fill *fill);
+int          fill_add_waiter(struct fill *fill, int epfd, int fd);
+void         fill_remove_waiter(struct fill *fill, int fd);
+int          fill_read(struct fill *fill, struct fill_cursor *cursor,
+                       struct iovec *iov, int max, FillState *state);
+void         fill_consume(struct fill_cursor *cursor, long len);
+int          fill_wait(struct fill *fill, struct fill_cursor *cursor,
+                       int epfd, int fd);
+int          fill_done(struct fill *fill);
+long         fill_length(struct fill *fill);
+int          fill_copy(struct fill *fill, char *buf, int max);
+struct cache_chunk* fill_chunks(struct fill *fill);
+void         fill_attach_object(struct fill *fill, struct object *obj);
+void         fill_release(struct fill *fill);
+
+#endif
@@ -0,0 +1,328 @@
+/*************************************************************************
+	> File Name: gzip.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: gzip encoding of the cached responses.
+	>
+	> Text responses usually shrink to a third with gzip, so the cache
+	> can keep them compressed and hold more of them. The response is
+	> stored as it is sent to a client that accepts gzip: the body is
+	> compressed and the headers get Content-Encoding, the new
+	> Content-Length and Vary: Accept-Encoding. Other clients get it
+	> decoded again. The gzip header carries an extra field with the size
+	> of the identity body, it tells our encoding from the one of an
+	> origin, and survives the disk tier and the snapshots unchanged.
+ ************************************************************************/
+#include "gzip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "typedef.h"
+#include "http.h"
+
+/* Room left for the headers added once the body is compressed */
+#define GZIP_HEADERS_ROOM 128
+/* Extra field of the gzip header: "PX", its length, the identity size */
+#define GZIP_EXTRA_LEN 8
+/* Offset of the extra field, after the fixed header and XLEN */
+#define GZIP_EXTRA_OFFSET 12
+/* FLG bit of a gzip header with an extra field */
+#define GZIP_FEXTRA 0x04
+
+static const char *compressible_types[] = {
+    "text/",
+    "application/javascript",
+    "application/x-javascript",
+    "application/json",
+    "application/xml",
+    "application/xhtml+xml",
+    "image/svg+xml",
+    NULL
+};
+
+/* The headers gzip_encode() sets, dropped from the original response */
+static const char *encoded_headers[] = {
+    "Content-Encoding", "Content-Length", "Vary", NULL
+};
+
+static int header_named(const char *line, const char *end, const char *name)
+{
+    int n = strlen(name);
+
+    return end - line > n && line[n] == ':' && !strncasecmp(line, name, n);
+}
+
+/*
+ * copy_headers - Copy the status line and the headers of the response to
+ *                dst, but the ones named in drop and the blank line ending
+ *                them. dst may be NULL to count the bytes only. Return the
+ *                length, or -1 if size is too short.
+ */
+static int copy_headers(char *dst, int size, const char *src, int body,
+                        const char **drop)
+{
+    const char *line = src, *end = src + body - 2, *eol;
+    int n = 0, i, skip;
+
+    for (; line < end; line = eol)
+    {
+        eol = memchr(line, '\n', end - line);
+        eol = eol ? eol + 1 : end;
+        for (skip = 0, i = 0; line != src && drop[i] && !skip; i++)
+            skip = header_named(line, eol, drop[i]);
+        if (skip)
+            continue;
+        if (dst)
+        {
+            if (n + (eol - line) > size)
+                return -1;
+            memcpy(dst + n, line, eol - line);
+        }
+        n += eol - line;
+    }
+    return n;
+}
+
+/*
+ * gzip_compressible - Return 1 if the response is a complete text response
+ *                     worth compressing, that we are allowed to transform.
+ */
+int gzip_compressible(const char *response, int len)
+{
+    char value[HTTP_VALIDATOR_LEN];
+    int body = http_body_offset(response, len);
+    int i;
+
+    if (http_status(response, len) != 200 || body < 0 ||
+        len - body < GZIP_MIN_SIZE)
+        return 0;
+    if (http_header(response, len, "Content-Encoding", value, sizeof(value)) >= 0 ||
+        http_header(response, len, "Transfer-Encoding", value, sizeof(value)) >= 0 ||
+        http_header(response, len, "Vary", value, sizeof(value)) >= 0 ||
+        http_cache_control(response, len, "no-transform", NULL))
+        return 0;
+    /* A truncated body would be cached as complete */
+    if (http_header(response, len, "Content-Length", value, sizeof(value)) >= 0 &&
+        atol(value) != len - body)
+        return 0;
+
+    if (http_header(response, len, "Content-Type", value, sizeof(value)) < 0)
+        return 0;
+    for (i = 0; compressible_types[i]; i++)
+    {
+        if (!strncasecmp(value, compressible_types[i],
+                         strlen(compressible_types[i])))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * gzip_encode - Write the gzip encoded version of the response to out.
+ *               Return its length, or -1 if the response is not
+ *               compressible, does not shrink by an eighth, or size is too
+ *               short.
+ */
+int gzip_encode(const char *response, int len, char *out, int size)
+{
+    unsigned char extra[GZIP_EXTRA_LEN];
+    int body = http_body_offset(response, len);
+    int identity = len - body;
+    int head, start, n, ret;
+    gz_header gz;
+    z_stream zs;
+
+    return_val_if_fail(response && out, -1);
+    if (!gzip_compressible(response, len))
+        return -1;
+    if ((head = copy_headers(out, size, response, body, encoded_headers)) < 0 ||
+        (start = head + GZIP_HEADERS_ROOM) >= size)
+        return -1;
+
+    extra[0] = 'P';
+    extra[1] = 'X';
+    extra[2] = 4;
+    extra[3] = 0;
+    extra[4] = identity & 0xff;
+    extra[5] = (identity >> 8) & 0xff;
+    extra[6] = (identity >> 16) & 0xff;
+    extra[7] = (identity >> 24) & 0xff;
+    memset(&gz, 0, sizeof(gz));
+    gz.extra = extra;
+    gz.extra_len = sizeof(extra);
+    gz.os = 3;
+
+    /* The length header comes once the body is compressed, after the room */
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    deflateSetHeader(&zs, &gz);
+    zs.next_in = (Bytef*)response + body;
+    zs.avail_in = identity;
+    zs.next_out = (Bytef*)out + start;
+    zs.avail_out = size - start;
+    ret = deflate(&zs, Z_FINISH);
+    n = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END || n > identity - identity / 8)
+        return -1;
+
+    head += sprintf(out + head, "Content-Encoding: gzip\r\n"
+                    "Content-Length: %d\r\nVary: Accept-Encoding\r\n\r\n", n);
+    memmove(out + head, out + start, n);
+    return head + n;
+}
+
+/*
+ * identity_body - return the size of the body before gzip_encode(), or -1
+ *                 if the body at offset body is not one of ours.
+ */
+static long identity_body(const char *response, int len, int body)
+{
+    const unsigned char *gz = (const unsigned char*)response + body;
+
+    if (body < 0 || len - body < GZIP_EXTRA_OFFSET + GZIP_EXTRA_LEN)
+        return -1;
+    if (gz[0] != 0x1f || gz[1] != 0x8b || !(gz[3] & GZIP_FEXTRA) ||
+        gz[12] != 'P' || gz[13] != 'X' || gz[14] != 4 || gz[15] != 0)
+        return -1;
+    return gz[16] | gz[17] << 8 | gz[18] << 16 | (long)gz[19] << 24;
+}
+
+/*
+ * gzip_identity_size - return the length of the response once decoded by
+ *                      gzip_decode(), or -1 if it was not encoded by
+ *                      gzip_encode().
+ */
+long gzip_identity_size(const char *response, int len)
+{
+    int body = http_body_offset(response, len);
+    long identity = identity_body(response, len, body);
+
+    if (identity < 0)
+        return -1;
+    return copy_headers(NULL, 0, response, body, encoded_headers) +
+           snprintf(NULL, 0, "Content-Length: %ld\r\n\r\n", identity) +
+           identity;
+}
+
+/*
+ * gzip_decode - Write the response encoded by gzip_encode() to out as it
+ *               was before. Return its length, or -1 if it is not one of
+ *               ours, is corrupted, or size is too short.
+ */
+int gzip_decode(const char *response, int len, char *out, int size)
+{
+    int body = http_body_offset(response, len);
+    long identity = identity_body(response, len, body);
+    int head, ret;
+    z_stream zs;
+
+    return_val_if_fail(response && out, -1);
+    if (identity < 0 || gzip_identity_size(response, len) > size)
+        return -1;
+    head = copy_headers(out, size, response, body, encoded_headers);
+    head += sprintf(out + head, "Content-Length: %ld\r\n\r\n", identity);
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return -1;
+    zs.next_in = (Bytef*)response + body;
+    zs.avail_in = len - body;
+    zs.next_out = (Bytef*)out + head;
+    zs.avail_out = identity;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != identity)
+        return -1;
+    return head + identity;
+}
+
+/*
+ * gzip_accepted - Return 1 if the request accepts a gzip encoded response.
+ */
+int gzip_accepted(const char *request, int len)
+{
+    char value[HTTP_VALIDATOR_LEN];
+    char *token, *save, *q;
+
+    if (http_header(request, len, "Accept-Encoding", value, sizeof(value)) < 0)
+        return 0;
+    for (token = strtok_r(value, ",", &save); token;
+         token = strtok_r(NULL, ",", &save))
+    {
+        while (*token == ' ' || *token == '\t')
+            token++;
+        if ((q = strchr(token, ';')) != NULL)
+            *q++ = '\0';
+        token[strcspn(token, " \t")] = '\0';
+        if (strcasecmp(token, "gzip") && strcasecmp(token, "x-gzip") &&
+            strcmp(token, "*"))
+            continue;
+        /* gzip;q=0 refuses it */
+        while (q && (*q == ' ' || *q == '\t'))
+            q++;
+        return q == NULL || strncasecmp(q, "q=", 2) || atof(q + 2) > 0;
+    }
+    return 0;
+}
+
+#ifdef GZIP_TEST
+
+#include <assert.h>
+
+#define BODY_LEN 4000
+
+int main()
+{
+    char response[8192], encoded[8192], decoded[8192];
+    int head, len, n, m, i;
+
+    head = sprintf(response, "HTTP/1.0 200 OK\r\nServer: Tiny\r\n"
+                   "Content-length: %d\r\nContent-type: text/plain\r\n\r\n",
+                   BODY_LEN);
+    for (i = 0; i < BODY_LEN; i++)
+        response[head + i] = "the quick brown fox\n"[i % 20];
+    len = head + BODY_LEN;
+
+    assert(gzip_compressible(response, len));
+    assert(gzip_identity_size(response, len) == -1);
+    n = gzip_encode(response, len, encoded, sizeof(encoded));
+    assert(n > 0 && n < len / 4);
+    assert(http_status(encoded, n) == 200);
+    assert(strstr(encoded, "Content-Encoding: gzip\r\n") != NULL);
+    assert(strstr(encoded, "Vary: Accept-Encoding\r\n") != NULL);
+    assert(strstr(encoded, "Server: Tiny\r\n") != NULL);
+    /* Not encoded twice */
+    assert(!gzip_compressible(encoded, n));
+
+    /* Back to the same body, with the length of the identity */
+    m = gzip_decode(encoded, n, decoded, sizeof(decoded));
+    assert(m > 0 && m == gzip_identity_size(encoded, n));
+    assert(strstr(decoded, "Content-Encoding") == NULL);
+    assert(strstr(decoded, "Content-Length: 4000\r\n\r\n") != NULL);
+    assert(memcmp(decoded + m - BODY_LEN, response + head, BODY_LEN) == 0);
+    assert(gzip_decode(encoded, n, decoded, m - 1) == -1);
+    assert(gzip_decode(response, len, decoded, sizeof(decoded)) == -1);
+
+    /* Images, truncated bodies and small ones are left alone */
+    memcpy(strstr(response, "text/plain"), "image/png!", 10);
+    assert(!gzip_compressible(response, len));
+    memcpy(strstr(response, "image/png!"), "text/plain", 10);
+    assert(!gzip_compressible(response, len - 1));
+    assert(!gzip_compressible(response, head + 100));
+
+    assert(gzip_accepted("GET / HTTP/1.0\r\nAccept-Encoding: deflate, gzip\r\n\r\n", 49));
+    assert(!gzip_accepted("GET / HTTP/1.0\r\nAccept-Encoding: gzip;q=0\r\n\r\n", 44));
+    assert(!gzip_accepted("GET / HTTP/1.0\r\nAccept-Encoding: br\r\n\r\n", 39));
+    assert(!gzip_accepted("GET / HTTP/1.0\r\n\r\n", 18));
+
+    printf("gzip test passed\n");
+    return 0;
+}
+#endif
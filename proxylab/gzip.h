@@ -0,0 +1,22 @@
+/*************************************************************************
+	> File Name: gzip.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: gzip encoding of the cached responses
+ ************************************************************************/
+
+#ifndef _GZIP_H
+#define _GZIP_H
+
+/* Bodies smaller than this don't save a chunk */
+#define GZIP_MIN_SIZE 512
+/* Compression level, speed matters more than the last percents */
+#define GZIP_LEVEL 6
+
+int  gzip_compressible(const char *response, int len);
+int  gzip_encode(const char *response, int len, char *out, int size);
+long gzip_identity_size(const char *response, int len);
+int  gzip_decode(const char *response, int len, char *out, int size);
+int  gzip_accepted(const char *request, int len);
+
+#endif
@@ -0,0 +1,762 @@
+/*************************************************************************
+	> File Name: http.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: HTTP response header parsing for the cache freshness.
+	>
+	> Responses are stored in the cache as they came from the origin, so
+	> the headers are parsed in place: a buffer holds the status line and
+	> the headers, maybe followed by (part of) the body. The freshness
+	> lifetime is computed as a shared cache would (RFC 7234): s-maxage,
+	> then max-age, then Expires, then a heuristic on Last-Modified.
+ ************************************************************************/
+#define _GNU_SOURCE
+#include "http.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+#include "typedef.h"
+
+#define CACHE_CONTROL_LEN 512
+
+/*
+ * http_body_offset - return the offset of the body of the response in buf,
+ *                    after the blank line ending the headers, or -1 if the
+ *                    headers are not complete.
+ */
+int http_body_offset(const char *buf, int len)
+{
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+
+    return end ? end - buf + 4 : -1;
+}
+
+/*
+ * headers_length - return the length of the status line and headers in buf,
+ *                  the whole buffer if the end of the headers is not in it.
+ */
+static int headers_length(const char *buf, int len)
+{
+    int body = http_body_offset(buf, len);
+
+    return body < 0 ? len : body - 2;
+}
+
+static const char *next_line(const char *line, const char *end)
+{
+    const char *eol = memchr(line, '\n', end - line);
+    return eol ? eol + 1 : end;
+}
+
+/*
+ * http_status - return the status code of the response in buf, or -1 if it
+ *               does not start with an HTTP/1.x status line.
+ */
+int http_status(const char *buf, int len)
+{
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) || buf[8] != ' ')
+        return -1;
+    return atoi(buf + 9);
+}
+
+/*
+ * http_header_at - return the value of the header name of the message in
+ *                  buf, in place and without the surrounding spaces, and
+ *                  set n to its length. Return NULL if there is no such
+ *                  header. The search stops at the blank line ending the
+ *                  headers, the body is never read.
+ */
+const char *http_header_at(const char *buf, int len, const char *name, int *n)
+{
+    const char *end = buf + len;
+    const char *line, *p, *q;
+    int size = strlen(name);
+
+    /* The first line is the status line */
+    for (line = next_line(buf, end); line < end && *line != '\r' && *line != '\n';
+         line = next_line(line, end))
+    {
+        if (end - line <= size || line[size] != ':' ||
+            strncasecmp(line, name, size))
+            continue;
+
+        for (p = line + size + 1; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+        for (q = p; q < end && *q != '\r' && *q != '\n'; q++)
+            ;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+            q--;
+        *n = q - p;
+        return p;
+    }
+    return NULL;
+}
+
+/*
+ * http_header - Copy the value of the header name of the message in buf
+ *               to value, without the surrounding spaces. Return the length
+ *               of the value, or -1 if there is no such header.
+ */
+int http_header(const char *buf, int len, const char *name,
+                char *value, int size)
+{
+    const char *p;
+    int n;
+
+    return_val_if_fail(size > 0, -1);
+
+    if ((p = http_header_at(buf, len, name, &n)) == NULL)
+        return -1;
+    n = n < size ? n : size - 1;
+    memcpy(value, p, n);
+    value[n] = '\0';
+    return n;
+}
+
+/*
+ * http_cache_control - Return 1 if the Cache-Control header of the response
+ *                      has directive. If it has an argument and value is
+ *                      not NULL, value is set to its number.
+ */
+int http_cache_control(const char *buf, int len, const char *directive,
+                       long *value)
+{
+    char header[CACHE_CONTROL_LEN];
+    char *token, *save, *arg;
+
+    if (http_header(buf, len, "Cache-Control", header, sizeof(header)) < 0)
+        return 0;
+    for (token = strtok_r(header, ",", &save); token;
+         token = strtok_r(NULL, ",", &save))
+    {
+        while (*token == ' ' || *token == '\t')
+            token++;
+        if ((arg = strchr(token, '=')) != NULL)
+            *arg++ = '\0';
+        token[strcspn(token, " \t")] = '\0';
+        if (strcasecmp(token, directive))
+            continue;
+        if (value && arg)
+            *value = atol(arg + (*arg == '"'));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * http_date - return the time of an HTTP-date, or -1 if it is malformed.
+ */
+time_t http_date(const char *value)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return -1;
+    return timegm(&tm);
+}
+
+/*
+ * http_negative - Return 1 if an error of the status is cached, briefly:
+ *                 the ones repeating requests would most likely get again.
+ */
+int http_negative(int status)
+{
+    return status == 404 || status == 410 || status == 500 ||
+           status == 502 || status == 503 || status == 504;
+}
+
+/*
+ * http_storable - Return 1 if a shared cache may store the response.
+ */
+int http_storable(const char *buf, int len)
+{
+    int status = http_status(buf, len);
+
+    return (status == 200 || http_negative(status)) &&
+           !http_cache_control(buf, len, "no-store", NULL) &&
+           !http_cache_control(buf, len, "private", NULL);
+}
+
+/*
+ * http_shareable - Return 1 if the response fetched for one client may be
+ *                  sent to another: it is storable, it does not vary with
+ *                  the request and it sets no cookie.
+ */
+int http_shareable(const char *buf, int len)
+{
+    int n;
+
+    return http_storable(buf, len) &&
+           http_header_at(buf, len, "Vary", &n) == NULL &&
+           http_header_at(buf, len, "Set-Cookie", &n) == NULL;
+}
+
+/*
+ * http_credentials - Return 1 if the request carries credentials, so its
+ *                    response is for that client only.
+ */
+int http_credentials(const char *buf, int len)
+{
+    int n;
+
+    return http_header_at(buf, len, "Authorization", &n) != NULL ||
+           http_header_at(buf, len, "Cookie", &n) != NULL;
+}
+
+/*
+ * response_date - return the Date of the response, now if it has none or it
+ *                 is in the future, and set age to its Age.
+ */
+static time_t response_date(const char *buf, int len, time_t now, long *age)
+{
+    char value[HTTP_VALIDATOR_LEN];
+    time_t t;
+
+    *age = 0;
+    if (http_header(buf, len, "Age", value, sizeof(value)) >= 0)
+        *age = atol(value);
+    if (http_header(buf, len, "Date", value, sizeof(value)) >= 0 &&
+        (t = http_date(value)) != -1 && t < now)
+        return t;
+    return now;
+}
+
+/*
+ * http_generated - return the time the origin generated the response in
+ *                  buf, if it was received at now. The Age of a cached
+ *                  copy counts from there.
+ */
+time_t http_generated(const char *buf, int len, time_t now)
+{
+    long age;
+    time_t date = response_date(buf, len, now, &age);
+
+    return date - age;
+}
+
+/*
+ * http_expires - return the time the response in buf becomes stale, if it
+ *                was received at now.
+ */
+time_t http_expires(const char *buf, int len, time_t now)
+{
+    char value[HTTP_VALIDATOR_LEN];
+    time_t date, t;
+    long age, lifetime;
+
+    date = response_date(buf, len, now, &age);
+
+    if (http_cache_control(buf, len, "no-cache", NULL))
+        lifetime = 0;
+    else if (http_cache_control(buf, len, "s-maxage", &lifetime) ||
+             http_cache_control(buf, len, "max-age", &lifetime))
+        ;
+    else if (http_header(buf, len, "Expires", value, sizeof(value)) >= 0)
+        /* A malformed Expires means already expired */
+        lifetime = (t = http_date(value)) != -1 ? t - date : 0;
+    else if (http_header(buf, len, "Last-Modified", value, sizeof(value)) >= 0)
+    {
+        t = http_date(value);
+        lifetime = t != -1 && t < date ? (date - t) / 10 : 0;
+        if (lifetime > HTTP_HEURISTIC_TTL)
+            lifetime = HTTP_HEURISTIC_TTL;
+    }
+    else
+        lifetime = HTTP_DEFAULT_TTL;
+    if (http_negative(http_status(buf, len)) && lifetime > HTTP_NEGATIVE_TTL)
+        lifetime = HTTP_NEGATIVE_TTL;
+
+    /* The response was generated age seconds before it was dated */
+    return date - age + lifetime;
+}
+
+/*
+ * http_stale_grace - return how long the response may be served stale once
+ *                    expired, while it is revalidated in the background.
+ */
+long http_stale_grace(const char *buf, int len)
+{
+    long grace = HTTP_STALE_GRACE;
+
+    /* An error is fetched again once expired, never served stale */
+    if (http_negative(http_status(buf, len)) ||
+        http_cache_control(buf, len, "must-revalidate", NULL) ||
+        http_cache_control(buf, len, "proxy-revalidate", NULL) ||
+        http_cache_control(buf, len, "no-cache", NULL))
+        return 0;
+    http_cache_control(buf, len, "stale-while-revalidate", &grace);
+    return grace;
+}
+
+/*
+ * hop_by_hop - Return 1 if the header line is only meant for one connection:
+ *              a standard hop-by-hop header, or one listed in the Connection
+ *              header value connection. Transfer-Encoding is kept, it frames
+ *              the stored body.
+ */
+static int hop_by_hop(const char *line, const char *end, const char *connection)
+{
+    static const char *names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", NULL
+    };
+    const char *colon = memchr(line, ':', end - line);
+    const char *p;
+    int i, n;
+
+    if (colon == NULL)
+        return 0;
+    n = colon - line;
+    for (i = 0; names[i]; i++)
+    {
+        if ((int)strlen(names[i]) == n && !strncasecmp(line, names[i], n))
+            return 1;
+    }
+    for (p = connection; *p; p += strcspn(p, ","))
+    {
+        p += strspn(p, ", \t");
+        if (!strncasecmp(p, line, n) && strchr(", \t", p[n]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * http_strip_hop - Copy the response in src to dst without its hop-by-hop
+ *                  headers, the proxy sends its own. dst may be NULL to
+ *                  count the bytes only. Anything else than a response with
+ *                  complete headers is copied as is. Return the length.
+ */
+int http_strip_hop(const char *src, int len, char *dst)
+{
+    char connection[HTTP_VALIDATOR_LEN] = "";
+    int body = headers_length(src, len);
+    const char *line, *eol, *end = src + body;
+    int n = 0;
+
+    if (http_status(src, len) < 0 || body >= len)
+    {
+        if (dst)
+            memcpy(dst, src, len);
+        return len;
+    }
+
+    http_header(src, len, "Connection", connection, sizeof(connection));
+    for (line = src; line < end; line = eol)
+    {
+        eol = next_line(line, end);
+        if (line != src && hop_by_hop(line, eol, connection))
+            continue;
+        if (dst)
+            memcpy(dst + n, line, eol - line);
+        n += eol - line;
+    }
+    /* The blank line and the body */
+    if (dst)
+        memcpy(dst + n, end, len - body);
+    return n + len - body;
+}
+
+/*
+ * http_patch_point - return the offset in the response in buf where the
+ *                    proxy inserts its own headers, and set replace to the
+ *                    length of the stored header they replace there: the
+ *                    Age header if any, else the blank line ending the
+ *                    headers and 0. Return -1 if the headers are not
+ *                    complete.
+ */
+int http_patch_point(const char *buf, int len, int *replace)
+{
+    int body = headers_length(buf, len);
+    const char *line, *eol, *end = buf + body;
+
+    if (body >= len)
+        return -1;
+    *replace = 0;
+    for (line = next_line(buf, end); line < end; line = eol)
+    {
+        eol = next_line(line, end);
+        if (!strncasecmp(line, "Age:", 4))
+        {
+            *replace = eol - line;
+            return line - buf;
+        }
+    }
+    return body;
+}
+
+/*
+ * append - Append len bytes of src to out, of length *n. Return 0 if success,
+ *          or -1 if it does not fit in size with a terminator.
+ */
+static int append(char *out, int size, int *n, const char *src, int len)
+{
+    if (*n + len >= size)
+        return -1;
+    memcpy(out + *n, src, len);
+    *n += len;
+    out[*n] = '\0';
+    return 0;
+}
+
+/*
+ * append_lower - Append src in lower case.
+ */
+static int append_lower(char *out, int size, int *n, const char *src, int len)
+{
+    int i;
+
+    if (append(out, size, n, src, len) < 0)
+        return -1;
+    for (i = *n - len; i < *n; i++)
+        out[i] = tolower((unsigned char)out[i]);
+    return 0;
+}
+
+/*
+ * append_escaped - Append src with its percent escapes in upper case.
+ */
+static int append_escaped(char *out, int size, int *n, const char *src, int len)
+{
+    int i;
+
+    if (append(out, size, n, src, len) < 0)
+        return -1;
+    for (i = *n - len; i + 2 < *n; i++)
+    {
+        if (out[i] == '%' && isxdigit((unsigned char)out[i + 1]) &&
+            isxdigit((unsigned char)out[i + 2]))
+        {
+            out[i + 1] = toupper((unsigned char)out[i + 1]);
+            out[i + 2] = toupper((unsigned char)out[i + 2]);
+        }
+    }
+    return 0;
+}
+
+struct query_param {
+    const char *p;
+    int len;
+    int name;   /* Length of the name, before any '=' */
+    int pos;    /* Position in the query */
+};
+
+/*
+ * compare_params - Order parameters by name. The values of a repeated name
+ *                  stay in their order, the origin may depend on it.
+ */
+static int compare_params(const void *a, const void *b)
+{
+    const struct query_param *x = a, *y = b;
+    int n = x->name < y->name ? x->name : y->name;
+    int c = memcmp(x->p, y->p, n);
+
+    if (c == 0)
+        c = x->name - y->name;
+    return c ? c : x->pos - y->pos;
+}
+
+/*
+ * append_query - Append the query q of len bytes, its parameters sorted by
+ *                name and the empty ones dropped. A query of too many parameters is
+ *                kept in order.
+ */
+static int append_query(char *out, int size, int *n, const char *q, int len)
+{
+    struct query_param params[HTTP_QUERY_PARAMS];
+    const char *end = q + len, *amp;
+    int i, count = 0, sort = 1;
+
+    for (; q < end; q = amp + 1)
+    {
+        if ((amp = memchr(q, '&', end - q)) == NULL)
+            amp = end;
+        if (amp == q)
+            continue;
+        if (count == HTTP_QUERY_PARAMS)
+        {
+            sort = 0;
+            break;
+        }
+        params[count].p = q;
+        params[count].len = amp - q;
+        params[count].name = strcspn(q, "=&");
+        if (params[count].name > amp - q)
+            params[count].name = amp - q;
+        params[count].pos = count;
+        count++;
+    }
+    if (!sort)
+        return append(out, size, n, "?", 1) < 0 ? -1 :
+               append_escaped(out, size, n, params[0].p, end - params[0].p);
+
+    qsort(params, count, sizeof(params[0]), compare_params);
+    for (i = 0; i < count; i++)
+    {
+        if (append(out, size, n, i ? "&" : "?", 1) < 0 ||
+            append_escaped(out, size, n, params[i].p, params[i].len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * http_canonical_url - Write the cache key of url to out, so equivalent urls
+ *                      share it: the scheme and the host in lower case,
+ *                      without the default port and the fragment, the
+ *                      query parameters sorted, the percent escapes in
+ *                      upper case. Return its length, or -1 if it does not
+ *                      fit in size.
+ */
+int http_canonical_url(const char *url, char *out, int size)
+{
+    const char *host, *p, *q, *end = url + strlen(url);
+    int n = 0;
+
+    if ((host = strstr(url, "://")) == NULL)
+        return append(out, size, &n, url, end - url) < 0 ? -1 : n;
+    host += 3;
+    if ((p = strchr(url, '#')) != NULL)
+        end = p;
+
+    if (append_lower(out, size, &n, url, host - url) < 0)
+        return -1;
+    p = host + strcspn(host, ":/?#");
+    if (p > end)
+        p = end;
+    if (append_lower(out, size, &n, host, p - host) < 0)
+        return -1;
+    if (p < end && *p == ':')
+    {
+        q = p + 1 + strcspn(p + 1, "/?#");
+        if (q > end)
+            q = end;
+        if (!(q - p == 1 || (q - p == 3 && !strncmp(p, ":80", 3) &&
+                             !strncasecmp(url, "http://", 7))) &&
+            append(out, size, &n, p, q - p) < 0)
+            return -1;
+        p = q;
+    }
+
+    /* The path, at least / */
+    q = p + strcspn(p, "?");
+    if (q > end)
+        q = end;
+    if (q == p ? append(out, size, &n, "/", 1) < 0 :
+                 append_escaped(out, size, &n, p, q - p) < 0)
+        return -1;
+    if (q < end && append_query(out, size, &n, q + 1, end - q - 1) < 0)
+        return -1;
+    return n;
+}
+
+/*
+ * negotiation_header - Return 1 if the values of the request header name are
+ *                      lists of tokens compared without case.
+ */
+static int negotiation_header(const char *name)
+{
+    return !strcasecmp(name, "Accept") ||
+           !strcasecmp(name, "Accept-Encoding") ||
+           !strcasecmp(name, "Accept-Language");
+}
+
+/*
+ * http_variant_key - Append to the key in out, of length n, the secondary
+ *                    key of request for a response with the Vary header
+ *                    vary: the values of the request headers it names,
+ *                    without their surrounding spaces. The Accept headers
+ *                    are in lower case without spaces, others are kept as
+ *                    sent. Return the new length, or -1 if the response
+ *                    varies on everything or the key does not fit in size.
+ */
+int http_variant_key(const char *vary, const char *request, int len,
+                     char *out, int n, int size)
+{
+    char name[HTTP_VALIDATOR_LEN], value[HTTP_VALIDATOR_LEN];
+    const char *p = vary;
+    int i, m;
+
+    while (*p)
+    {
+        p += strspn(p, ", \t");
+        m = strcspn(p, ", \t");
+        if (m == 0)
+            break;
+        if (m == 1 && *p == '*')
+            return -1;
+        if (m >= (int)sizeof(name))
+            m = sizeof(name) - 1;
+        memcpy(name, p, m);
+        name[m] = '\0';
+        p += m;
+
+        if (append(out, size, &n, "\n", 1) < 0 ||
+            append_lower(out, size, &n, name, m) < 0 ||
+            append(out, size, &n, ":", 1) < 0)
+            return -1;
+        if ((m = http_header(request, len, name, value, sizeof(value))) < 0)
+            continue;
+        if (!negotiation_header(name))
+        {
+            if (append(out, size, &n, value, m) < 0)
+                return -1;
+            continue;
+        }
+        for (i = 0; value[i]; i++)
+        {
+            if (value[i] != ' ' && value[i] != '\t' &&
+                append_lower(out, size, &n, value + i, 1) < 0)
+                return -1;
+        }
+    }
+    return n;
+}
+
+#ifdef HTTP_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+#define RESPONSE(headers) "HTTP/1.0 200 OK\r\n" headers "\r\nbody\r\n\r\n"
+
+static time_t expires_of(const char *response, time_t now)
+{
+    return http_expires(response, strlen(response), now);
+}
+
+int main()
+{
+    const char *r;
+    char value[HTTP_VALIDATOR_LEN], stripped[256];
+    int n, replace;
+    long arg = 0;
+    /* Sun, 06 Nov 1994 08:49:37 GMT */
+    time_t date = 784111777;
+
+    r = RESPONSE("Content-Type: text/html\r\nETag:  \"abc\" \r\n");
+    assert(http_status(r, strlen(r)) == 200);
+    assert(http_header(r, strlen(r), "etag", value, sizeof(value)) == 5);
+    assert(strcmp(value, "\"abc\"") == 0);
+    assert(http_header(r, strlen(r), "Content", value, sizeof(value)) == -1);
+    /* Only the headers are searched */
+    assert(http_header(r, strlen(r), "body", value, sizeof(value)) == -1);
+    assert(http_body_offset(r, strlen(r)) == (int)strlen(r) - 8);
+    assert(http_header("HTTP/1.0 200 OK\r\n\r\nETag: x\r\n", 28, "ETag",
+                       value, sizeof(value)) == -1);
+    assert(http_body_offset("HTTP/1.0 200 OK\r\nETag: x", 24) == -1);
+    assert(http_status("HTTP/1.1 304 Not Modified\r\n\r\n", 29) == 304);
+    assert(http_status("garbage", 7) == -1);
+
+    r = RESPONSE("Cache-Control: public, max-age=60, s-maxage=\"120\"\r\n");
+    assert(http_cache_control(r, strlen(r), "max-age", &arg) && arg == 60);
+    assert(http_cache_control(r, strlen(r), "s-maxage", &arg) && arg == 120);
+    assert(!http_cache_control(r, strlen(r), "max", NULL));
+    assert(http_storable(r, strlen(r)));
+    assert(expires_of(r, 1000) == 1120);
+
+    r = RESPONSE("Cache-Control: private\r\n");
+    assert(!http_storable(r, strlen(r)));
+    assert(!http_shareable(r, strlen(r)));
+    r = "HTTP/1.0 206 Partial Content\r\n\r\n";
+    assert(!http_storable(r, strlen(r)));
+
+    /* Stored per variant or with a cookie, but sent to one client only */
+    r = RESPONSE("Vary: Accept-Encoding\r\n");
+    assert(http_storable(r, strlen(r)) && !http_shareable(r, strlen(r)));
+    r = RESPONSE("Set-Cookie: id=1\r\n");
+    assert(!http_shareable(r, strlen(r)));
+    r = RESPONSE("Cache-Control: max-age=60\r\n");
+    assert(http_shareable(r, strlen(r)));
+    r = "GET / HTTP/1.1\r\nHost: a\r\nCookie: id=1\r\n\r\n";
+    assert(http_credentials(r, strlen(r)));
+    r = "GET / HTTP/1.1\r\nHost: a\r\nX-Cookie: 1\r\n\r\n";
+    assert(!http_credentials(r, strlen(r)));
+
+    /* Errors are cached for a short time only */
+    r = "HTTP/1.0 404 Not Found\r\nCache-Control: max-age=3600\r\n\r\n";
+    assert(http_storable(r, strlen(r)));
+    assert(expires_of(r, date) == date + HTTP_NEGATIVE_TTL);
+    assert(http_stale_grace(r, strlen(r)) == 0);
+    r = "HTTP/1.0 503 Service Unavailable\r\nCache-Control: max-age=2\r\n\r\n";
+    assert(expires_of(r, date) == date + 2);
+    r = "HTTP/1.0 403 Forbidden\r\n\r\n";
+    assert(!http_storable(r, strlen(r)));
+
+    /* Date and Age move the base of the lifetime back */
+    r = RESPONSE("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\nAge: 10\r\n"
+                 "Cache-Control: max-age=100\r\n");
+    assert(http_date("Sun, 06 Nov 1994 08:49:37 GMT") == date);
+    assert(expires_of(r, date + 50) == date + 90);
+
+    r = RESPONSE("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                 "Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n");
+    assert(expires_of(r, date) == date + 3600);
+    r = RESPONSE("Expires: 0\r\n");
+    assert(expires_of(r, date) == date);
+    r = RESPONSE("Cache-Control: no-cache, max-age=100\r\n");
+    assert(expires_of(r, date) == date);
+
+    r = RESPONSE("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                 "Last-Modified: Sun, 06 Nov 1994 07:49:37 GMT\r\n");
+    assert(expires_of(r, date) == date + 360);
+    r = RESPONSE("");
+    assert(expires_of(r, date) == date + HTTP_DEFAULT_TTL);
+
+    assert(http_stale_grace(r, strlen(r)) == HTTP_STALE_GRACE);
+    r = RESPONSE("Cache-Control: max-age=10, stale-while-revalidate=30\r\n");
+    assert(http_stale_grace(r, strlen(r)) == 30);
+    r = RESPONSE("Cache-Control: max-age=10, must-revalidate\r\n");
+    assert(http_stale_grace(r, strlen(r)) == 0);
+
+    r = "HTTP/1.1 200 OK\r\nConnection: close, X-Hop\r\nX-Hop: 1\r\n"
+        "Keep-Alive: timeout=5\r\nAge: 30\r\nX-Hopper: 2\r\n\r\nbody";
+    n = http_strip_hop(r, strlen(r), NULL);
+    assert(n == http_strip_hop(r, strlen(r), stripped));
+    stripped[n] = '\0';
+    assert(strcmp(stripped, "HTTP/1.1 200 OK\r\nAge: 30\r\nX-Hopper: 2\r\n\r\nbody") == 0);
+    assert(http_patch_point(stripped, n, &replace) == 17 && replace == 9);
+    r = "HTTP/1.1 200 OK\r\nX-Hopper: 2\r\n\r\nbody";
+    assert(http_patch_point(r, strlen(r), &replace) == 30 && replace == 0);
+    assert(http_patch_point(stripped, n - 6, &replace) == -1);
+    assert(http_strip_hop("garbage", 7, NULL) == 7);
+    /* Generated 30 seconds before it was dated */
+    assert(http_generated(stripped, n, date) == date - 30);
+
+    /* Equivalent urls share their key */
+    assert(http_canonical_url("HTTP://Example.COM:80/a%2fb?y=2&&x=1#frag",
+                              value, sizeof(value)) > 0);
+    assert(strcmp(value, "http://example.com/a%2Fb?x=1&y=2") == 0);
+    http_canonical_url("http://example.com", value, sizeof(value));
+    assert(strcmp(value, "http://example.com/") == 0);
+    http_canonical_url("http://example.com:8080?", value, sizeof(value));
+    assert(strcmp(value, "http://example.com:8080/") == 0);
+    assert(http_canonical_url("http://example.com/long", value, 10) == -1);
+    /* Repeated parameters keep their order */
+    http_canonical_url("http://example.com/?a=2&a=1", value, sizeof(value));
+    http_canonical_url("http://example.com/?a=1&a=2", stripped, sizeof(stripped));
+    assert(strcmp(value, stripped) != 0);
+    http_canonical_url("http://example.com/?b=1&a=2&ab&a=1", value, sizeof(value));
+    assert(strcmp(value, "http://example.com/?a=2&a=1&ab&b=1") == 0);
+
+    /* Secondary keys of the Vary headers */
+    r = "GET / HTTP/1.1\r\nAccept-Encoding: gzip, Deflate\r\n\r\n";
+    strcpy(value, "k");
+    n = http_variant_key("Accept-Encoding, Accept-Language", r, strlen(r),
+                         value, 1, sizeof(value));
+    assert(n > 0 && strcmp(value, "k\naccept-encoding:gzip,deflate\naccept-language:") == 0);
+    /* Other values are compared as sent */
+    r = "GET / HTTP/1.1\r\nX-Tenant:  Acme Corp \r\nAccept: Text/HTML\r\n\r\n";
+    strcpy(value, "k");
+    n = http_variant_key("x-tenant,accept", r, strlen(r), value, 1,
+                         sizeof(value));
+    assert(n > 0 && strcmp(value, "k\nx-tenant:Acme Corp\naccept:text/html") == 0);
+    assert(http_variant_key("*", r, strlen(r), value, 1, sizeof(value)) == -1);
+
+    printf("http test passed\n");
+    return 0;
+}
+#endif
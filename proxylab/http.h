@@ -0,0 +1,46 @@
+/*************************************************************************
+	> File Name: http.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: HTTP response header parsing for the cache freshness
+ ************************************************************************/
+
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#include <time.h>
+
+/* Lifetime of a response without any freshness information */
+#define HTTP_DEFAULT_TTL 300
+/* Cap of the lifetime guessed from Last-Modified */
+#define HTTP_HEURISTIC_TTL (24 * 3600)
+/* Stale window of a response without stale-while-revalidate */
+#define HTTP_STALE_GRACE 60
+/* Cap of the lifetime of a cached error, the origin may recover soon */
+#define HTTP_NEGATIVE_TTL 10
+#define HTTP_VALIDATOR_LEN 256
+/* Query parameters sorted in a cache key, more are kept in order */
+#define HTTP_QUERY_PARAMS 64
+
+int    http_status(const char *buf, int len);
+int    http_body_offset(const char *buf, int len);
+const char *http_header_at(const char *buf, int len, const char *name, int *n);
+int    http_header(const char *buf, int len, const char *name,
+                   char *value, int size);
+int    http_cache_control(const char *buf, int len, const char *directive,
+                          long *value);
+time_t http_date(const char *value);
+int    http_negative(int status);
+int    http_storable(const char *buf, int len);
+int    http_shareable(const char *buf, int len);
+int    http_credentials(const char *buf, int len);
+time_t http_generated(const char *buf, int len, time_t now);
+time_t http_expires(const char *buf, int len, time_t now);
+long   http_stale_grace(const char *buf, int len);
+int    http_strip_hop(const char *src, int len, char *dst);
+int    http_patch_point(const char *buf, int len, int *replace);
+int    http_canonical_url(const char *url, char *out, int size);
+int    http_variant_key(const char *vary, const char *request, int len,
+                        char *out, int n, int size);
+
+#endif
@@ -0,0 +1,290 @@
+/*************************************************************************
+	> File Name: policy.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Eviction policy registry, shared queues and the LRU policy
+ ************************************************************************/
+#include "policy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "typedef.h"
+
+static const EvictionPolicy *policies[] = {
+    &lru_policy,
+    &arc_policy,
+    &s3fifo_policy,
+    &gdsf_policy,
+    NULL
+};
+
+/*
+ * find_policy - return the policy called name, or NULL if there is none.
+ */
+const EvictionPolicy* find_policy(const char *name)
+{
+    int i;
+
+    for (i = 0; policies[i]; i++)
+    {
+        if (!strcasecmp(policies[i]->name, name))
+            return policies[i];
+    }
+
+    return NULL;
+}
+
+void policy_list_init(struct policy_list *list)
+{
+    list->first = list->last = NULL;
+    list->bytes = 0;
+    list->count = 0;
+}
+
+void policy_list_push_front(struct policy_list *list, struct policy_node *node)
+{
+    node->prev = NULL;
+    node->next = list->first;
+    if (list->first)
+        list->first->prev = node;
+    else
+        list->last = node;
+    list->first = node;
+    list->bytes += node->size;
+    list->count++;
+}
+
+void policy_list_remove(struct policy_list *list, struct policy_node *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        list->first = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        list->last = node->prev;
+    node->prev = node->next = NULL;
+    list->bytes -= node->size;
+    list->count--;
+}
+
+/*
+ * Ghost list
+ */
+#define GHOST_BUCKETS 1024
+
+struct ghost {
+    unsigned int hash;
+    int size;
+    struct ghost *prev;   /* Towards the newer ghosts */
+    struct ghost *next;   /* Towards the older ghosts */
+    struct ghost *hnext;
+};
+
+struct _GhostList
+{
+    struct ghost *first;  /* Newest ghost */
+    struct ghost *last;   /* Oldest ghost, dropped first */
+    struct ghost **buckets;
+    unsigned int nbuckets;
+    int count;
+    long bytes;
+    long max_bytes;
+};
+
+GhostList* ghost_create(long max_bytes)
+{
+    GhostList *thiz = calloc(1, sizeof(GhostList));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    thiz->nbuckets = GHOST_BUCKETS;
+    thiz->buckets = calloc(thiz->nbuckets, sizeof(struct ghost*));
+    if (thiz->buckets == NULL)
+    {
+        free(thiz);
+        return NULL;
+    }
+    thiz->max_bytes = max_bytes;
+
+    return thiz;
+}
+
+static struct ghost **ghost_slot(GhostList *thiz, unsigned int hash)
+{
+    struct ghost **pp = &thiz->buckets[hash & (thiz->nbuckets - 1)];
+
+    while (*pp && (*pp)->hash != hash)
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+static void ghost_unlink(GhostList *thiz, struct ghost **pp)
+{
+    struct ghost *g = *pp;
+
+    *pp = g->hnext;
+    if (g->prev)
+        g->prev->next = g->next;
+    else
+        thiz->first = g->next;
+    if (g->next)
+        g->next->prev = g->prev;
+    else
+        thiz->last = g->prev;
+    thiz->bytes -= g->size;
+    thiz->count--;
+    free(g);
+}
+
+static void ghost_trim(GhostList *thiz)
+{
+    while (thiz->last && thiz->bytes > thiz->max_bytes)
+        ghost_unlink(thiz, ghost_slot(thiz, thiz->last->hash));
+}
+
+static void ghost_grow(GhostList *thiz)
+{
+    unsigned int i, n = thiz->nbuckets * 2;
+    struct ghost **buckets, *g, *next;
+
+    if ((buckets = calloc(n, sizeof(struct ghost*))) == NULL)
+        return;
+    for (i = 0; i < thiz->nbuckets; i++)
+    {
+        for (g = thiz->buckets[i]; g; g = next)
+        {
+            next = g->hnext;
+            g->hnext = buckets[g->hash & (n - 1)];
+            buckets[g->hash & (n - 1)] = g;
+        }
+    }
+    free(thiz->buckets);
+    thiz->buckets = buckets;
+    thiz->nbuckets = n;
+}
+
+/*
+ * ghost_remove - Forget the ghost of hash. Return 1 if it was there.
+ */
+int ghost_remove(GhostList *thiz, unsigned int hash)
+{
+    struct ghost **pp;
+
+    return_val_if_fail(thiz != NULL, 0);
+
+    pp = ghost_slot(thiz, hash);
+    if (*pp == NULL)
+        return 0;
+    ghost_unlink(thiz, pp);
+    return 1;
+}
+
+void ghost_push(GhostList *thiz, unsigned int hash, int size)
+{
+    struct ghost *g;
+
+    return_if_fail(thiz != NULL);
+
+    ghost_remove(thiz, hash);
+    if ((g = malloc(sizeof(struct ghost))) == NULL)
+        return;
+    g->hash = hash;
+    g->size = size;
+    g->prev = NULL;
+    g->next = thiz->first;
+    if (thiz->first)
+        thiz->first->prev = g;
+    else
+        thiz->last = g;
+    thiz->first = g;
+    g->hnext = thiz->buckets[hash & (thiz->nbuckets - 1)];
+    thiz->buckets[hash & (thiz->nbuckets - 1)] = g;
+    thiz->bytes += size;
+    thiz->count++;
+    if ((unsigned int)thiz->count > thiz->nbuckets)
+        ghost_grow(thiz);
+
+    ghost_trim(thiz);
+}
+
+void ghost_set_limit(GhostList *thiz, long max_bytes)
+{
+    return_if_fail(thiz != NULL);
+
+    thiz->max_bytes = max_bytes < 0 ? 0 : max_bytes;
+    ghost_trim(thiz);
+}
+
+long ghost_bytes(GhostList *thiz)
+{
+    return_val_if_fail(thiz != NULL, 0);
+
+    return thiz->bytes;
+}
+
+void ghost_destroy(GhostList *thiz)
+{
+    if (thiz != NULL)
+    {
+        ghost_set_limit(thiz, 0);
+        free(thiz->buckets);
+        free(thiz);
+    }
+}
+
+/*
+ * LRU policy, a single recency queue. A hit moves the object to the front
+ * and the victim is always the tail.
+ */
+static void* lru_create(int capacity)
+{
+    struct policy_list *list = malloc(sizeof(struct policy_list));
+
+    if (list)
+        policy_list_init(list);
+    return list;
+}
+
+static void lru_destroy(void *ctx)
+{
+    free(ctx);
+}
+
+static void lru_on_insert(void *ctx, struct policy_node *node)
+{
+    policy_list_push_front((struct policy_list*)ctx, node);
+}
+
+static void lru_on_hit(void *ctx, struct policy_node *node)
+{
+    struct policy_list *list = ctx;
+
+    if (list->first != node)
+    {
+        policy_list_remove(list, node);
+        policy_list_push_front(list, node);
+    }
+}
+
+static void lru_on_remove(void *ctx, struct policy_node *node, int evicted)
+{
+    policy_list_remove((struct policy_list*)ctx, node);
+}
+
+static struct policy_node* lru_choose_victim(void *ctx)
+{
+    return ((struct policy_list*)ctx)->last;
+}
+
+const EvictionPolicy lru_policy = {
+    "lru",
+    lru_create,
+    lru_destroy,
+    lru_on_insert,
+    lru_on_hit,
+    lru_on_remove,
+    lru_choose_victim
+};
@@ -0,0 +1,83 @@
+/*************************************************************************
+	> File Name: policy.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Eviction policy interface of the cache
+ ************************************************************************/
+
+#ifndef _POLICY_H
+#define _POLICY_H
+
+/*
+ * Every cache object embeds a policy node. Policies only see the nodes, the
+ * cache maps them back to the objects.
+ */
+struct policy_node {
+    struct policy_node *prev;
+    struct policy_node *next;
+    unsigned int hash;   /* Hash of the object key */
+    int size;            /* Object size in bytes */
+    int queue;           /* Queue of the node, policy specific */
+    int freq;            /* Access count, policy specific */
+    double priority;     /* GDSF priority */
+    int heap_index;      /* GDSF heap slot */
+};
+
+/*
+ * The hooks of an eviction policy. All of them are called with the shard
+ * lock held.
+ *
+ * on_insert      - a new object entered the cache.
+ * on_hit         - an object was found by a lookup.
+ * on_remove      - an object left the cache, evicted is 1 if it was the
+ *                  victim chosen by choose_victim.
+ * choose_victim  - return the next object to evict, without removing it.
+ *                  The policy may reorganize its queues to find it.
+ */
+typedef struct _EvictionPolicy {
+    const char *name;
+    void* (*create)(int capacity);
+    void  (*destroy)(void *ctx);
+    void  (*on_insert)(void *ctx, struct policy_node *node);
+    void  (*on_hit)(void *ctx, struct policy_node *node);
+    void  (*on_remove)(void *ctx, struct policy_node *node, int evicted);
+    struct policy_node* (*choose_victim)(void *ctx);
+} EvictionPolicy;
+
+const EvictionPolicy* find_policy(const char *name);
+
+extern const EvictionPolicy lru_policy;
+extern const EvictionPolicy arc_policy;
+extern const EvictionPolicy s3fifo_policy;
+extern const EvictionPolicy gdsf_policy;
+
+/*
+ * Doubly linked queue of nodes, shared by the policies. first is the most
+ * recently inserted node.
+ */
+struct policy_list {
+    struct policy_node *first;
+    struct policy_node *last;
+    long bytes;
+    int count;
+};
+
+void policy_list_init(struct policy_list *list);
+void policy_list_push_front(struct policy_list *list, struct policy_node *node);
+void policy_list_remove(struct policy_list *list, struct policy_node *node);
+
+/*
+ * Ghost list, the hashes and sizes of recently evicted objects, oldest
+ * dropped first once it holds more than a byte budget.
+ */
+struct _GhostList;
+typedef struct _GhostList GhostList;
+
+GhostList* ghost_create(long max_bytes);
+int        ghost_remove(GhostList *thiz, unsigned int hash);
+void       ghost_push(GhostList *thiz, unsigned int hash, int size);
+void       ghost_set_limit(GhostList *thiz, long max_bytes);
+long       ghost_bytes(GhostList *thiz);
+void       ghost_destroy(GhostList *thiz);
+
+#endif
@@ -0,0 +1,143 @@
+/*************************************************************************
+	> File Name: policy_arc.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Adaptive Replacement Cache policy, in bytes.
+	>
+	> T1 holds the objects seen once recently, T2 the ones seen at least
+	> twice. B1 and B2 remember the objects evicted from T1 and T2. A miss
+	> found in B1 means T1 was too small, so its target p grows, a miss found
+	> in B2 shrinks it. Sizes are counted in bytes instead of pages, so a
+	> large object moves p as much as its size.
+ ************************************************************************/
+#include "policy.h"
+
+#include <stdlib.h>
+
+enum { ARC_T1, ARC_T2 };
+
+struct arc {
+    struct policy_list t1;
+    struct policy_list t2;
+    GhostList *b1;
+    GhostList *b2;
+    long p;         /* Target size of T1 in bytes */
+    long c;         /* Capacity in bytes */
+};
+
+static void* arc_create(int capacity)
+{
+    struct arc *arc = calloc(1, sizeof(struct arc));
+
+    if (arc == NULL)
+        return NULL;
+    policy_list_init(&arc->t1);
+    policy_list_init(&arc->t2);
+    arc->c = capacity;
+    arc->p = 0;
+    arc->b1 = ghost_create(capacity);
+    arc->b2 = ghost_create(capacity);
+    if (arc->b1 == NULL || arc->b2 == NULL)
+    {
+        ghost_destroy(arc->b1);
+        ghost_destroy(arc->b2);
+        free(arc);
+        return NULL;
+    }
+
+    return arc;
+}
+
+static void arc_destroy(void *ctx)
+{
+    struct arc *arc = ctx;
+
+    ghost_destroy(arc->b1);
+    ghost_destroy(arc->b2);
+    free(arc);
+}
+
+/*
+ * arc_bound_ghosts - Keep T1 + B1 within c and the whole directory within 2c.
+ */
+static void arc_bound_ghosts(struct arc *arc)
+{
+    ghost_set_limit(arc->b1, arc->c - arc->t1.bytes);
+    ghost_set_limit(arc->b2, 2 * arc->c - arc->t1.bytes - arc->t2.bytes -
+                    ghost_bytes(arc->b1));
+}
+
+static void arc_on_insert(void *ctx, struct policy_node *node)
+{
+    struct arc *arc = ctx;
+    long b1 = ghost_bytes(arc->b1), b2 = ghost_bytes(arc->b2);
+    long delta;
+
+    if (ghost_remove(arc->b1, node->hash))
+    {
+        delta = b1 > 0 && b2 > b1 ? node->size * (b2 / b1) : node->size;
+        arc->p = arc->p + delta > arc->c ? arc->c : arc->p + delta;
+        node->queue = ARC_T2;
+        policy_list_push_front(&arc->t2, node);
+    }
+    else if (ghost_remove(arc->b2, node->hash))
+    {
+        delta = b2 > 0 && b1 > b2 ? node->size * (b1 / b2) : node->size;
+        arc->p = arc->p - delta < 0 ? 0 : arc->p - delta;
+        node->queue = ARC_T2;
+        policy_list_push_front(&arc->t2, node);
+    }
+    else
+    {
+        node->queue = ARC_T1;
+        policy_list_push_front(&arc->t1, node);
+    }
+    arc_bound_ghosts(arc);
+}
+
+static void arc_on_hit(void *ctx, struct policy_node *node)
+{
+    struct arc *arc = ctx;
+
+    policy_list_remove(node->queue == ARC_T1 ? &arc->t1 : &arc->t2, node);
+    node->queue = ARC_T2;
+    policy_list_push_front(&arc->t2, node);
+}
+
+static void arc_on_remove(void *ctx, struct policy_node *node, int evicted)
+{
+    struct arc *arc = ctx;
+
+    if (node->queue == ARC_T1)
+    {
+        policy_list_remove(&arc->t1, node);
+        if (evicted)
+            ghost_push(arc->b1, node->hash, node->size);
+    }
+    else
+    {
+        policy_list_remove(&arc->t2, node);
+        if (evicted)
+            ghost_push(arc->b2, node->hash, node->size);
+    }
+    arc_bound_ghosts(arc);
+}
+
+static struct policy_node* arc_choose_victim(void *ctx)
+{
+    struct arc *arc = ctx;
+
+    if (arc->t1.last && (arc->t1.bytes > arc->p || arc->t2.last == NULL))
+        return arc->t1.last;
+    return arc->t2.last;
+}
+
+const EvictionPolicy arc_policy = {
+    "arc",
+    arc_create,
+    arc_destroy,
+    arc_on_insert,
+    arc_on_hit,
+    arc_on_remove,
+    arc_choose_victim
+};
@@ -0,0 +1,165 @@
+/*************************************************************************
+	> File Name: policy_gdsf.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: GreedyDual-Size-Frequency policy.
+	>
+	> Every object has the priority L + freq / size, the victim is the
+	> object of lowest priority. L is raised to the priority of every
+	> victim, so objects that are not hit anymore age out. Small and popular
+	> objects are kept longer, which favors the object hit ratio.
+ ************************************************************************/
+#include "policy.h"
+
+#include <stdlib.h>
+
+#define GDSF_INIT_HEAP 1024
+/* Keep the priorities of byte sized objects away from the float epsilon */
+#define GDSF_SCALE 1048576.0
+
+struct gdsf {
+    struct policy_node **heap;  /* Min heap on priority */
+    int count;
+    int size;
+    double inflation;           /* L */
+};
+
+static void* gdsf_create(int capacity)
+{
+    struct gdsf *gdsf = calloc(1, sizeof(struct gdsf));
+
+    if (gdsf == NULL)
+        return NULL;
+    gdsf->size = GDSF_INIT_HEAP;
+    gdsf->heap = malloc(gdsf->size * sizeof(struct policy_node*));
+    if (gdsf->heap == NULL)
+    {
+        free(gdsf);
+        return NULL;
+    }
+
+    return gdsf;
+}
+
+static void gdsf_destroy(void *ctx)
+{
+    struct gdsf *gdsf = ctx;
+
+    free(gdsf->heap);
+    free(gdsf);
+}
+
+static void heap_set(struct gdsf *gdsf, int i, struct policy_node *node)
+{
+    gdsf->heap[i] = node;
+    node->heap_index = i;
+}
+
+static void sift_up(struct gdsf *gdsf, int i)
+{
+    struct policy_node *node = gdsf->heap[i];
+
+    while (i > 0 && gdsf->heap[(i - 1) / 2]->priority > node->priority)
+    {
+        heap_set(gdsf, i, gdsf->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(gdsf, i, node);
+}
+
+static void sift_down(struct gdsf *gdsf, int i)
+{
+    struct policy_node *node = gdsf->heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < gdsf->count)
+    {
+        if (child + 1 < gdsf->count &&
+            gdsf->heap[child + 1]->priority < gdsf->heap[child]->priority)
+            child++;
+        if (gdsf->heap[child]->priority >= node->priority)
+            break;
+        heap_set(gdsf, i, gdsf->heap[child]);
+        i = child;
+    }
+    heap_set(gdsf, i, node);
+}
+
+static double gdsf_priority(struct gdsf *gdsf, struct policy_node *node)
+{
+    return gdsf->inflation + GDSF_SCALE * node->freq / node->size;
+}
+
+static void gdsf_on_insert(void *ctx, struct policy_node *node)
+{
+    struct gdsf *gdsf = ctx;
+    struct policy_node **heap;
+
+    if (gdsf->count == gdsf->size)
+    {
+        heap = realloc(gdsf->heap, 2 * gdsf->size * sizeof(struct policy_node*));
+        if (heap == NULL)
+        {
+            /* Not tracked, it will never be a victim */
+            node->heap_index = -1;
+            return;
+        }
+        gdsf->heap = heap;
+        gdsf->size *= 2;
+    }
+
+    node->freq = 1;
+    node->priority = gdsf_priority(gdsf, node);
+    heap_set(gdsf, gdsf->count++, node);
+    sift_up(gdsf, node->heap_index);
+}
+
+static void gdsf_on_hit(void *ctx, struct policy_node *node)
+{
+    struct gdsf *gdsf = ctx;
+
+    if (node->heap_index < 0)
+        return;
+    node->freq++;
+    node->priority = gdsf_priority(gdsf, node);
+    sift_down(gdsf, node->heap_index);
+}
+
+static void gdsf_on_remove(void *ctx, struct policy_node *node, int evicted)
+{
+    struct gdsf *gdsf = ctx;
+    struct policy_node *moved;
+    int i = node->heap_index;
+
+    if (i < 0)
+        return;
+    if (evicted)
+        gdsf->inflation = node->priority;
+
+    gdsf->count--;
+    if (i != gdsf->count)
+    {
+        moved = gdsf->heap[gdsf->count];
+        heap_set(gdsf, i, moved);
+        sift_up(gdsf, i);
+        sift_down(gdsf, moved->heap_index);
+    }
+    node->heap_index = -1;
+}
+
+static struct policy_node* gdsf_choose_victim(void *ctx)
+{
+    struct gdsf *gdsf = ctx;
+
+    return gdsf->count > 0 ? gdsf->heap[0] : NULL;
+}
+
+const EvictionPolicy gdsf_policy = {
+    "gdsf",
+    gdsf_create,
+    gdsf_destroy,
+    gdsf_on_insert,
+    gdsf_on_hit,
+    gdsf_on_remove,
+    gdsf_choose_victim
+};
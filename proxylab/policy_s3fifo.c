@@ -0,0 +1,137 @@
+/*************************************************************************
+	> File Name: policy_s3fifo.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: S3-FIFO policy.
+	>
+	> New objects enter a small FIFO S holding 10% of the bytes. Objects hit
+	> while in S move on to the main FIFO M, the others are evicted and only
+	> their hash is kept in the ghost FIFO G. A miss found in G goes straight
+	> to M. M is a CLOCK: an object with hits left is reinserted with one
+	> hit less instead of being evicted. A hit only bumps a counter, it never
+	> moves an object.
+ ************************************************************************/
+#include "policy.h"
+
+#include <stdlib.h>
+
+#define S3FIFO_MAX_FREQ 3
+
+enum { S3FIFO_SMALL, S3FIFO_MAIN };
+
+struct s3fifo {
+    struct policy_list small;
+    struct policy_list main;
+    GhostList *ghost;
+    long small_target;  /* Bytes of S before it is evicted from */
+};
+
+static void* s3fifo_create(int capacity)
+{
+    struct s3fifo *s3 = calloc(1, sizeof(struct s3fifo));
+
+    if (s3 == NULL)
+        return NULL;
+    policy_list_init(&s3->small);
+    policy_list_init(&s3->main);
+    s3->small_target = capacity / 10;
+    if ((s3->ghost = ghost_create(capacity - s3->small_target)) == NULL)
+    {
+        free(s3);
+        return NULL;
+    }
+
+    return s3;
+}
+
+static void s3fifo_destroy(void *ctx)
+{
+    struct s3fifo *s3 = ctx;
+
+    ghost_destroy(s3->ghost);
+    free(s3);
+}
+
+static void s3fifo_on_insert(void *ctx, struct policy_node *node)
+{
+    struct s3fifo *s3 = ctx;
+
+    node->freq = 0;
+    if (ghost_remove(s3->ghost, node->hash))
+    {
+        node->queue = S3FIFO_MAIN;
+        policy_list_push_front(&s3->main, node);
+    }
+    else
+    {
+        node->queue = S3FIFO_SMALL;
+        policy_list_push_front(&s3->small, node);
+    }
+}
+
+static void s3fifo_on_hit(void *ctx, struct policy_node *node)
+{
+    if (node->freq < S3FIFO_MAX_FREQ)
+        node->freq++;
+}
+
+static void s3fifo_on_remove(void *ctx, struct policy_node *node, int evicted)
+{
+    struct s3fifo *s3 = ctx;
+
+    if (node->queue == S3FIFO_SMALL)
+    {
+        policy_list_remove(&s3->small, node);
+        if (evicted)
+            ghost_push(s3->ghost, node->hash, node->size);
+    }
+    else
+    {
+        policy_list_remove(&s3->main, node);
+    }
+}
+
+static struct policy_node* s3fifo_choose_victim(void *ctx)
+{
+    struct s3fifo *s3 = ctx;
+    struct policy_node *node;
+
+    for (;;)
+    {
+        if (s3->small.last &&
+            (s3->small.bytes > s3->small_target || s3->main.last == NULL))
+        {
+            node = s3->small.last;
+            if (node->freq == 0)
+                return node;
+            /* Hit while in S, promote it to M */
+            policy_list_remove(&s3->small, node);
+            node->freq = 0;
+            node->queue = S3FIFO_MAIN;
+            policy_list_push_front(&s3->main, node);
+        }
+        else if (s3->main.last)
+        {
+            node = s3->main.last;
+            if (node->freq == 0)
+                return node;
+            policy_list_remove(&s3->main, node);
+            node->freq--;
+            policy_list_push_front(&s3->main, node);
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+}
+
+const EvictionPolicy s3fifo_policy = {
+    "s3fifo",
+    s3fifo_create,
+    s3fifo_destroy,
+    s3fifo_on_insert,
+    s3fifo_on_hit,
+    s3fifo_on_remove,
+    s3fifo_choose_victim
+};
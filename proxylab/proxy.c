@@ -9,17 +9,23 @@
 
 #include "csapp.h"
 #include "cache.h"
+#include "disk.h"
 #include "queue.h"
 #include "ConnectionOperation.h"
 
 /* Recommended max cache and object sizes */
 
 #define THREAD_NUM 4
+#define CACHE_SHARDS 8
 #define MAX_FILENO_PER_THREAD 64
 #define MAX_EVENTS MAX_FILENO_PER_THREAD
 
 pthread_t tid[THREAD_NUM];
 
+static const char *snapshot_path;
+static int snapshot_period;
+static volatile sig_atomic_t terminated;
+static volatile sig_atomic_t stats_requested;
 
 void* proxy_thread(void *argv);
 
@@ -52,10 +58,75 @@ void set_socket_reuse(int listenfd)
 
 static void display_usage(const char *progname)
 {
-    fprintf(stderr, "%s <port>\n", progname);
+    fprintf(stderr, "%s [-s shards] [-m cache_bytes] [-l large_cache_bytes] "
+            "[-d disk_dir] [-D disk_bytes] [-S snapshot_file] [-P seconds] "
+            "[-a 0|1] [-z 0|1] [-f 0|1] [-p lru|arc|s3fifo|gdsf] <port>\n", progname);
     exit(-1);
 }
 
+static void handle_signal(int sig)
+{
+    if (sig == SIGTERM)
+        terminated = 1;
+    else
+        stats_requested = 1;
+}
+
+/*
+ * snapshot_thread - Save the cache snapshot every snapshot_period seconds,
+ *                   so a crash loses at most one period.
+ */
+static void* snapshot_thread(void *varg)
+{
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        sleep(snapshot_period);
+        save_cache_snapshot(snapshot_path, stdout);
+    }
+    return NULL;
+}
+
+/*
+ * init_signals - SIGTERM saves the snapshot and exits, SIGUSR1 prints the
+ *                cache statistics. The signals are only delivered to the
+ *                main thread, so they interrupt accept(); mask is unblocked
+ *                there once the other threads are created.
+ */
+static void init_signals(sigset_t *mask)
+{
+    struct sigaction action;
+
+    sigemptyset(mask);
+    sigaddset(mask, SIGTERM);
+    sigaddset(mask, SIGUSR1);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+    pthread_sigmask(SIG_BLOCK, mask, NULL);
+}
+
+/*
+ * init_snapshot - Load the snapshot of the previous run, and save it
+ *                 periodically if asked to.
+ */
+static void init_snapshot(void)
+{
+    pthread_t snapshot_tid;
+
+    if (snapshot_path == NULL)
+        return;
+
+    if (load_cache_snapshot(snapshot_path, stdout) < 0)
+        printf("snapshot: no snapshot loaded from %s, starting cold\n",
+               snapshot_path);
+    if (snapshot_period > 0)
+        pthread_create(&snapshot_tid, NULL, snapshot_thread, NULL);
+}
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -67,20 +138,83 @@ int main(int argc, char *argv[])
     Queue **queue_array;
     int ret;
     int index = 0;
+    int opt;
+    int nshard = CACHE_SHARDS;
+    int capacity = MAX_CACHE_SIZE;
+    int large_capacity = LARGE_CACHE_SIZE;
+    const char *disk_dir = NULL;
+    long disk_capacity = DISK_CACHE_SIZE;
+    int admission = 1;
+    int compression = 0;
+    sigset_t mask;
+
+    while ((opt = getopt(argc, argv, "s:m:l:d:D:S:P:a:z:f:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            nshard = atoi(optarg);
+            break;
+        case 'm':
+            capacity = atoi(optarg);
+            break;
+        case 'l':
+            large_capacity = atoi(optarg);
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'D':
+            disk_capacity = atol(optarg);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'P':
+            snapshot_period = atoi(optarg);
+            break;
+        case 'a':
+            admission = atoi(optarg);
+            break;
+        case 'z':
+            compression = atoi(optarg);
+            break;
+        case 'f':
+            set_cache_memfd(atoi(optarg));
+            break;
+        case 'p':
+            if (set_cache_policy(optarg) < 0)
+                display_usage(argv[0]);
+            break;
+        default:
+            display_usage(argv[0]);
+        }
+    }
 
-    if (argc < 2)
+    if (optind >= argc)
     {
         display_usage(argv[0]);
     }
     
-    if ((listenfd = open_listenfd(argv[1])) < 0)
+    if ((listenfd = open_listenfd(argv[optind])) < 0)
     {
         err_exit("open_listenfd error");
     } 
     set_socket_reuse(listenfd);
 
-    init_cache();
+    if (init_cache(nshard, capacity) < 0)
+        err_exit("init_cache error");
+    if (init_large_cache(large_capacity) < 0)
+        err_exit("init_large_cache error");
+    if (disk_dir && init_disk_cache(disk_dir, disk_capacity) < 0)
+        err_exit("init_disk_cache error");
+    set_cache_admission(admission);
+    set_cache_compression(compression);
+    printf("Cache initialized with %d shards, %s eviction, objects up to %d bytes\n",
+           get_cache_shards(), get_cache_policy(), get_cache_object_limit());
     signal(SIGPIPE, SIG_IGN);
+    init_signals(&mask);
+    init_snapshot();
 
     /* Create thread pool */
     queue_array = malloc(sizeof(Queue*));
@@ -90,6 +224,7 @@ int main(int argc, char *argv[])
         queue_array[i] = queue;
         pthread_create(&tid[i], NULL, proxy_thread, (void*)queue);
     }
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
     
     addrlen = sizeof(clientaddr);
     while (1)
@@ -97,7 +232,21 @@ int main(int argc, char *argv[])
         if ((connfd = accept(listenfd, (struct sockaddr*)&clientaddr, 
                              &addrlen)) < 0)
         {
-            err_exit("accept error");
+            if (errno != EINTR)
+                err_exit("accept error");
+            if (terminated)
+            {
+                if (snapshot_path)
+                    save_cache_snapshot(snapshot_path, stdout);
+                exit(0);
+            }
+            if (stats_requested)
+            {
+                stats_requested = 0;
+                dump_cache_stats(stdout);
+                fflush(stdout);
+            }
+            continue;
         }
          
         if ((ret = getnameinfo((struct sockaddr*)&clientaddr, addrlen, 
@@ -136,16 +285,17 @@ void handle_event(DList* connectionTable, struct epoll_event *ev, int epfd)
             struct connection* pair = conn->pair;
             delete_connection(connectionTable, conn);
 
-            if (pair->size == 0)
+            /* A background refresh has no client */
+            if (pair == NULL)
+                return;
+            if (connection_pending(pair) == 0)
             {
                 /*
                  * If no data needs to forward, we should delete the peer connection
                  */
-                char buf[64];
 
                 /*Wait peer closed the connection*/
-                shutdown(pair->fd, SHUT_WR);
-                while (read(pair->fd, buf, 64) != 0) continue; 
+                drain_connection(pair);
                 delete_connection(connectionTable, pair);
             }
             else
@@ -155,7 +305,7 @@ void handle_event(DList* connectionTable, struct epoll_event *ev, int epfd)
                  * HALF_FINISH_CONNECTION, then when send all data, we will delete
                  * the pair connection.
                  */
-                conn->pair->state = HALF_FINISH_CONNECTION;
+                pair->state = HALF_FINISH_CONNECTION;
             }
         }
     }
@@ -169,21 +319,29 @@ void handle_event(DList* connectionTable, struct epoll_event *ev, int epfd)
     else if (ev->events & EPOLLOUT)
     {
         struct epoll_event event;
+        int ret;
 
-        if (write_to_connection(conn, epfd) < 0)
+        if ((ret = write_to_connection(conn, epfd)) == 1)
+        {
+            /* The response it waited for is another client's, fetch its own */
+            if (refetch_connection(connectionTable, conn, epfd) != 0)
+                delete_connection(connectionTable, conn);
+            return;
+        }
+        if (ret < 0)
         {
             /*
-             * Set conn->size = 0 just discard the data.
+             * Just discard the data.
              */
             if (conn->pair)
                 shutdown(conn->pair->fd, SHUT_WR);
-            conn->size = 0;
+            discard_connection(conn);
         }
 
         /*
          * If no data needs to send, disable write of the connection
          */
-        if (conn->size == 0)
+        if (connection_pending(conn) == 0)
         {
             /* 
              * The pair connection has closed and we have send all data, so
@@ -191,9 +349,7 @@ void handle_event(DList* connectionTable, struct epoll_event *ev, int epfd)
              */
             if (conn->state == HALF_FINISH_CONNECTION)
             {
-                char buf[64];
-                shutdown(conn->fd, SHUT_WR);
-                while (read(conn->fd, buf, 64) != 0) continue; 
+                drain_connection(conn);
                 delete_connection(connectionTable, conn);
                 return;
             }
@@ -251,6 +407,7 @@ void* proxy_thread(void *varg)
             }
             
             ready = epoll_wait(epfd, evlists, MAX_EVENTS, timeout); 
+            cache_tick();
             if (ready == -1) /* Error occured */
             {
                 if (errno == EINTR)
@@ -0,0 +1,155 @@
+/*************************************************************************
+	> File Name: sketch.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Count-min frequency sketch with periodic aging.
+	>
+	> Every key bumps one small counter in each of SKETCH_DEPTH rows, and
+	> its frequency is the smallest of those counters. After 10 * width
+	> increments all counters are halved, so old popularity fades away.
+	> The sketch is not locked, the caller serializes the accesses.
+ ************************************************************************/
+#include "sketch.h"
+
+#include <stdlib.h>
+
+#include "typedef.h"
+
+struct _FreqSketch
+{
+    unsigned char *counters;  /* SKETCH_DEPTH rows of width counters */
+    unsigned int mask;        /* width - 1, width is a power of two */
+    int additions;            /* Increments since the last aging */
+    int sample_size;          /* Increments between two agings */
+};
+
+static const unsigned int seeds[SKETCH_DEPTH] = {
+    0x97cb3127u, 0xb3c2a6d9u, 0x2c1b3c6du, 0x7fb5d329u
+};
+
+FreqSketch* sketch_create(int width)
+{
+    unsigned int n = 1;
+    FreqSketch* thiz = malloc(sizeof(FreqSketch));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    while (n < (unsigned int)width)
+        n <<= 1;
+    thiz->counters = calloc(SKETCH_DEPTH, n);
+    if (thiz->counters == NULL)
+    {
+        free(thiz);
+        return NULL;
+    }
+    thiz->mask = n - 1;
+    thiz->additions = 0;
+    thiz->sample_size = 10 * n;
+
+    return thiz;
+}
+
+/*
+ * slot - Index of the counter of hash in row i.
+ */
+static unsigned int slot(FreqSketch* thiz, unsigned int hash, int i)
+{
+    unsigned int h = (hash ^ seeds[i]) * 0x9e3779b1u;
+
+    h ^= h >> 15;
+    return i * (thiz->mask + 1) + (h & thiz->mask);
+}
+
+/*
+ * age - Halve every counter.
+ */
+static void age(FreqSketch* thiz)
+{
+    unsigned int i;
+
+    for (i = 0; i < SKETCH_DEPTH * (thiz->mask + 1); i++)
+        thiz->counters[i] >>= 1;
+    thiz->additions /= 2;
+}
+
+void sketch_increment(FreqSketch* thiz, unsigned int hash)
+{
+    int i;
+    unsigned int index;
+    int added = 0;
+
+    return_if_fail(thiz != NULL);
+
+    for (i = 0; i < SKETCH_DEPTH; i++)
+    {
+        index = slot(thiz, hash, i);
+        if (thiz->counters[index] < SKETCH_MAX_COUNT)
+        {
+            thiz->counters[index]++;
+            added = 1;
+        }
+    }
+
+    if (added && ++thiz->additions >= thiz->sample_size)
+        age(thiz);
+}
+
+int sketch_estimate(FreqSketch* thiz, unsigned int hash)
+{
+    int i;
+    int count, min = SKETCH_MAX_COUNT;
+
+    return_val_if_fail(thiz != NULL, 0);
+
+    for (i = 0; i < SKETCH_DEPTH; i++)
+    {
+        count = thiz->counters[slot(thiz, hash, i)];
+        if (count < min)
+            min = count;
+    }
+
+    return min;
+}
+
+void sketch_destroy(FreqSketch* thiz)
+{
+    if (thiz != NULL)
+    {
+        free(thiz->counters);
+        free(thiz);
+    }
+}
+
+#ifdef SKETCH_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+static void sketch_estimate_test(void)
+{
+    unsigned int i;
+    FreqSketch* thiz = sketch_create(1024);
+
+    for (i = 0; i < 5; i++)
+        sketch_increment(thiz, 42);
+    assert(sketch_estimate(thiz, 42) == 5);
+    assert(sketch_estimate(thiz, 43) == 0);
+
+    for (i = 0; i < 100; i++)
+        sketch_increment(thiz, 42);
+    assert(sketch_estimate(thiz, 42) == SKETCH_MAX_COUNT);
+
+    /* Enough other keys force an aging, which halves the counters */
+    for (i = 0; i < 10 * 1024; i++)
+        sketch_increment(thiz, 1000 + i);
+    assert(sketch_estimate(thiz, 42) <= SKETCH_MAX_COUNT / 2);
+
+    sketch_destroy(thiz);
+}
+
+int main(int argc, char* argv[])
+{
+    sketch_estimate_test();
+    return 0;
+}
+#endif
@@ -0,0 +1,22 @@
+/*************************************************************************
+	> File Name: sketch.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Count-min frequency sketch with periodic aging
+ ************************************************************************/
+
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+
+struct _FreqSketch;
+typedef struct _FreqSketch FreqSketch;
+
+FreqSketch* sketch_create(int width);
+void        sketch_increment(FreqSketch* thiz, unsigned int hash);
+int         sketch_estimate(FreqSketch* thiz, unsigned int hash);
+void        sketch_destroy(FreqSketch* thiz);
+
+#endif
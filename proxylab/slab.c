@@ -0,0 +1,708 @@
+/*************************************************************************
+	> File Name: slab.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Size class slab allocator for cache objects.
+	>
+	> The arena is one region allocated up front and cut in SLAB_PAGE_SIZE
+	> pages. A page is given to a size class on demand and carved in chunks
+	> of the class size. Chunks are never returned to malloc, so the memory
+	> of the cache stays bounded by the arena whatever the churn is. When a
+	> class runs out of pages, pages left completely free by other classes
+	> are taken back. A page whose chunks are spread over many objects
+	> rarely drains on its own though: slab_reassign() then moves the page
+	> of another class with the fewest chunks in use, asking the owner of
+	> the arena to evict the objects in it, and hands it to the starving
+	> class once its last chunk is freed. So the arena follows the object
+	> size mix.
+	>
+	> The region may be a mapped memfd instead of malloc memory, so chunks
+	> can be sent to sockets with sendfile straight from the page cache.
+ ************************************************************************/
+#define _GNU_SOURCE
+#include "slab.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "typedef.h"
+
+#define MAX_CLASSES 64
+
+struct chunk {
+    struct chunk *next;
+};
+
+struct slab_page {
+    int cls;   /* Owner class, -1 if the page is free */
+    int used;  /* Chunks of the page handed out */
+    int target; /* Class the page moves to once drained, or -1 */
+    unsigned char *freed; /* Chunks freed since the move started */
+};
+
+struct slab_class {
+    size_t size;          /* Chunk size */
+    int perpage;          /* Chunks per page */
+    struct chunk *free;   /* Free chunks of the class */
+    int nfree;
+    int npages;
+    int nused;
+    size_t requested;
+};
+
+struct _SlabArena
+{
+    char *base;
+    int fd;               /* memfd mapped at base, or -1 if malloc'd */
+    int npages;
+    struct slab_page *pages;
+    int *free_pages;      /* Stack of the free page numbers */
+    int nfree_pages;
+    struct slab_class classes[MAX_CLASSES];
+    int nclasses;
+    SlabEvictFunc evict;  /* Drops the object of a chunk of a moved page */
+    void *evict_ctx;
+    int moving;           /* Pages being drained */
+    long moved;           /* Pages handed to another class */
+    long move_evictions;  /* Objects evicted to move them */
+    pthread_mutex_t mutex;
+};
+
+/*
+ * map_memfd - Map a new memfd of len bytes. Return its address, and set fd,
+ *             or return NULL if failed.
+ */
+static char* map_memfd(size_t len, int *fd)
+{
+    char *base = MAP_FAILED;
+
+    if ((*fd = memfd_create("proxylab-slab", MFD_CLOEXEC)) < 0)
+        return NULL;
+    if (ftruncate(*fd, len) == 0)
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+    return base;
+}
+
+static SlabArena* create_arena(size_t size, int memfd)
+{
+    int i;
+    size_t chunk;
+    SlabArena* thiz = calloc(1, sizeof(SlabArena));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    thiz->fd = -1;
+    thiz->npages = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+    if (memfd)
+        thiz->base = map_memfd((size_t)thiz->npages * SLAB_PAGE_SIZE, &thiz->fd);
+    else
+        thiz->base = malloc((size_t)thiz->npages * SLAB_PAGE_SIZE);
+    thiz->pages = calloc(thiz->npages, sizeof(struct slab_page));
+    thiz->free_pages = calloc(thiz->npages, sizeof(int));
+    if (thiz->base == NULL || thiz->pages == NULL || thiz->free_pages == NULL)
+    {
+        slab_destroy(thiz);
+        return NULL;
+    }
+
+    for (i = 0; i < thiz->npages; i++)
+    {
+        thiz->pages[i].cls = -1;
+        thiz->pages[i].target = -1;
+        thiz->free_pages[i] = thiz->npages - 1 - i;
+    }
+    thiz->nfree_pages = thiz->npages;
+
+    /* Chunk sizes grow by SLAB_GROWTH_FACTOR, the last one is a whole page */
+    chunk = SLAB_MIN_CHUNK;
+    while (thiz->nclasses < MAX_CLASSES - 1 && chunk <= SLAB_PAGE_SIZE / 2)
+    {
+        thiz->classes[thiz->nclasses].size = chunk;
+        thiz->classes[thiz->nclasses].perpage = SLAB_PAGE_SIZE / chunk;
+        thiz->nclasses++;
+        chunk = ((size_t)(chunk * SLAB_GROWTH_FACTOR) + 7) & ~(size_t)7;
+    }
+    thiz->classes[thiz->nclasses].size = SLAB_PAGE_SIZE;
+    thiz->classes[thiz->nclasses].perpage = 1;
+    thiz->nclasses++;
+
+    pthread_mutex_init(&thiz->mutex, NULL);
+
+    return thiz;
+}
+
+SlabArena* slab_create(size_t size)
+{
+    return create_arena(size, 0);
+}
+
+/*
+ * slab_create_memfd - Create an arena in a memfd, see slab_fd().
+ */
+SlabArena* slab_create_memfd(size_t size)
+{
+    return create_arena(size, 1);
+}
+
+/*
+ * slab_fd - Return the memfd holding ptr, a chunk of the arena, and set
+ *           offset to its position in it, or return -1 if the arena is not
+ *           in a memfd.
+ */
+int slab_fd(SlabArena* thiz, const void* ptr, off_t* offset)
+{
+    return_val_if_fail(thiz != NULL, -1);
+
+    if (thiz->fd < 0 || (const char*)ptr < thiz->base ||
+        (const char*)ptr >= thiz->base + (size_t)thiz->npages * SLAB_PAGE_SIZE)
+        return -1;
+    *offset = (const char*)ptr - thiz->base;
+    return thiz->fd;
+}
+
+/*
+ * find_class - return the smallest class holding size bytes, or -1.
+ */
+static int find_class(SlabArena* thiz, size_t size)
+{
+    int lo = 0, hi = thiz->nclasses - 1, mid;
+
+    if (size > thiz->classes[hi].size)
+        return -1;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (thiz->classes[mid].size >= size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+static int page_of(SlabArena* thiz, void* ptr)
+{
+    return ((char*)ptr - thiz->base) / SLAB_PAGE_SIZE;
+}
+
+/*
+ * reclaim_page - Take back a page left free by another class. The chunks
+ *                of the page are removed from the free list of its owner.
+ *                Return the page number, or -1 if no page is free.
+ */
+static int reclaim_page(SlabArena* thiz, int cls)
+{
+    int i;
+    struct slab_class *owner;
+    struct chunk **pp;
+
+    for (i = 0; i < thiz->npages; i++)
+    {
+        if (thiz->pages[i].cls >= 0 && thiz->pages[i].cls != cls &&
+            thiz->pages[i].used == 0)
+            break;
+    }
+    if (i == thiz->npages)
+        return -1;
+
+    owner = &thiz->classes[thiz->pages[i].cls];
+    pp = &owner->free;
+    while (*pp)
+    {
+        if (page_of(thiz, *pp) == i)
+        {
+            *pp = (*pp)->next;
+            owner->nfree--;
+        }
+        else
+        {
+            pp = &(*pp)->next;
+        }
+    }
+    owner->npages--;
+    thiz->pages[i].cls = -1;
+
+    return i;
+}
+
+/*
+ * assign_page - Carve the page in chunks of the class.
+ */
+static void assign_page(SlabArena* thiz, int page, int cls)
+{
+    int i;
+    struct slab_class *c = &thiz->classes[cls];
+    struct chunk *chunk;
+
+    thiz->pages[page].cls = cls;
+    thiz->pages[page].used = 0;
+    for (i = c->perpage - 1; i >= 0; i--)
+    {
+        chunk = (struct chunk*)(thiz->base + (size_t)page * SLAB_PAGE_SIZE + i * c->size);
+        chunk->next = c->free;
+        c->free = chunk;
+    }
+    c->nfree += c->perpage;
+    c->npages++;
+}
+
+/*
+ * grow_class - Give a free page to the class.
+ */
+static Ret grow_class(SlabArena* thiz, int cls)
+{
+    int page;
+
+    if (thiz->nfree_pages > 0)
+        page = thiz->free_pages[--thiz->nfree_pages];
+    else if ((page = reclaim_page(thiz, cls)) < 0)
+        return RET_OOM;
+
+    assign_page(thiz, page, cls);
+    return RET_OK;
+}
+
+/*
+ * chunk_index - return the index of the chunk ptr in its page.
+ */
+static int chunk_index(SlabArena* thiz, void* ptr)
+{
+    int page = page_of(thiz, ptr);
+    size_t offset = (char*)ptr - thiz->base - (size_t)page * SLAB_PAGE_SIZE;
+
+    return offset / thiz->classes[thiz->pages[page].cls].size;
+}
+
+/*
+ * finish_move - The last chunk of a moved page was freed, hand the page to
+ *               its new class.
+ */
+static void finish_move(SlabArena* thiz, int page)
+{
+    struct slab_page *p = &thiz->pages[page];
+    int target = p->target;
+
+    thiz->classes[p->cls].npages--;
+    free(p->freed);
+    p->freed = NULL;
+    p->target = -1;
+    thiz->moving--;
+    thiz->moved++;
+    assign_page(thiz, page, target);
+}
+
+/*
+ * start_move - Start moving the page to the class cls: its free chunks are
+ *              taken out of the free list of its owner, the others are
+ *              kept out once freed. Return -1 if out of memory.
+ */
+static int start_move(SlabArena* thiz, int page, int cls)
+{
+    struct slab_page *p = &thiz->pages[page];
+    struct slab_class *owner = &thiz->classes[p->cls];
+    struct chunk **pp;
+
+    if ((p->freed = calloc(owner->perpage, 1)) == NULL)
+        return -1;
+    pp = &owner->free;
+    while (*pp)
+    {
+        if (page_of(thiz, *pp) == page)
+        {
+            p->freed[chunk_index(thiz, *pp)] = 1;
+            *pp = (*pp)->next;
+            owner->nfree--;
+        }
+        else
+        {
+            pp = &(*pp)->next;
+        }
+    }
+    p->target = cls;
+    thiz->moving++;
+    return 0;
+}
+
+/*
+ * pick_page - return the page of another class with the fewest chunks in
+ *             use, the cheapest to move to cls, or -1 if there is none.
+ */
+static int pick_page(SlabArena* thiz, int cls)
+{
+    int i, page = -1;
+
+    for (i = 0; i < thiz->npages; i++)
+    {
+        if (thiz->pages[i].cls < 0 || thiz->pages[i].cls == cls ||
+            thiz->pages[i].target >= 0)
+            continue;
+        if (page < 0 || thiz->pages[i].used < thiz->pages[page].used)
+            page = i;
+    }
+    return page;
+}
+
+/*
+ * slab_set_evict - Set the function slab_reassign() calls to drop the
+ *                  object held in a chunk of a page it moves.
+ */
+void slab_set_evict(SlabArena* thiz, SlabEvictFunc evict, void* ctx)
+{
+    return_if_fail(thiz != NULL);
+
+    thiz->evict = evict;
+    thiz->evict_ctx = ctx;
+}
+
+/*
+ * slab_reassign - Move a page of another class to the class of size, the
+ *                 arena has no chunk of it left. The chunks in use in the
+ *                 page are handed to the evict function, the page changes
+ *                 class once they are all freed. A page still holding
+ *                 chunks of a previous call, pinned by their readers, is
+ *                 tried again first. Call it without holding any lock the
+ *                 evict function takes.
+ *                 Return 0 if the class has a free chunk, 1 if the page is
+ *                 still held, or -1 if no page can be moved.
+ */
+int slab_reassign(SlabArena* thiz, size_t size)
+{
+    void* used[SLAB_PAGE_SIZE / SLAB_MIN_CHUNK];
+    struct slab_class *owner;
+    int cls, page, i, n = 0, evicted = 0, ret;
+
+    return_val_if_fail(thiz != NULL, -1);
+    if (thiz->evict == NULL || (cls = find_class(thiz, size)) < 0)
+        return -1;
+
+    pthread_mutex_lock(&thiz->mutex);
+    if (thiz->classes[cls].free != NULL)
+    {
+        pthread_mutex_unlock(&thiz->mutex);
+        return 0;
+    }
+    for (page = 0; page < thiz->npages; page++)
+    {
+        if (thiz->pages[page].target == cls)
+            break;
+    }
+    if (page == thiz->npages &&
+        ((page = pick_page(thiz, cls)) < 0 || start_move(thiz, page, cls) < 0))
+    {
+        pthread_mutex_unlock(&thiz->mutex);
+        return -1;
+    }
+    owner = &thiz->classes[thiz->pages[page].cls];
+    for (i = 0; i < owner->perpage; i++)
+    {
+        if (!thiz->pages[page].freed[i])
+            used[n++] = thiz->base + (size_t)page * SLAB_PAGE_SIZE + i * owner->size;
+    }
+    /* Not handed over while the chunks are looked at, even once freed */
+    thiz->pages[page].used++;
+    pthread_mutex_unlock(&thiz->mutex);
+
+    for (i = 0; i < n; i++)
+        evicted += thiz->evict(thiz->evict_ctx, used[i]);
+
+    pthread_mutex_lock(&thiz->mutex);
+    thiz->move_evictions += evicted;
+    if (--thiz->pages[page].used == 0)
+        finish_move(thiz, page);
+    ret = thiz->classes[cls].free != NULL ? 0 : 1;
+    pthread_mutex_unlock(&thiz->mutex);
+
+    return ret;
+}
+
+/*
+ * slab_chunk_size - return the size of the chunks an allocation of size
+ *                   bytes gets, or 0 if it is too big for the arena.
+ */
+size_t slab_chunk_size(SlabArena* thiz, size_t size)
+{
+    int cls;
+
+    return_val_if_fail(thiz != NULL, 0);
+    /* The classes never change once the arena is created */
+    cls = find_class(thiz, size);
+    return cls < 0 ? 0 : thiz->classes[cls].size;
+}
+
+/*
+ * slab_alloc - Allocate size bytes. Return NULL if the arena is full, the
+ *              caller should then free some chunks and try again.
+ */
+void* slab_alloc(SlabArena* thiz, size_t size)
+{
+    int cls;
+    struct slab_class *c;
+    struct chunk *chunk = NULL;
+
+    return_val_if_fail(thiz != NULL, NULL);
+    if ((cls = find_class(thiz, size)) < 0)
+        return NULL;
+    c = &thiz->classes[cls];
+
+    pthread_mutex_lock(&thiz->mutex);
+    if (c->free != NULL || grow_class(thiz, cls) == RET_OK)
+    {
+        chunk = c->free;
+        c->free = chunk->next;
+        c->nfree--;
+        c->nused++;
+        c->requested += size;
+        thiz->pages[page_of(thiz, chunk)].used++;
+    }
+    pthread_mutex_unlock(&thiz->mutex);
+
+    return chunk;
+}
+
+/*
+ * slab_free - Give back a chunk, size must be the size it was allocated with.
+ */
+void slab_free(SlabArena* thiz, void* ptr, size_t size)
+{
+    struct slab_page *page;
+    struct slab_class *c;
+    struct chunk *chunk = ptr;
+
+    return_if_fail(thiz != NULL && ptr != NULL);
+
+    pthread_mutex_lock(&thiz->mutex);
+    page = &thiz->pages[page_of(thiz, ptr)];
+    c = &thiz->classes[page->cls];
+    c->nused--;
+    c->requested -= size;
+    page->used--;
+    if (page->target >= 0)
+    {
+        /* The page is moving, the chunk is not reused in it */
+        page->freed[chunk_index(thiz, ptr)] = 1;
+        if (page->used == 0)
+            finish_move(thiz, page_of(thiz, ptr));
+    }
+    else
+    {
+        chunk->next = c->free;
+        c->free = chunk;
+        c->nfree++;
+    }
+    pthread_mutex_unlock(&thiz->mutex);
+}
+
+/*
+ * slab_get_stats - Fill the statistics of at most max classes which own
+ *                  pages. Return the number of classes filled.
+ */
+int slab_get_stats(SlabArena* thiz, SlabClassStats* stats, int max)
+{
+    int i, n = 0;
+    struct slab_class *c;
+
+    return_val_if_fail(thiz != NULL && stats != NULL, 0);
+
+    pthread_mutex_lock(&thiz->mutex);
+    for (i = 0; i < thiz->nclasses && n < max; i++)
+    {
+        c = &thiz->classes[i];
+        if (c->npages == 0)
+            continue;
+        stats[n].chunk_size = c->size;
+        stats[n].pages = c->npages;
+        stats[n].chunks = c->npages * c->perpage;
+        stats[n].used = c->nused;
+        stats[n].requested = c->requested;
+        stats[n].waste = c->nused * c->size - c->requested;
+        n++;
+    }
+    pthread_mutex_unlock(&thiz->mutex);
+
+    return n;
+}
+
+void slab_dump_stats(SlabArena* thiz, FILE* fp)
+{
+    int i, n;
+    SlabClassStats stats[MAX_CLASSES];
+
+    return_if_fail(thiz != NULL && fp != NULL);
+
+    n = slab_get_stats(thiz, stats, MAX_CLASSES);
+    fprintf(fp, "%8s %6s %9s %9s %6s %10s %6s\n", "chunk", "pages", "chunks",
+            "used", "fill%", "waste", "waste%");
+    for (i = 0; i < n; i++)
+    {
+        fprintf(fp, "%8zu %6d %9d %9d %6.1f %10zu %6.1f\n",
+                stats[i].chunk_size, stats[i].pages, stats[i].chunks,
+                stats[i].used, 100.0 * stats[i].used / stats[i].chunks,
+                stats[i].waste, stats[i].used == 0 ? 0.0 :
+                100.0 * stats[i].waste / (stats[i].used * stats[i].chunk_size));
+    }
+    pthread_mutex_lock(&thiz->mutex);
+    fprintf(fp, "%d of %d pages free\n", thiz->nfree_pages, thiz->npages);
+    if (thiz->moved || thiz->moving)
+        fprintf(fp, "%ld pages moved between classes, %ld objects evicted "
+                "to move them, %d moving\n", thiz->moved, thiz->move_evictions,
+                thiz->moving);
+    pthread_mutex_unlock(&thiz->mutex);
+}
+
+void slab_destroy(SlabArena* thiz)
+{
+    int i;
+
+    if (thiz != NULL)
+    {
+        if (thiz->fd < 0)
+            free(thiz->base);
+        else
+        {
+            if (thiz->base)
+                munmap(thiz->base, (size_t)thiz->npages * SLAB_PAGE_SIZE);
+            close(thiz->fd);
+        }
+        for (i = 0; thiz->pages && i < thiz->npages; i++)
+            free(thiz->pages[i].freed);
+        free(thiz->pages);
+        free(thiz->free_pages);
+        pthread_mutex_destroy(&thiz->mutex);
+        free(thiz);
+    }
+}
+
+#ifdef SLAB_TEST
+
+#include <assert.h>
+#include <string.h>
+
+static void slab_alloc_test(void)
+{
+    int i;
+    void *small[SLAB_PAGE_SIZE / SLAB_MIN_CHUNK];
+    void *big;
+    SlabClassStats stats[MAX_CLASSES];
+    SlabArena* thiz = slab_create(SLAB_PAGE_SIZE);
+
+    /* Fill the only page with the smallest chunks */
+    for (i = 0; i < SLAB_PAGE_SIZE / SLAB_MIN_CHUNK; i++)
+    {
+        small[i] = slab_alloc(thiz, 40);
+        assert(small[i] != NULL);
+        memset(small[i], i, 40);
+    }
+    assert(slab_alloc(thiz, 40) == NULL);
+    assert(slab_alloc(thiz, 1000) == NULL);
+    assert(slab_get_stats(thiz, stats, MAX_CLASSES) == 1);
+    assert(stats[0].used == SLAB_PAGE_SIZE / SLAB_MIN_CHUNK);
+    assert(stats[0].waste == stats[0].used * (SLAB_MIN_CHUNK - 40));
+
+    /* Once the page is free again, a bigger class can take it back */
+    for (i = 0; i < SLAB_PAGE_SIZE / SLAB_MIN_CHUNK; i++)
+        slab_free(thiz, small[i], 40);
+    big = slab_alloc(thiz, SLAB_PAGE_SIZE - 1);
+    assert(big != NULL);
+    assert(slab_alloc(thiz, 40) == NULL);
+    assert(slab_get_stats(thiz, stats, MAX_CLASSES) == 1);
+    assert(stats[0].chunk_size == SLAB_PAGE_SIZE);
+    slab_free(thiz, big, SLAB_PAGE_SIZE - 1);
+
+    assert(slab_alloc(thiz, SLAB_PAGE_SIZE + 1) == NULL);
+    slab_dump_stats(thiz, stdout);
+    slab_destroy(thiz);
+}
+
+static void slab_memfd_test(void)
+{
+    SlabArena* thiz = slab_create_memfd(2 * SLAB_PAGE_SIZE);
+    char *chunk, buf[16];
+    off_t offset;
+
+    assert(thiz != NULL);
+    chunk = slab_alloc(thiz, 1000);
+    assert(chunk != NULL);
+    memcpy(chunk, "memfd chunk", 12);
+    /* The file sees the chunk */
+    assert(slab_fd(thiz, chunk, &offset) >= 0);
+    assert(pread(slab_fd(thiz, chunk, &offset), buf, 12, offset) == 12);
+    assert(strcmp(buf, "memfd chunk") == 0);
+    assert(slab_fd(thiz, buf, &offset) == -1);
+    slab_free(thiz, chunk, 1000);
+    slab_destroy(thiz);
+
+    thiz = slab_create(SLAB_PAGE_SIZE);
+    chunk = slab_alloc(thiz, 1000);
+    assert(slab_fd(thiz, chunk, &offset) == -1);
+    slab_free(thiz, chunk, 1000);
+    slab_destroy(thiz);
+}
+
+static SlabArena* moved_arena;
+static void* pinned;
+
+static int evict_test_chunk(void* ctx, void* chunk)
+{
+    /* A pinned chunk is freed later, by its last reader */
+    if (chunk == pinned)
+        return 1;
+    slab_free(moved_arena, chunk, 40);
+    return 1;
+}
+
+static void slab_reassign_test(void)
+{
+    int i, n = SLAB_PAGE_SIZE / SLAB_MIN_CHUNK;
+    void *small[2 * SLAB_PAGE_SIZE / SLAB_MIN_CHUNK];
+    void *big;
+    SlabArena* thiz = slab_create(2 * SLAB_PAGE_SIZE);
+
+    moved_arena = thiz;
+    for (i = 0; i < 2 * n; i++)
+        assert((small[i] = slab_alloc(thiz, 40)) != NULL);
+    assert(slab_alloc(thiz, 1000) == NULL);
+    assert(slab_reassign(thiz, 1000) == -1);
+    slab_set_evict(thiz, evict_test_chunk, NULL);
+
+    /* Free a few chunks of the second page, it is the one moved */
+    for (i = n; i < n + 10; i++)
+        slab_free(thiz, small[i], 40);
+    pinned = small[n + 10];
+    assert(slab_reassign(thiz, 1000) == 1);
+    assert(slab_alloc(thiz, 1000) == NULL);
+    /* The freed chunks of a moving page are not handed out again */
+    assert(slab_alloc(thiz, 40) == NULL);
+    slab_free(thiz, pinned, 40);
+    big = slab_alloc(thiz, 1000);
+    assert(big != NULL);
+    assert(page_of(thiz, big) == page_of(thiz, small[n]));
+    assert(thiz->moved == 1 && thiz->moving == 0);
+    assert(thiz->move_evictions == n - 10);
+    assert(thiz->classes[0].npages == 1);
+
+    /* The first page is untouched */
+    for (i = 0; i < n; i++)
+        slab_free(thiz, small[i], 40);
+    slab_free(thiz, big, 1000);
+    slab_dump_stats(thiz, stdout);
+    slab_destroy(thiz);
+}
+
+int main(int argc, char* argv[])
+{
+    slab_alloc_test();
+    slab_memfd_test();
+    slab_reassign_test();
+    return 0;
+}
+#endif
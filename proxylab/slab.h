@@ -0,0 +1,50 @@
+/*************************************************************************
+	> File Name: slab.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Size class slab allocator for cache objects
+ ************************************************************************/
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SLAB_PAGE_SIZE (128*1024)
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH_FACTOR 1.25
+
+struct _SlabArena;
+typedef struct _SlabArena SlabArena;
+
+typedef struct _SlabClassStats {
+    size_t chunk_size;  /* Size of every chunk in the class */
+    int pages;          /* Pages owned by the class */
+    int chunks;         /* Chunks carved from those pages */
+    int used;           /* Chunks handed out */
+    size_t requested;   /* Bytes asked for by the used chunks */
+    size_t waste;       /* used * chunk_size - requested */
+} SlabClassStats;
+
+/*
+ * Called by slab_reassign() for every chunk in use in a page it moves to
+ * another class. The owner of the chunk should drop what it holds, the
+ * chunk is freed whenever its last user is done. Return 1 if it did.
+ */
+typedef int (*SlabEvictFunc)(void* ctx, void* chunk);
+
+SlabArena* slab_create(size_t size);
+SlabArena* slab_create_memfd(size_t size);
+void*      slab_alloc(SlabArena* thiz, size_t size);
+void       slab_free(SlabArena* thiz, void* ptr, size_t size);
+size_t     slab_chunk_size(SlabArena* thiz, size_t size);
+void       slab_set_evict(SlabArena* thiz, SlabEvictFunc evict, void* ctx);
+int        slab_reassign(SlabArena* thiz, size_t size);
+int        slab_fd(SlabArena* thiz, const void* ptr, off_t* offset);
+int        slab_get_stats(SlabArena* thiz, SlabClassStats* stats, int max);
+void       slab_dump_stats(SlabArena* thiz, FILE* fp);
+void       slab_destroy(SlabArena* thiz);
+
+#endif
@@ -0,0 +1,504 @@
+/*************************************************************************
+	> File Name: snapshot.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Cache snapshot files, for warm restarts.
+	>
+	> A snapshot is a header, the key and the content of every object one
+	> after the other, then the index, one fixed size record per object:
+	>
+	>   | header | key data key data ... | record | record | ... |
+	>
+	> It is written to path.tmp and renamed when complete, so a crash never
+	> leaves a torn snapshot behind. It is loaded by mapping the file and
+	> hashing the records, the data is only read when an object is hit.
+ ************************************************************************/
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "typedef.h"
+
+#define SNAPSHOT_MAGIC "PXYSNAP"
+#define SNAPSHOT_VERSION 3
+
+struct snapshot_header {
+    char magic[8];
+    int version;
+    int count;
+    long index_offset;
+    double hit_ratio;    /* Hit ratio of the cache when it was saved */
+};
+
+struct snapshot_record {
+    long key_offset;     /* The key, with its terminator, is before the data */
+    int key_len;
+    unsigned int hash;
+    int len;
+    long offset;
+    struct cache_lifetime life;  /* As last revalidated before the save */
+};
+
+struct _SnapshotWriter
+{
+    char path[256];
+    char tmp[264];
+    int fd;
+    long offset;
+    struct snapshot_record *records;
+    int count;
+    int max;
+};
+
+struct _Snapshot
+{
+    int fd;
+    char *base;
+    size_t size;
+    const struct snapshot_header *header;
+    const struct snapshot_record *records;
+    int *buckets;            /* First record of every bucket, -1 if none */
+    int *next;               /* Next record in the same bucket */
+    unsigned int nbuckets;
+    long bytes;
+};
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+SnapshotWriter* snapshot_writer_create(const char *path)
+{
+    struct snapshot_header header;
+    SnapshotWriter *thiz = calloc(1, sizeof(SnapshotWriter));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    snprintf(thiz->path, sizeof(thiz->path), "%s", path);
+    snprintf(thiz->tmp, sizeof(thiz->tmp), "%s.tmp", path);
+    if ((thiz->fd = open(thiz->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    {
+        fprintf(stderr, "open %s error, %s\n", thiz->tmp, strerror(errno));
+        free(thiz);
+        return NULL;
+    }
+    /* The header is written last, once the index is there */
+    memset(&header, 0, sizeof(header));
+    if (write_all(thiz->fd, (char*)&header, sizeof(header)) < 0)
+    {
+        snapshot_writer_abort(thiz);
+        return NULL;
+    }
+    thiz->offset = sizeof(header);
+
+    return thiz;
+}
+
+/*
+ * snapshot_writer_add - Append an object made of the iovecs.
+ *                       Return 0 if success, or -1 if failed.
+ */
+int snapshot_writer_add(SnapshotWriter *thiz, const char *url,
+                        unsigned int hash, const struct cache_lifetime *life,
+                        const struct iovec *iov, int iovcnt)
+{
+    struct snapshot_record *record;
+    int i, len = 0, key_len = strlen(url);
+
+    return_val_if_fail(thiz != NULL && life != NULL, -1);
+    return_val_if_fail(key_len < MAX_REQUEST, -1);
+
+    if (thiz->count == thiz->max)
+    {
+        i = thiz->max ? thiz->max * 2 : 1024;
+        record = realloc(thiz->records, i * sizeof(struct snapshot_record));
+        if (record == NULL)
+            return -1;
+        thiz->records = record;
+        thiz->max = i;
+    }
+
+    if (write_all(thiz->fd, url, key_len + 1) < 0)
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (write_all(thiz->fd, iov[i].iov_base, iov[i].iov_len) < 0)
+            return -1;
+        len += iov[i].iov_len;
+    }
+
+    record = &thiz->records[thiz->count++];
+    memset(record, 0, sizeof(*record));
+    record->key_offset = thiz->offset;
+    record->key_len = key_len;
+    record->hash = hash;
+    record->len = len;
+    record->offset = thiz->offset + key_len + 1;
+    record->life = *life;
+    thiz->offset = record->offset + len;
+
+    return 0;
+}
+
+int snapshot_writer_count(SnapshotWriter *thiz)
+{
+    return_val_if_fail(thiz != NULL, 0);
+
+    return thiz->count;
+}
+
+/*
+ * snapshot_writer_commit - Write the index and the header, and replace the
+ *                          previous snapshot. Return 0 if success, or -1 if
+ *                          failed. The writer is freed in both cases.
+ */
+int snapshot_writer_commit(SnapshotWriter *thiz, double hit_ratio)
+{
+    struct snapshot_header header;
+
+    return_val_if_fail(thiz != NULL, -1);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.count = thiz->count;
+    header.index_offset = thiz->offset;
+    header.hit_ratio = hit_ratio;
+
+    if (write_all(thiz->fd, (char*)thiz->records,
+                  thiz->count * sizeof(struct snapshot_record)) < 0 ||
+        pwrite(thiz->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fsync(thiz->fd) < 0 || rename(thiz->tmp, thiz->path) < 0)
+    {
+        fprintf(stderr, "write %s error, %s\n", thiz->tmp, strerror(errno));
+        snapshot_writer_abort(thiz);
+        return -1;
+    }
+
+    close(thiz->fd);
+    free(thiz->records);
+    free(thiz);
+    return 0;
+}
+
+void snapshot_writer_abort(SnapshotWriter *thiz)
+{
+    if (thiz != NULL)
+    {
+        close(thiz->fd);
+        unlink(thiz->tmp);
+        free(thiz->records);
+        free(thiz);
+    }
+}
+
+/*
+ * map_snapshot - Map and check the file at path, then hash its records.
+ *                Return 0 if success, or -1 if failed.
+ */
+static int map_snapshot(Snapshot *thiz, const char *path)
+{
+    const struct snapshot_record *r;
+    struct stat st;
+    unsigned int b;
+    int i;
+
+    if ((thiz->fd = open(path, O_RDONLY)) < 0 || fstat(thiz->fd, &st) < 0 ||
+        st.st_size < (off_t)sizeof(struct snapshot_header))
+        return -1;
+    thiz->size = st.st_size;
+    thiz->base = mmap(NULL, thiz->size, PROT_READ, MAP_SHARED, thiz->fd, 0);
+    if (thiz->base == MAP_FAILED)
+        return -1;
+
+    thiz->header = (const struct snapshot_header*)thiz->base;
+    if (memcmp(thiz->header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+        thiz->header->version != SNAPSHOT_VERSION ||
+        thiz->header->count < 0 ||
+        thiz->header->index_offset < (long)sizeof(struct snapshot_header) ||
+        thiz->header->index_offset +
+        thiz->header->count * (long)sizeof(struct snapshot_record) >
+        (long)thiz->size)
+    {
+        fprintf(stderr, "%s is not a valid snapshot\n", path);
+        return -1;
+    }
+    thiz->records = (const struct snapshot_record*)
+                    (thiz->base + thiz->header->index_offset);
+
+    for (thiz->nbuckets = 1024;
+         thiz->nbuckets < (unsigned int)thiz->header->count;
+         thiz->nbuckets *= 2)
+        ;
+    thiz->buckets = malloc(thiz->nbuckets * sizeof(int));
+    thiz->next = malloc((thiz->header->count + 1) * sizeof(int));
+    if (thiz->buckets == NULL || thiz->next == NULL)
+        return -1;
+    for (b = 0; b < thiz->nbuckets; b++)
+        thiz->buckets[b] = -1;
+    for (i = 0; i < thiz->header->count; i++)
+    {
+        /* Skip records pointing out of the data */
+        r = &thiz->records[i];
+        if (r->len <= 0 || r->key_len < 0 ||
+            r->key_offset < (long)sizeof(struct snapshot_header) ||
+            r->key_offset + r->key_len >= r->offset ||
+            thiz->base[r->key_offset + r->key_len] != '\0' ||
+            r->offset + r->len > thiz->header->index_offset)
+            continue;
+        b = thiz->records[i].hash & (thiz->nbuckets - 1);
+        thiz->next[i] = thiz->buckets[b];
+        thiz->buckets[b] = i;
+        thiz->bytes += thiz->records[i].len;
+    }
+
+    return 0;
+}
+
+/*
+ * snapshot_open - Map the snapshot at path and index its objects. Return
+ *                 NULL if there is none or it is not valid.
+ */
+Snapshot* snapshot_open(const char *path)
+{
+    Snapshot *thiz = calloc(1, sizeof(Snapshot));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    thiz->fd = -1;
+    thiz->base = MAP_FAILED;
+    if (map_snapshot(thiz, path) < 0)
+    {
+        snapshot_close(thiz);
+        return NULL;
+    }
+
+    return thiz;
+}
+
+/*
+ * snapshot_lookup - Find the object of url in the snapshot. Return 0 and set
+ *                   data, len and life if found, or -1 if not. The index
+ *                   is never modified, so it needs no lock.
+ */
+int snapshot_lookup(Snapshot *thiz, const char *url, unsigned int hash,
+                    const char **data, int *len, struct cache_lifetime *life)
+{
+    int i;
+
+    return_val_if_fail(thiz != NULL, -1);
+
+    for (i = thiz->buckets[hash & (thiz->nbuckets - 1)]; i >= 0; i = thiz->next[i])
+    {
+        if (thiz->records[i].hash == hash &&
+            !strcmp(thiz->base + thiz->records[i].key_offset, url))
+        {
+            *data = thiz->base + thiz->records[i].offset;
+            *len = thiz->records[i].len;
+            *life = thiz->records[i].life;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * snapshot_fd - Return the file descriptor of the snapshot, and set offset
+ *               to the file offset of data.
+ */
+int snapshot_fd(Snapshot *thiz, const char *data, off_t *offset)
+{
+    *offset = data - thiz->base;
+    return thiz->fd;
+}
+
+/*
+ * snapshot_foreach - Call visit for every object of the snapshot.
+ */
+void snapshot_foreach(Snapshot *thiz, SnapshotVisitFunc visit, void *ctx)
+{
+    unsigned int b;
+    int i;
+    const struct snapshot_record *r;
+
+    return_if_fail(thiz != NULL && visit != NULL);
+
+    for (b = 0; b < thiz->nbuckets; b++)
+    {
+        for (i = thiz->buckets[b]; i >= 0; i = thiz->next[i])
+        {
+            r = &thiz->records[i];
+            visit(ctx, thiz->base + r->key_offset, r->hash, &r->life,
+                  thiz->base + r->offset, r->len);
+        }
+    }
+}
+
+/*
+ * snapshot_purge - Unlink the records match selects from the index, so
+ *                  they are never found again. Lookups don't lock: a
+ *                  lookup on an unlinked record still finds the next one.
+ *                  The caller serializes the purges. Return the number of
+ *                  objects purged.
+ */
+int snapshot_purge(Snapshot *thiz, SnapshotMatchFunc match, void *ctx)
+{
+    unsigned int b;
+    int i, *link, purged = 0;
+    const struct snapshot_record *r;
+
+    return_val_if_fail(thiz != NULL && match != NULL, 0);
+
+    for (b = 0; b < thiz->nbuckets; b++)
+    {
+        link = &thiz->buckets[b];
+        while ((i = *link) >= 0)
+        {
+            r = &thiz->records[i];
+            if (match(ctx, thiz->base + r->key_offset,
+                      thiz->base + r->offset, r->len))
+            {
+                __atomic_store_n(link, thiz->next[i], __ATOMIC_RELEASE);
+                thiz->bytes -= r->len;
+                purged++;
+            }
+            else
+            {
+                link = &thiz->next[i];
+            }
+        }
+    }
+    return purged;
+}
+
+int snapshot_count(Snapshot *thiz)
+{
+    return_val_if_fail(thiz != NULL, 0);
+
+    return thiz->header->count;
+}
+
+long snapshot_bytes(Snapshot *thiz)
+{
+    return_val_if_fail(thiz != NULL, 0);
+
+    return thiz->bytes;
+}
+
+double snapshot_hit_ratio(Snapshot *thiz)
+{
+    return_val_if_fail(thiz != NULL, 0);
+
+    return thiz->header->hit_ratio;
+}
+
+void snapshot_close(Snapshot *thiz)
+{
+    if (thiz != NULL)
+    {
+        if (thiz->base != MAP_FAILED)
+            munmap(thiz->base, thiz->size);
+        if (thiz->fd >= 0)
+            close(thiz->fd);
+        free(thiz->buckets);
+        free(thiz->next);
+        free(thiz);
+    }
+}
+
+#ifdef SNAPSHOT_TEST
+
+#include <assert.h>
+
+/* Keys are stored at their length, some are long */
+static void make_url(char *url, int i)
+{
+    sprintf(url, "http://snap.test/%d?%0*d", i, i % 7 ? 1 : 1500, 0);
+}
+
+static void snapshot_save_load_test(void)
+{
+    const char *path = "/tmp/snapshot_test";
+    char url[MAX_REQUEST];
+    char buf[1000];
+    const char *data;
+    struct iovec iov[2];
+    struct cache_lifetime life = { 0, 0, 0 };
+    off_t offset;
+    int i, len;
+    Snapshot *snap;
+    SnapshotWriter *writer = snapshot_writer_create(path);
+
+    assert(writer != NULL);
+    for (i = 0; i < 3000; i++)
+    {
+        make_url(url, i);
+        memset(buf, i % 256, sizeof(buf));
+        iov[0].iov_base = url;
+        iov[0].iov_len = strlen(url);
+        iov[1].iov_base = buf;
+        iov[1].iov_len = i % sizeof(buf);
+        life.expires = 1000 + i;
+        assert(0 == snapshot_writer_add(writer, url, cache_hash(url), &life,
+                                        iov, 2));
+    }
+    assert(snapshot_writer_count(writer) == 3000);
+    assert(0 == snapshot_writer_commit(writer, 0.5));
+
+    snap = snapshot_open(path);
+    assert(snap != NULL && snapshot_count(snap) == 3000);
+    assert(snapshot_hit_ratio(snap) == 0.5);
+    for (i = 0; i < 3000; i++)
+    {
+        make_url(url, i);
+        assert(0 == snapshot_lookup(snap, url, cache_hash(url), &data, &len,
+                                    &life));
+        assert(len == (int)(strlen(url) + i % sizeof(buf)));
+        assert(life.expires == 1000 + i);
+        assert(!memcmp(data, url, strlen(url)));
+        assert(len == (int)strlen(url) || (unsigned char)data[len - 1] == i % 256);
+    }
+    assert(-1 == snapshot_lookup(snap, "http://snap.test/x",
+                                 cache_hash("http://snap.test/x"), &data, &len,
+                                 &life));
+    make_url(url, 7);
+    snapshot_lookup(snap, url, cache_hash(url), &data, &len, &life);
+    i = snapshot_fd(snap, data, &offset);
+    assert(pread(i, buf, 17, offset) == 17);
+    assert(!memcmp(buf, "http://snap.test/7", 17));
+    snapshot_close(snap);
+
+    /* A truncated file is refused */
+    assert(truncate(path, 100) == 0);
+    assert(snapshot_open(path) == NULL);
+    unlink(path);
+}
+
+int main(int argc, char* argv[])
+{
+    snapshot_save_load_test();
+    return 0;
+}
+#endif
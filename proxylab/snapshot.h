@@ -0,0 +1,51 @@
+/*************************************************************************
+	> File Name: snapshot.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Cache snapshot files, for warm restarts
+ ************************************************************************/
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+
+struct _SnapshotWriter;
+typedef struct _SnapshotWriter SnapshotWriter;
+
+struct _Snapshot;
+typedef struct _Snapshot Snapshot;
+
+typedef void (*SnapshotVisitFunc)(void *ctx, const char *url,
+                                  unsigned int hash,
+                                  const struct cache_lifetime *life,
+                                  const char *data, int len);
+/* Return 1 if the object of url, of len bytes at data, must be purged */
+typedef int (*SnapshotMatchFunc)(void *ctx, const char *url, const char *data,
+                                 int len);
+
+SnapshotWriter* snapshot_writer_create(const char *path);
+int             snapshot_writer_add(SnapshotWriter *thiz, const char *url,
+                                    unsigned int hash,
+                                    const struct cache_lifetime *life,
+                                    const struct iovec *iov, int iovcnt);
+int             snapshot_writer_count(SnapshotWriter *thiz);
+int             snapshot_writer_commit(SnapshotWriter *thiz, double hit_ratio);
+void            snapshot_writer_abort(SnapshotWriter *thiz);
+
+Snapshot*   snapshot_open(const char *path);
+int         snapshot_lookup(Snapshot *thiz, const char *url, unsigned int hash,
+                            const char **data, int *len,
+                            struct cache_lifetime *life);
+int         snapshot_fd(Snapshot *thiz, const char *data, off_t *offset);
+void        snapshot_foreach(Snapshot *thiz, SnapshotVisitFunc visit, void *ctx);
+int         snapshot_purge(Snapshot *thiz, SnapshotMatchFunc match, void *ctx);
+int         snapshot_count(Snapshot *thiz);
+long        snapshot_bytes(Snapshot *thiz);
+double      snapshot_hit_ratio(Snapshot *thiz);
+void        snapshot_close(Snapshot *thiz);
+
+#endif
@@ -0,0 +1,397 @@
+/*************************************************************************
+	> File Name: trie.c
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Radix tree of the cache keys, for prefix purges.
+	>
+	> Every edge holds a run of key bytes, and no node but the root has a
+	> single child and no value: nodes are split when a key diverges in
+	> the middle of an edge, and merged back when a removal leaves such a
+	> node. Finding the keys of a prefix walks the length of the prefix,
+	> then the subtree below it only. The tree is not locked, the caller
+	> serializes the accesses.
+ ************************************************************************/
+#include "trie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "typedef.h"
+
+struct trie_node {
+    char *label;               /* Edge from the parent, not terminated */
+    int len;
+    void *value;               /* Non NULL if a key ends here */
+    struct trie_node *child;   /* First child */
+    struct trie_node *next;    /* Next sibling */
+};
+
+struct _KeyTrie
+{
+    struct trie_node root;     /* Empty label, never removed */
+    int count;
+};
+
+static struct trie_node *make_node(const char *label, int len)
+{
+    struct trie_node *node = calloc(1, sizeof(struct trie_node));
+
+    return_val_if_fail(node != NULL, NULL);
+
+    if ((node->label = malloc(len ? len : 1)) == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->len = len;
+    return node;
+}
+
+static void free_node(struct trie_node *node)
+{
+    free(node->label);
+    free(node);
+}
+
+/*
+ * common_prefix - return the length of the common prefix of the label of
+ *                 len bytes and the string key.
+ */
+static int common_prefix(const char *label, int len, const char *key)
+{
+    int i;
+
+    for (i = 0; i < len && key[i] && label[i] == key[i]; i++)
+        ;
+    return i;
+}
+
+/*
+ * find_link - return the link to the child of node whose label starts with
+ *             c, or NULL if there is none.
+ */
+static struct trie_node **find_link(struct trie_node *node, char c)
+{
+    struct trie_node **link;
+
+    for (link = &node->child; *link; link = &(*link)->next)
+    {
+        if ((*link)->label[0] == c)
+            return link;
+    }
+    return NULL;
+}
+
+KeyTrie* trie_create(void)
+{
+    KeyTrie *thiz = calloc(1, sizeof(KeyTrie));
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    return thiz;
+}
+
+/*
+ * trie_insert - Set the value of key, a previous one is replaced. Return 0
+ *               if success, or -1 if out of memory.
+ */
+int trie_insert(KeyTrie* thiz, const char *key, void *value)
+{
+    struct trie_node *node, **link, *child, *split;
+    int n;
+
+    return_val_if_fail(thiz != NULL && value != NULL &&
+                       strlen(key) < TRIE_MAX_KEY, -1);
+
+    for (node = &thiz->root; *key; node = child, key += n)
+    {
+        if ((link = find_link(node, *key)) == NULL)
+        {
+            /* The rest of the key is a new leaf */
+            if ((child = make_node(key, strlen(key))) == NULL)
+                return -1;
+            child->next = node->child;
+            node->child = child;
+            n = child->len;
+            continue;
+        }
+        child = *link;
+        n = common_prefix(child->label, child->len, key);
+        if (n < child->len)
+        {
+            /* The key leaves the edge in its middle, split it there */
+            if ((split = make_node(child->label, n)) == NULL)
+                return -1;
+            memmove(child->label, child->label + n, child->len - n);
+            child->len -= n;
+            split->next = child->next;
+            split->child = child;
+            child->next = NULL;
+            *link = split;
+            child = split;
+        }
+    }
+
+    if (node->value == NULL)
+        thiz->count++;
+    node->value = value;
+    return 0;
+}
+
+/*
+ * prune - The node at link lost its value or a child. Remove it if it is
+ *         useless, or merge it with its only child.
+ */
+static void prune(struct trie_node **link)
+{
+    struct trie_node *node = *link, *child = node->child;
+    char *label;
+
+    if (node->value)
+        return;
+    if (child == NULL)
+    {
+        *link = node->next;
+        free_node(node);
+        return;
+    }
+    if (child->next || (label = malloc(node->len + child->len)) == NULL)
+        return;
+    memcpy(label, node->label, node->len);
+    memcpy(label + node->len, child->label, child->len);
+    free(child->label);
+    child->label = label;
+    child->len += node->len;
+    child->next = node->next;
+    *link = child;
+    free_node(node);
+}
+
+/*
+ * remove_below - Remove key, relative to node. Return its value, or NULL if
+ *                not found.
+ */
+static void *remove_below(struct trie_node *node, const char *key)
+{
+    struct trie_node **link, *child;
+    void *value;
+
+    if (*key == '\0')
+    {
+        value = node->value;
+        node->value = NULL;
+        return value;
+    }
+    if ((link = find_link(node, *key)) == NULL)
+        return NULL;
+    child = *link;
+    if (common_prefix(child->label, child->len, key) < child->len)
+        return NULL;
+    if ((value = remove_below(child, key + child->len)) != NULL)
+        prune(link);
+    return value;
+}
+
+/*
+ * trie_remove - Remove key. Return its value, or NULL if not found.
+ */
+void* trie_remove(KeyTrie* thiz, const char *key)
+{
+    void *value;
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    if ((value = remove_below(&thiz->root, key)) != NULL)
+        thiz->count--;
+    return value;
+}
+
+/*
+ * trie_find - return the value of key, or NULL if not found.
+ */
+void* trie_find(KeyTrie* thiz, const char *key)
+{
+    struct trie_node *node, **link;
+
+    return_val_if_fail(thiz != NULL, NULL);
+
+    for (node = &thiz->root; *key; node = *link, key += node->len)
+    {
+        if ((link = find_link(node, *key)) == NULL ||
+            common_prefix((*link)->label, (*link)->len, key) < (*link)->len)
+            return NULL;
+    }
+    return node->value;
+}
+
+/*
+ * visit_below - Call visit for every key of the subtree of node, whose key
+ *               is the first len bytes of key. Return the number of keys.
+ */
+static int visit_below(struct trie_node *node, char *key, int len,
+                       TrieVisitFunc visit, void *ctx)
+{
+    struct trie_node *child;
+    int count = 0;
+
+    if (node->value)
+    {
+        key[len] = '\0';
+        visit(ctx, key, node->value);
+        count++;
+    }
+    for (child = node->child; child; child = child->next)
+    {
+        memcpy(key + len, child->label, child->len);
+        count += visit_below(child, key, len + child->len, visit, ctx);
+    }
+    return count;
+}
+
+/*
+ * trie_prefix - Call visit for every key starting with prefix. visit must
+ *               not change the tree. Return the number of keys.
+ */
+int trie_prefix(KeyTrie* thiz, const char *prefix, TrieVisitFunc visit,
+                void *ctx)
+{
+    char key[TRIE_MAX_KEY];
+    struct trie_node *node, **link;
+    int len = 0, n;
+
+    return_val_if_fail(thiz != NULL && visit != NULL, 0);
+
+    /* The prefix may end in the middle of the last edge */
+    for (node = &thiz->root; *prefix; node = *link, prefix += n)
+    {
+        if ((link = find_link(node, *prefix)) == NULL)
+            return 0;
+        n = common_prefix((*link)->label, (*link)->len, prefix);
+        if (n < (*link)->len && prefix[n])
+            return 0;
+        memcpy(key + len, (*link)->label, (*link)->len);
+        len += (*link)->len;
+    }
+    return visit_below(node, key, len, visit, ctx);
+}
+
+int trie_count(KeyTrie* thiz)
+{
+    return_val_if_fail(thiz != NULL, 0);
+
+    return thiz->count;
+}
+
+static void destroy_below(struct trie_node *node)
+{
+    struct trie_node *child, *next;
+
+    for (child = node->child; child; child = next)
+    {
+        next = child->next;
+        destroy_below(child);
+        free_node(child);
+    }
+}
+
+void trie_destroy(KeyTrie* thiz)
+{
+    if (thiz != NULL)
+    {
+        destroy_below(&thiz->root);
+        free(thiz);
+    }
+}
+
+#ifdef TRIE_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+#define KEYS 5000
+
+static void count_key(void *ctx, const char *key, void *value)
+{
+    assert(strcmp(key, value) == 0);
+    (*(int*)ctx)++;
+}
+
+static void trie_prefix_test(void)
+{
+    KeyTrie *trie = trie_create();
+    int n = 0;
+
+    assert(0 == trie_insert(trie, "http://a.test/img/1", "http://a.test/img/1"));
+    assert(0 == trie_insert(trie, "http://a.test/img/2", "http://a.test/img/2"));
+    assert(0 == trie_insert(trie, "http://a.test/i", "http://a.test/i"));
+    assert(0 == trie_insert(trie, "http://b.test/", "http://b.test/"));
+    assert(trie_count(trie) == 4);
+
+    assert(trie_prefix(trie, "http://a.test/img/", count_key, &n) == 2 && n == 2);
+    /* A prefix ending in the middle of an edge */
+    assert(trie_prefix(trie, "http://a.test/im", count_key, &n) == 2);
+    assert(trie_prefix(trie, "http://a.test/", count_key, &n) == 3);
+    assert(trie_prefix(trie, "http://", count_key, &n) == 4);
+    assert(trie_prefix(trie, "http://c", count_key, &n) == 0);
+    assert(trie_prefix(trie, "http://a.test/img/3", count_key, &n) == 0);
+
+    assert(trie_find(trie, "http://a.test/i") != NULL);
+    assert(trie_find(trie, "http://a.test/im") == NULL);
+    assert(trie_remove(trie, "http://a.test/im") == NULL);
+    assert(trie_remove(trie, "http://a.test/i") != NULL);
+    assert(trie_find(trie, "http://a.test/img/1") != NULL);
+    assert(trie_count(trie) == 3);
+    trie_destroy(trie);
+}
+
+static void trie_random_test(void)
+{
+    static char keys[KEYS][32];
+    static int present[KEYS];
+    KeyTrie *trie = trie_create();
+    int i, j, n, count = 0;
+
+    srand(7);
+    for (i = 0; i < KEYS; i++)
+        sprintf(keys[i], "http://h%d.test/%d/%d", rand() % 8, rand() % 50, i);
+
+    for (j = 0; j < 20 * KEYS; j++)
+    {
+        i = rand() % KEYS;
+        if (rand() % 2)
+        {
+            assert(0 == trie_insert(trie, keys[i], keys[i]));
+            present[i] = 1;
+        }
+        else
+        {
+            assert((trie_remove(trie, keys[i]) != NULL) == present[i]);
+            present[i] = 0;
+        }
+    }
+    for (i = 0; i < KEYS; i++)
+    {
+        assert((trie_find(trie, keys[i]) != NULL) == present[i]);
+        count += present[i] && !strncmp(keys[i], "http://h3.test/", 15);
+    }
+    n = 0;
+    assert(trie_prefix(trie, "", count_key, &n) == trie_count(trie));
+    n = 0;
+    trie_prefix(trie, "http://h3.test/", count_key, &n);
+    assert(n == count);
+
+    for (i = 0; i < KEYS; i++)
+        trie_remove(trie, keys[i]);
+    assert(trie_count(trie) == 0);
+    trie_destroy(trie);
+}
+
+int main(int argc, char* argv[])
+{
+    trie_prefix_test();
+    trie_random_test();
+    printf("trie test passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,28 @@
+/*************************************************************************
+	> File Name: trie.h
+	> Author: ye xuefeng
+	> Mail: yexuefeng_coder@outlook.com
+	> Brief: Radix tree of the cache keys, for prefix purges
+ ************************************************************************/
+
+#ifndef _TRIE_H
+#define _TRIE_H
+
+/* Longest key of the tree */
+#define TRIE_MAX_KEY 4096
+
+struct _KeyTrie;
+typedef struct _KeyTrie KeyTrie;
+
+typedef void (*TrieVisitFunc)(void *ctx, const char *key, void *value);
+
+KeyTrie* trie_create(void);
+int      trie_insert(KeyTrie* thiz, const char *key, void *value);
+void*    trie_remove(KeyTrie* thiz, const char *key);
+void*    trie_find(KeyTrie* thiz, const char *key);
+int      trie_prefix(KeyTrie* thiz, const char *prefix, TrieVisitFunc visit,
+                     void *ctx);
+int      trie_count(KeyTrie* thiz);
+void     trie_destroy(KeyTrie* thiz);
+
+#endif